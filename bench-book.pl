@@ -0,0 +1,47 @@
+#! /usr/bin/perl
+#
+# Benchmarks booklook on every position reached along the lines in the given
+# files (pv-benchmark.txt if none), which have UCI moves from the start
+# position, one line per line of play. To benchmark on a list of FENs
+# instead, use booklook --bench directly.
+#
+# Usage: ./bench-book.pl [--book NAME | --index FILE] [--cache ENTRIES] [--cold] [FILE...]
+#
+use strict;
+use warnings;
+require 'Position.pm';
+
+my @book_args = ();
+my @bench_args = ();
+while (scalar @ARGV > 0 && $ARGV[0] =~ /^--/) {
+	my $opt = shift @ARGV;
+	if ($opt eq '--cold') {
+		push @bench_args, $opt;
+	} elsif ($opt eq '--book' || $opt eq '--index' || $opt eq '--cache') {
+		push @book_args, $opt, shift @ARGV;
+	} else {
+		die "Unknown option $opt\n";
+	}
+}
+@ARGV = ('pv-benchmark.txt') if (scalar @ARGV == 0);
+
+my %seen = ();
+my @fens = ();
+while (<>) {
+	my $pos = Position->start_pos('NN', 'NN');
+	for my $move (split ' ', $_) {
+		$pos = $pos->apply_uci_pv($move);
+
+		# booklook doesn't care about the clocks
+		my $fen = join(' ', (split / /, $pos->fen())[0..3]);
+		push @fens, $fen if (!$seen{$fen}++);
+	}
+}
+
+open my $booklook, '|-', './booklook', @book_args, '--bench', @bench_args
+	or die "./booklook: $!";
+for my $fen (@fens) {
+	print $booklook "$fen\n";
+}
+close $booklook
+	or die "booklook failed";
@@ -1,15 +1,68 @@
 #! /usr/bin/perl
+#
+# Benchmarks PV pretty-printing on the lines in the given files (typically
+# pv-benchmark.txt), which have UCI moves from the start position. Each line
+# is done first in Perl (Board.pm) and then by the prettyprint server
+# (./prettyprint --server, if it's built), the same way remoteglot.pl does;
+# the Perl output goes to stdout, and the timings and any lines where the
+# two disagree go to stderr.
+#
 use strict;
 use warnings;
+use IPC::Open2;
+use Time::HiRes;
 require 'Position.pm';
 
 my $pos = Position->start_pos('NN', 'NN');
+my @lines = ();
 while (<>) {
 	chomp;
-	my @pvs = split / /, $_;
-	print join(' ', prettyprint_pv_no_cache($pos->{'board'}, @pvs)), "\n";
+	push @lines, [ split / /, $_ ];
 }
 
+my @perl_output = ();
+my $start = [Time::HiRes::gettimeofday];
+for my $pvs (@lines) {
+	push @perl_output, join(' ', prettyprint_pv_no_cache($pos->{'board'}, @$pvs));
+}
+my $perl_elapsed = Time::HiRes::tv_interval($start);
+print "$_\n" for (@perl_output);
+printf STDERR "Perl:   %8.2f ms\n", 1e3 * $perl_elapsed;
+
+if (! -x './prettyprint') {
+	print STDERR "./prettyprint not built; skipping the native version\n";
+	exit 0;
+}
+
+my ($read, $write);
+my $pid = IPC::Open2::open2($read, $write, './prettyprint', '--server');
+
+my $mismatches = 0;
+$start = [Time::HiRes::gettimeofday];
+for my $i (0..$#lines) {
+	print $write join(' ', $i, $pos->{'board'}->fen(), @{$lines[$i]}), "\n";
+
+	my $pretty;
+	while (my $line = <$read>) {
+		chomp $line;
+		last if ($line =~ /^end /);
+		$pretty = $line;
+	}
+	if (!defined($pretty) || $pretty ne $perl_output[$i]) {
+		print STDERR "Mismatch on line ", $i + 1, ":\n";
+		print STDERR "  Perl:   $perl_output[$i]\n";
+		print STDERR "  native: ", ($pretty // '(error)'), "\n";
+		++$mismatches;
+	}
+}
+my $native_elapsed = Time::HiRes::tv_interval($start);
+close($write);
+waitpid($pid, 0);
+
+printf STDERR "native: %8.2f ms (%.1fx faster)\n", 1e3 * $native_elapsed, $perl_elapsed / $native_elapsed;
+printf STDERR "%d of %d lines differ\n", $mismatches, scalar @lines;
+exit($mismatches == 0 ? 0 : 1);
+
 sub prettyprint_pv_no_cache {
 	my ($board, @pvs) = @_;
 
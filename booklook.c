@@ -1,999 +1,665 @@
+// Command-line interface to libbooklook. Build with
+//
+//   gcc -O2 -o booklook booklook.c libbooklook.c
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <fcntl.h>
-
-#define DUMP_FEN 0
-#define DUMP_ENC 0
-
-int cto_fd, ctg_fd, ctb_fd;
-
-unsigned int tbl2[] = {
-	0x3100d2bf, 0x3118e3de, 0x34ab1372, 0x2807a847,
-	0x1633f566, 0x2143b359, 0x26d56488, 0x3b9e6f59,
-	0x37755656, 0x3089ca7b, 0x18e92d85, 0x0cd0e9d8,
-	0x1a9e3b54, 0x3eaa902f, 0x0d9bfaae, 0x2f32b45b,
-	0x31ed6102, 0x3d3c8398, 0x146660e3, 0x0f8d4b76,
-	0x02c77a5f, 0x146c8799, 0x1c47f51f, 0x249f8f36,
-	0x24772043, 0x1fbc1e4d, 0x1e86b3fa, 0x37df36a6,
-	0x16ed30e4, 0x02c3148e, 0x216e5929, 0x0636b34e,
-	0x317f9f56, 0x15f09d70, 0x131026fb, 0x38c784b1,
-	0x29ac3305, 0x2b485dc5, 0x3c049ddc, 0x35a9fbcd,
-	0x31d5373b, 0x2b246799, 0x0a2923d3, 0x08a96e9d,
-	0x30031a9f, 0x08f525b5, 0x33611c06, 0x2409db98,
-	0x0ca4feb2, 0x1000b71e, 0x30566e32, 0x39447d31,
-	0x194e3752, 0x08233a95, 0x0f38fe36, 0x29c7cd57,
-	0x0f7b3a39, 0x328e8a16, 0x1e7d1388, 0x0fba78f5,
-	0x274c7e7c, 0x1e8be65c, 0x2fa0b0bb, 0x1eb6c371
-};
-
-signed char data[] = {
-	0x36, 0xb6, 0x0f, 0x79, 0x61, 0x1f, 0x50, 0xde, 0x61, 0xb9, 0x52, 0x24, 0xb3, 0xac, 0x6e, 0x5e, 0x0a, 0x69, 0xbd, 0x61, 0x61, 0xc5
-};
-
-void output_stats(char *result, int invert)
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#include "booklook.h"
+
+// We always output from white's point of view, so <swap> must be set
+// if it is black to move in the position the stats belong to.
+void output_stats(struct book_stats *stats, int swap)
 {
-	unsigned char *ptr = result;
-	ptr += *ptr;
-	ptr += 3;
-
 	// wins-draw-loss
-	if (invert) {
-		printf("%u,", (ptr[0] << 16) | (ptr[1] << 8) | ptr[2]);
-		printf("%u,", (ptr[6] << 16) | (ptr[7] << 8) | ptr[8]);
-		printf("%u,", (ptr[3] << 16) | (ptr[4] << 8) | ptr[5]);
+	if (swap) {
+		printf("%u,%u,%u,", stats->losses, stats->draws, stats->wins);
 	} else {
-		printf("%u,", (ptr[3] << 16) | (ptr[4] << 8) | ptr[5]);
-		printf("%u,", (ptr[6] << 16) | (ptr[7] << 8) | ptr[8]);
-		printf("%u,", (ptr[0] << 16) | (ptr[1] << 8) | ptr[2]);
+		printf("%u,%u,%u,", stats->wins, stats->draws, stats->losses);
 	}
 
-	ptr += 9;
-	ptr += 4;
-	ptr += 7;
-
 	// rating
-	{
-		int rat2_sum, rat2_div;
-		rat2_div = (ptr[0] << 16) | (ptr[1] << 8) | ptr[2];
-		rat2_sum = (ptr[3] << 24) | (ptr[4] << 16) | (ptr[5] << 8) | ptr[6];
-
-		if (rat2_div == 0) {
-			printf(",0");
-		} else {
-			printf("%u,%u", rat2_sum / rat2_div, rat2_div);
-		}
+	if (stats->rating_div == 0) {
+		printf(",0");
+	} else {
+		printf("%u,%u", stats->rating, stats->rating_div);
 	}
 		
 	printf("\n");
 }
 
-unsigned int gen_hash(signed char *ptr, unsigned len)
+void output_annotation(unsigned char annotation)
 {
-	signed hash = 0;
-	short tmp = 0;
-	int i;
-
-	for (i = 0; i < len; ++i) {
-		signed char ch = *ptr++;
-		tmp += ((0x0f - (ch & 0x0f)) << 2) + 1;
-		hash += tbl2[tmp & 0x3f];
-		tmp += ((0xf0 - (ch & 0xf0)) >> 2) + 1;
-		hash += tbl2[tmp & 0x3f];
+	switch (annotation) {
+	case 0x00:
+		break;
+	case 0x01:
+		printf("!");
+		break;
+	case 0x02:
+		printf("?");
+		break;
+	case 0x03:
+		printf("!!");
+		break;
+	case 0x04:
+		printf("??");
+		break;
+	case 0x05:
+		printf("!?");
+		break;
+	case 0x06:
+		printf("?!");
+		break;
+	case 0x08:
+		printf(" (only move)");
+		break;
+	case 0x16:
+		printf(" (zugzwang)");
+		break;
+	default:
+		printf(" (unknown status 0x%02x)", annotation);
 	}
-	return hash;
 }
 
-void decode_fen_board(char *str, char *board)
+// Outputs the entry in terms of the position that was looked up. If
+// <list_children> is set, also outputs the key and FEN of the position
+// after each move (used by the workers in dump_book()).
+void output_entry(struct book_entry *entry, int list_children)
 {
-	while (*str) {
-		switch (*str) {
-		case 'r':
-		case 'n':
-		case 'b':
-		case 'q':
-		case 'k':
-		case 'p':
-		case 'R':
-		case 'N':
-		case 'B':
-		case 'Q':
-		case 'K':
-		case 'P':
-			*board++ = *str;
-			break;
-		case '8':
-			*board++ = ' ';
-			// fall through
-		case '7':
-			*board++ = ' ';
-			// fall through
-		case '6':
-			*board++ = ' ';
-			// fall through
-		case '5':
-			*board++ = ' ';
-			// fall through
-		case '4':
-			*board++ = ' ';
-			// fall through
-		case '3':
-			*board++ = ' ';
-			// fall through
-		case '2':
-			*board++ = ' ';
-			// fall through
-		case '1':
-			*board++ = ' ';
-			break;
-		case '/':
-			// ignore
-			break;
-		default:
-			fprintf(stderr, "Unknown FEN board character '%c'\n", *str);
-			exit(1);
-		}
+	int invert = entry->invert, flip = entry->flip;
+	int i;
 
-		++str;
-	}
-}
+	printf(",,");
+	output_stats(&entry->stats, invert);
 
-void invert_board(char *board)
-{
-	int y, x, i;
-
-	// flip the board
-	for (y = 0; y < 4; ++y) {
-		for (x = 0; x < 8; ++x) {
-			char tmp = board[y * 8 + (x)];
-			board[y * 8 + (x)] = board[(7-y) * 8 + (x)];
-			board[(7-y) * 8 + (x)] = tmp;
-		}
-	}
+	for (i = 0; i < entry->num_moves; ++i) {
+		struct book_move *move = &entry->moves[i];
+		int fromcol = move->from_square % 8;
+		int fromrow = move->from_square / 8;
+		int tocol = move->to_square % 8;
+		int torow = move->to_square / 8;
 
-	// invert the colors
-	for (y = 0; y < 8; ++y) {
-		for (x = 0; x < 8; ++x) {
-			if (board[y * 8 + x] == toupper(board[y * 8 + x])) {
-				board[y * 8 + x] = tolower(board[y * 8 + x]);
-			} else {
-				board[y * 8 + x] = toupper(board[y * 8 + x]);
-			}
+		if (invert) {
+			fromrow = 7 - fromrow;
+			torow = 7 - torow;
+		}
+		if (flip) {
+			fromcol = 7 - fromcol;
+			tocol = 7 - tocol;
 		}
-	}
-}
 
-int needs_flipping(char *board, char *castling_rights)
-{
-	int y, x;
+		printf("%c%u%c%u,",
+			"abcdefgh"[fromcol], fromrow + 1,
+			"abcdefgh"[tocol], torow + 1);
+		output_annotation(move->annotation);
+		printf(",");
 
-	// never flip if either side can castle
-	if (strcmp(castling_rights, "-") != 0)
-		return 0;
+		// the side to move after the move is the other one
+		output_stats(&move->stats, !invert);
 
-	for (y = 0; y < 8; ++y) {
-		for (x = 0; x < 4; ++x) {
-			if (board[y * 8 + x] == 'K')
-				return 1;
+		if (list_children) {
+			int j;
+			printf("> ");
+			for (j = 0; j < move->child_key_len; ++j)
+				printf("%02x", move->child_key[j]);
+			printf(" %s\n", move->child_fen);
 		}
 	}
+}
 
-	return 0;
+// Looks up the given position, and prints out the book information for it.
+// Returns 1 if the position was found, 0 if not, and -1 on error.
+int lookup_and_output(struct book *book, struct book_query *q, char *fen_board, char *toplay, char *castling_rights, char *ep_square)
+{
+	struct book_entry entry;
+	int ret = book_lookup(book, q, fen_board, toplay, castling_rights, ep_square, &entry);
+
+	if (ret == -1)
+		fprintf(stderr, "ERROR: %s\n", q->error);
+	if (ret == 1)
+		output_entry(&entry, q->list_children);
+	return ret;
 }
 
-// horizontal flip
-void flip_board(char *board, char *eps)
+// Server mode, so that the caller doesn't have to start a new process
+// (and open the book files again) for every position. Reads one request
+// per line, of the form
+//
+//   <id> <board> <toplay> <castling> <ep> [...]
+//
+// where <id> is an arbitrary token chosen by the client and the rest is
+// a FEN (the clock fields are ignored). The response is the same lines
+// we'd output in normal mode, followed by a line
+//
+//   end <id> <status> <probes> <pages>
+//
+// where <status> is "found", "notfound" or "error". Output preceding
+// an error may be incomplete and should be thrown away. <probes> and
+// <pages> are the number of CTO entries and CTG pages we had to look at
+// to answer the request (including the positions after each book move);
+// with an index file, <probes> is the number of index records instead.
+// Both are zero if the answer came from the cache.
+//
+// The request "<id> stats" instead gives a line
+//
+//   cache <hits> <misses> <evictions> <entries> <capacity>
+//
+// followed by the end line (with status "error" if there is no cache).
+void serve(struct book *book, FILE *in, int list_children)
 {
-	int y, x;
-
-	// flip the board
-	for (y = 0; y < 8; ++y) {
-		for (x = 0; x < 4; ++x) {
-			char tmp = board[y * 8 + x];
-			board[y * 8 + (x)] = board[y * 8 + (7-x)];
-			board[y * 8 + (7-x)] = tmp;
+	struct book_query q;
+	char line[1024];
+
+	memset(&q, 0, sizeof(q));
+	q.list_children = list_children;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char id[64], fen_board[128], toplay[8], castling_rights[8], ep_square[8];
+		int n, ret;
+
+		strcpy(id, "-");
+		q.probes = q.pages_read = 0;
+		n = sscanf(line, "%63s %127s %7s %7s %7s", id, fen_board, toplay, castling_rights, ep_square);
+		if (n <= 0)
+			continue;
+
+		if (n == 2 && strcmp(fen_board, "stats") == 0) {
+			struct book_cache_stats stats;
+			ret = book_get_cache_stats(book, &stats);
+			if (ret == 0) {
+				printf("cache %llu %llu %llu %zu %zu\n",
+					(unsigned long long)stats.hits, (unsigned long long)stats.misses,
+					(unsigned long long)stats.evictions, stats.entries, stats.capacity);
+				ret = 1;
+			}
+		} else if (n != 5) {
+			fprintf(stderr, "Malformed request '%s'\n", id);
+			ret = -1;
+		} else {
+			ret = lookup_and_output(book, &q, fen_board, toplay, castling_rights, ep_square);
 		}
-	}
 
-	// flip the en passant square
-	if (strcmp(eps, "-") != 0) {
-		int epsc = eps[0] - 'a';
-		eps[0] = 'a' + (7 - epsc);
+		printf("end %s %s %u %u\n", id,
+			(ret == 1) ? "found" : (ret == 0) ? "notfound" : "error",
+			q.probes, q.pages_read);
+		fflush(stdout);
 	}
 }
 
-unsigned char position[32];
-int pos_len;
-int bits_left;
+static volatile sig_atomic_t stop_serving = 0;
 
-void put_bit(int x)
+static void handle_stop_signal(int sig)
 {
-	position[pos_len] <<= 1;
-	if (x)
-		position[pos_len] |= 1;
-
-	if (--bits_left == 0) {
-		++pos_len;
-		bits_left = 8;
-	}
+	(void)sig;
+	stop_serving = 1;
 }
 
-void dump_fen(char *board, int invert, int flip, char *castling_rights, char *ep_square)
+// Same as serve(), but on a Unix socket; connections are served one by one.
+// All output goes to stdout, so we point it to the socket while serving.
+// Returns on SIGINT or SIGTERM (after the current connection), so that the
+// caller gets to close the book, or with -1 if we couldn't set up the socket.
+int serve_socket(struct book *book, char *path)
 {
-	int y, x;
-	for (y = 0; y < 8; ++y) {
-		int space = 0;
-		for (x = 0; x < 8; ++x) {
-			int xx = (flip) ? (7-x) : x;
-
-			if (board[y * 8 + xx] == ' ') {
-				++space;
-			} else {
-				if (space != 0)
-					putchar('0' + space);
-				putchar(board[y * 8 + xx]);
-				space = 0;
-			}
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int sock, stdout_fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		close(sock);
+		return -1;
+	}
+	if (listen(sock, 16) == -1) {
+		perror("listen");
+		close(sock);
+		return -1;
+	}
+
+	// a client going away shouldn't take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+
+	// no SA_RESTART, so that accept() gets interrupted
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	stdout_fd = dup(STDOUT_FILENO);
+	while (!stop_serving) {
+		FILE *in;
+		int fd = accept(sock, NULL, NULL);
+		if (fd == -1) {
+			if (errno != EINTR)
+				perror("accept");
+			continue;
 		}
-		if (space != 0)
-			putchar('0' + space);
-		if (y != 7)
-			putchar('/');
-	}
-	putchar(' ');
-
-	if (invert)
-		putchar('b');
-	else
-		putchar('w');
 
-	printf(" %s ", castling_rights);
-	if (flip && strcmp(ep_square, "-") != 0) {
-		printf("%c%c 0 0\n", 'a' + (7 - (ep_square[0] - 'a')), ep_square[1]);
-	} else {
-		printf("%s 0 0\n", ep_square);
+		in = fdopen(fd, "r");
+		fflush(stdout);
+		dup2(fd, STDOUT_FILENO);
+		serve(book, in, 0);
+		fflush(stdout);
+		dup2(stdout_fd, STDOUT_FILENO);
+		fclose(in);
 	}
+
+	close(sock);
+	unlink(path);
+	return 0;
 }
 
-void encode_position(char *board, int invert, char *castling_rights, char *ep_column)
+struct book_worker {
+	pid_t pid;
+	FILE *to, *from;
+	char *fen;   // the position the worker is looking up, or NULL if idle
+};
+
+// Walks the entire book breadth-first from the start position, and outputs
+// every position we find, in the form
+//
+//   <fen>
+//   <the same lines as for a normal lookup>
+//   <empty line>
+//
+// The lookups are done by <num_workers> child processes running the server
+// loop; we only keep track of which positions we've seen and what is left
+// to look up.
+void dump_book(struct book *book, int num_workers)
 {
-	int x, y;
-	int ep_any = 0;
-
-	// clear out
-	memset(position, 0, 32);
-
-	// leave some room for the header byte, which will be filled last
-	pos_len = 1;
-	bits_left = 8;
-
-	// slightly unusual ordering
-	for (x = 0; x < 8; ++x) {
-		for (y = 0; y < 8; ++y) {
-			switch (board[(7-y) * 8 + x]) {
-			case ' ':
-				put_bit(0);
-				break;
-			case 'p':
-				put_bit(1);
-				put_bit(1);
-				put_bit(1);
-				break;
-			case 'P':
-				put_bit(1);
-				put_bit(1);
-				put_bit(0);
-				break;
-			case 'r':
-				put_bit(1);
-				put_bit(0);
-				put_bit(1);
-				put_bit(1);
-				put_bit(1);
-				break;
-			case 'R':
-				put_bit(1);
-				put_bit(0);
-				put_bit(1);
-				put_bit(1);
-				put_bit(0);
-				break;
-			case 'b':
-				put_bit(1);
-				put_bit(0);
-				put_bit(1);
-				put_bit(0);
-				put_bit(1);
-				break;
-			case 'B':
-				put_bit(1);
-				put_bit(0);
-				put_bit(1);
-				put_bit(0);
-				put_bit(0);
-				break;
-			case 'n':
-				put_bit(1);
-				put_bit(0);
-				put_bit(0);
-				put_bit(1);
-				put_bit(1);
-				break;
-			case 'N':
-				put_bit(1);
-				put_bit(0);
-				put_bit(0);
-				put_bit(1);
-				put_bit(0);
-				break;
-			case 'q':
-				put_bit(1);
-				put_bit(0);
-				put_bit(0);
-				put_bit(0);
-				put_bit(1);
-				put_bit(1);
-				break;
-			case 'Q':
-				put_bit(1);
-				put_bit(0);
-				put_bit(0);
-				put_bit(0);
-				put_bit(1);
-				put_bit(0);
-				break;
-			case 'k':
-				put_bit(1);
-				put_bit(0);
-				put_bit(0);
-				put_bit(0);
-				put_bit(0);
-				put_bit(1);
-				break;
-			case 'K':
-				put_bit(1);
-				put_bit(0);
-				put_bit(0);
-				put_bit(0);
-				put_bit(0);
-				put_bit(0);
-				break;
+	struct book_worker *workers = calloc(num_workers, sizeof(struct book_worker));
+	struct key_set seen = { NULL, 0, 0 };
+	struct fen_queue queue = { NULL, 0, 0, 0 };
+	struct pollfd *pfds = calloc(num_workers, sizeof(struct pollfd));
+	char start_fen[] = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+	int i, busy = 0;
+
+	// start the workers
+	for (i = 0; i < num_workers; ++i) {
+		int req[2], resp[2];
+		if (pipe(req) == -1 || pipe(resp) == -1) {
+			perror("pipe");
+			exit(1);
+		}
+		fflush(stdout);
+		workers[i].pid = fork();
+		if (workers[i].pid == -1) {
+			perror("fork");
+			exit(1);
+		}
+		if (workers[i].pid == 0) {
+			int j;
+			for (j = 0; j < i; ++j) {
+				fclose(workers[j].to);
+				fclose(workers[j].from);
 			}
+			close(req[1]);
+			close(resp[0]);
+			dup2(resp[1], STDOUT_FILENO);
+			close(resp[1]);
+			serve(book, fdopen(req[0], "r"), 1);
+			exit(0);
 		}
+		close(req[0]);
+		close(resp[1]);
+		workers[i].to = fdopen(req[1], "w");
+		workers[i].from = fdopen(resp[0], "r");
+		workers[i].fen = NULL;
 	}
-		
-	if (strcmp(ep_column, "-") != 0) {
-		int epcn = ep_column[0] - 'a';
 
-		if ((epcn > 0 && board[3*8 + epcn - 1] == 'P') ||
-		    (epcn < 7 && board[3*8 + epcn + 1] == 'P')) {
-			ep_any = 1;
+	// seed with the start position
+	{
+		struct book_query q;
+		struct book_entry entry;
+		memset(&q, 0, sizeof(q));
+		book_lookup(book, &q, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR", "w", "KQkq", "-", &entry);
+		if (key_set_insert(&seen, entry.key, entry.key_len) == -1 ||
+		    fen_queue_push(&queue, start_fen) == -1) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
 		}
 	}
-	
-	// really odd padding
-	{
-		int nb = 0, i;
 
-		// find the right number of bits
-		int right = (ep_any) ? 3 : 8;
-
-		// castling needs four more
-		if (strcmp(castling_rights, "-") != 0) {
-			right = right + 4;
-			if (right > 8)
-				right %= 8;
+	while (queue.head != queue.tail || busy > 0) {
+		// hand out work to idle workers
+		for (i = 0; i < num_workers && queue.head != queue.tail; ++i) {
+			if (workers[i].fen != NULL)
+				continue;
+			workers[i].fen = queue.fens[queue.head++];
+			fprintf(workers[i].to, "%d %s\n", i, workers[i].fen);
+			fflush(workers[i].to);
+			++busy;
 		}
 
-		if (bits_left > right)
-			nb = bits_left - right;
-		else if (bits_left < right)
-			nb = bits_left + 8 - right;
-
-		if (bits_left == 8 && strcmp(castling_rights, "-") == 0 && !ep_any)
-			nb = 8;
-
-		for (i = 0; i < nb; ++i) {
-			put_bit(0);
+		// wait for at least one of them to finish
+		for (i = 0; i < num_workers; ++i) {
+			pfds[i].fd = fileno(workers[i].from);
+			pfds[i].events = (workers[i].fen != NULL) ? POLLIN : 0;
+			pfds[i].revents = 0;
 		}
-	}
-	
-	// en passant
-	if (ep_any) {
-		int epcn = ep_column[0] - 'a';
-
-		put_bit(epcn & 0x04);
-		put_bit(epcn & 0x02);
-		put_bit(epcn & 0x01);
-	}
-	
-	// castling rights
-	if (strcmp(castling_rights, "-") != 0) {
-		if (invert) {
-			put_bit(strchr(castling_rights, 'K') != NULL);
-			put_bit(strchr(castling_rights, 'Q') != NULL);
-			put_bit(strchr(castling_rights, 'k') != NULL);
-			put_bit(strchr(castling_rights, 'q') != NULL);
-		} else {
-			put_bit(strchr(castling_rights, 'k') != NULL);
-			put_bit(strchr(castling_rights, 'q') != NULL);
-			put_bit(strchr(castling_rights, 'K') != NULL);
-			put_bit(strchr(castling_rights, 'Q') != NULL);
+		if (poll(pfds, num_workers, -1) == -1) {
+			perror("poll");
+			exit(1);
 		}
-	}
 
-	// padding stuff
-	if (bits_left == 8) {
-		//++pos_len;
-	} else {
-#if 0
-		++pos_len;
-#else
-		int i, nd = 8 - bits_left;
-		for (i = 0; i < nd; ++i)
-			put_bit(0);
-#endif
-	}
-		
-	// and the header byte
-	position[0] = pos_len;
+		for (i = 0; i < num_workers; ++i) {
+			char line[1024], status[16];
+			int found = 0;
 
-	if (strcmp(castling_rights, "-") != 0)
-		position[0] |= 0x40;
-	if (ep_any)
-		position[0] |= 0x20;
-
-#if DUMP_ENC
-	{
-		int i;
-		for (i = 0; i < pos_len; ++i) {
-			printf("%02x ", position[i]);
-		}
-		printf("\n");
-	}
-#endif
-}
-		
-int search_pos(unsigned c, char *result)
-{
-	char buf[4];
-	unsigned char pagebuf[4096];
-	unsigned page;
-	unsigned page_len;
-
-	lseek(cto_fd, c * 4 + 16, SEEK_SET);
-	
-	read(cto_fd, buf, 4);
-	page = htonl(*((unsigned *)buf));
-	if (page == -1)
-		return 0;
-
-	lseek(ctg_fd, page * 4096 + 4096, SEEK_SET);
-	read(ctg_fd, pagebuf, 4096);
-
-	// search the page
-	{
-		int pos = 4;
-		int page_end = htons(*((short *)(pagebuf + 2)));
-
-		while (pos < page_end) {
-			if (pagebuf[pos] != position[0] ||
-			    memcmp(pagebuf + pos, position, pos_len) != 0) {
-				// no match, skip through
-				pos += pagebuf[pos] & 0x1f;
-				pos += pagebuf[pos];
-				pos += 33;
+			if (workers[i].fen == NULL || pfds[i].revents == 0)
 				continue;
+
+			// collect the response; child positions go into the queue,
+			// the rest is output
+			printf("%s\n", workers[i].fen);
+			strcpy(status, "error");
+			while (fgets(line, sizeof(line), workers[i].from) != NULL) {
+				if (strncmp(line, "end ", 4) == 0) {
+					sscanf(line, "end %*s %15s", status);
+					found = 1;
+					break;
+				}
+				if (strncmp(line, "> ", 2) == 0) {
+					unsigned char key[32];
+					int len = 0;
+					char *ptr = line + 2;
+					while (len < 32 && isxdigit(ptr[0]) && isxdigit(ptr[1])) {
+						sscanf(ptr, "%2hhx", &key[len++]);
+						ptr += 2;
+					}
+					if (*ptr == ' ') {
+						int inserted = key_set_insert(&seen, key, len);
+						ptr[strcspn(ptr, "\n")] = '\0';
+						if (inserted == -1 || (inserted == 1 && fen_queue_push(&queue, ptr + 1) == -1)) {
+							fprintf(stderr, "Out of memory\n");
+							exit(1);
+						}
+					}
+					continue;
+				}
+				fputs(line, stdout);
+			}
+			if (!found) {
+				fprintf(stderr, "Worker %d died\n", i);
+				exit(1);
 			}
-			pos += pagebuf[pos] & 0x1f;
-			memcpy(result, pagebuf + pos, pagebuf[pos] + 33);
-			return 1;
+			if (strcmp(status, "found") != 0)
+				fprintf(stderr, "Lookup of '%s' failed (%s)\n", workers[i].fen, status);
+			printf("\n");
+
+			free(workers[i].fen);
+			workers[i].fen = NULL;
+			--busy;
 		}
 	}
 
-	return 0;
+	// shut down the workers
+	for (i = 0; i < num_workers; ++i) {
+		fclose(workers[i].to);
+		fclose(workers[i].from);
+		waitpid(workers[i].pid, NULL, 0);
+	}
+	fflush(stdout);
+	fprintf(stderr, "%zu positions\n", seen.used);
 }
 
-int lookup_position(char *pos, unsigned len, char *result)
+uint64_t now_ns(void)
 {
-	int hash = gen_hash(position, pos_len);
-	int n;
-	
-	for (n = 0; n < 0x7fffffff; n = 2 * n + 1) {
-		unsigned c = (hash & n) + n;
-
-		// FIXME: adjust these bounds
-		if (c < 0x80e0)
-			continue;
-
-		if (search_pos(c, result))
-			return 1;
-		
-		if (c >= 0x1fd00)
-			break;
-	}
-
-	return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-struct moveenc {
-	char encoding;
-	char piece;
-	int num;
-	int forward, right;
-};
-struct moveenc movetable[] = {
-	0x00, 'P', 5,  1,  1,
-	0x01, 'N', 2, -1, -2,
-	0x03, 'Q', 2,  0,  2,
-	0x04, 'P', 2,  1,  0,
-	0x05, 'Q', 1,  1,  0,
-	0x06, 'P', 4,  1, -1,
-	0x08, 'Q', 2,  0,  4, 
-	0x09, 'B', 2,  6,  6,
-	0x0a, 'K', 1, -1,  0,
-	0x0c, 'P', 1,  1, -1,
-	0x0d, 'B', 1,  3,  3,
-	0x0e, 'R', 2,  0,  3,
-	0x0f, 'N', 1, -1, -2,
-	0x12, 'B', 1,  7,  7,
-	0x13, 'K', 1,  1,  0,
-	0x14, 'P', 8,  1,  1,
-	0x15, 'B', 1,  5,  5,
-	0x18, 'P', 7,  1,  0,
-	0x1a, 'Q', 2,  6,  0,
-	0x1b, 'B', 1,  1, -1,
-	0x1d, 'B', 2,  7,  7,
-	0x21, 'R', 2,  0,  7,
-	0x22, 'B', 2,  2, -2,
-	0x23, 'Q', 2,  6,  6,
-	0x24, 'P', 8,  1, -1,
-	0x26, 'B', 1,  7, -7,
-	0x27, 'P', 3,  1, -1,
-	0x28, 'Q', 1,  5,  5,
-	0x29, 'Q', 1,  0,  6,
-	0x2a, 'N', 2, -2,  1,
-	0x2d, 'P', 6,  1,  1,
-	0x2e, 'B', 1,  1,  1,
-	0x2f, 'Q', 1,  0,  1,
-	0x30, 'N', 2, -2, -1,
-	0x31, 'Q', 1,  0,  3,
-	0x32, 'B', 2,  5,  5,
-	0x34, 'N', 1,  2,  1,
-	0x36, 'N', 1,  1,  2,
-	0x37, 'Q', 1,  4,  0,
-	0x38, 'Q', 2,  4, -4,
-	0x39, 'Q', 1,  0,  5,
-	0x3a, 'B', 1,  6,  6,
-	0x3b, 'Q', 2,  5, -5,
-	0x3c, 'B', 1,  5, -5,
-	0x41, 'Q', 2,  5,  5,
-	0x42, 'Q', 1,  7, -7,
-	0x44, 'K', 1, -1,  1,
-	0x45, 'Q', 1,  3,  3,
-	0x4a, 'P', 8,  2,  0,
-	0x4b, 'Q', 1,  5, -5,
-	0x4c, 'N', 2,  2,  1,
-	0x4d, 'Q', 2,  1,  0,
-	0x50, 'R', 1,  6,  0,
-	0x52, 'R', 1,  0,  6,
-	0x54, 'B', 2,  1, -1,
-	0x55, 'P', 3,  1,  0,
-	0x5c, 'P', 7,  1,  1,
-	0x5f, 'P', 5,  2,  0,
-	0x61, 'Q', 1,  6,  6,
-	0x62, 'P', 2,  2,  0,
-	0x63, 'Q', 2,  7, -7,
-	0x66, 'B', 1,  3, -3,
-	0x67, 'K', 1,  1,  1,
-	0x69, 'R', 2,  7,  0,
-	0x6a, 'B', 1,  4,  4,
-	0x6b, 'K', 1,  0,  2,   /* short castling */
-	0x6e, 'R', 1,  0,  5,
-	0x6f, 'Q', 2,  7,  7,
-	0x72, 'B', 2,  7, -7,
-	0x74, 'Q', 1,  0,  2,
-	0x79, 'B', 2,  6, -6,
-	0x7a, 'R', 1,  3,  0,
-	0x7b, 'R', 2,  6,  0,
-	0x7c, 'P', 3,  1,  1,
-	0x7d, 'R', 2,  1,  0,
-	0x7e, 'Q', 1,  3, -3,
-	0x7f, 'R', 1,  0,  1,
-	0x80, 'Q', 1,  6, -6,
-	0x81, 'R', 1,  1,  0,
-	0x82, 'P', 6,  1, -1,
-	0x85, 'N', 1,  2, -1,
-	0x86, 'R', 1,  0,  7,
-	0x87, 'R', 1,  5,  0,
-	0x8a, 'N', 1, -2,  1,
-	0x8b, 'P', 1,  1,  1,
-	0x8c, 'K', 1, -1, -1,
-	0x8e, 'Q', 2,  2, -2,
-	0x8f, 'Q', 1,  0,  7,
-	0x92, 'Q', 2,  1,  1,
-	0x94, 'Q', 1,  3,  0,
-	0x96, 'P', 2,  1,  1,
-	0x97, 'K', 1,  0, -1,
-	0x98, 'R', 1,  0,  3,
-	0x99, 'R', 1,  4,  0,
-	0x9a, 'Q', 1,  6,  0,
-	0x9b, 'P', 3,  2,  0,
-	0x9d, 'Q', 1,  2,  0,
-	0x9f, 'B', 2,  4, -4,
-	0xa0, 'Q', 2,  3,  0,
-	0xa2, 'Q', 1,  2,  2,
-	0xa3, 'P', 8,  1,  0,
-	0xa5, 'R', 2,  5,  0,
-	0xa9, 'R', 2,  0,  2,
-	0xab, 'Q', 2,  6, -6,
-	0xad, 'R', 2,  0,  4,
-	0xae, 'Q', 2,  3,  3,
-	0xb0, 'Q', 2,  4,  0,
-	0xb1, 'P', 6,  2,  0,
-	0xb2, 'B', 1,  6, -6,
-	0xb5, 'R', 2,  0,  5,
-	0xb7, 'Q', 1,  5,  0,
-	0xb9, 'B', 2,  3,  3,
-	0xbb, 'P', 5,  1,  0,
-	0xbc, 'Q', 2,  0,  5,
-	0xbd, 'Q', 2,  2,  0,
-	0xbe, 'K', 1,  0,  1,
-	0xc1, 'B', 1,  2,  2,
-	0xc2, 'B', 2,  2,  2,
-	0xc3, 'B', 1,  2, -2,
-	0xc4, 'R', 2,  0,  1,
-	0xc5, 'R', 2,  4,  0,
-	0xc6, 'Q', 2,  5,  0,
-	0xc7, 'P', 7,  1, -1,
-	0xc8, 'P', 7,  2,  0,
-	0xc9, 'Q', 2,  7,  0,
-	0xca, 'B', 2,  3, -3,
-	0xcb, 'P', 6,  1,  0,
-	0xcc, 'B', 2,  5, -5,
-	0xcd, 'R', 1,  0,  2,
-	0xcf, 'P', 4,  1,  0,
-	0xd1, 'P', 2,  1, -1,
-	0xd2, 'N', 2,  1,  2,
-	0xd3, 'N', 2,  1, -2,
-	0xd7, 'Q', 1,  1, -1,
-	0xd8, 'R', 2,  0,  6,
-	0xd9, 'Q', 1,  2, -2,
-	0xda, 'N', 1, -2, -1,
-	0xdb, 'P', 1,  2,  0,
-	0xde, 'P', 5,  1, -1,
-	0xdf, 'K', 1,  1, -1,
-	0xe0, 'N', 2, -1,  2,
-	0xe1, 'R', 1,  7,  0,
-	0xe3, 'R', 2,  3,  0,
-	0xe5, 'Q', 1,  0,  4,
-	0xe6, 'P', 4,  2,  0,
-	0xe7, 'Q', 1,  4,  4,
-	0xe8, 'R', 1,  2,  0,
-	0xe9, 'N', 1, -1,  2,
-	0xeb, 'P', 4,  1,  1,
-	0xec, 'P', 1,  1,  0,
-	0xed, 'Q', 1,  7,  7,
-	0xee, 'Q', 2,  1, -1,
-	0xef, 'R', 1,  0,  4,
-	0xf0, 'Q', 2,  0,  7,
-	0xf1, 'Q', 1,  1,  1,
-	0xf3, 'N', 2,  2, -1,
-	0xf4, 'R', 2,  2,  0,
-	0xf5, 'B', 2,  1,  1,
-	0xf6, 'K', 1,  0, -2,   /* long castling */
-	0xf7, 'N', 1,  1, -2,
-	0xf8, 'Q', 2,  0,  1,
-	0xf9, 'Q', 2,  6,  0,
-	0xfa, 'Q', 2,  0,  3,
-	0xfb, 'Q', 2,  2,  2,
-	0xfd, 'Q', 1,  7,  0,
-	0xfe, 'Q', 2,  3, -3
-};
-
-int find_piece(char *board, char piece, int num)
+int compare_u64(const void *a, const void *b)
 {
-	int y, x;
-	for (x = 0; x < 8; ++x) {
-		for (y = 0; y < 8; ++y) {
-			if (board[(7-y) * 8 + x] != piece)
-				continue;
-			if (--num == 0)
-				return (y * 8 + x);
-		}
-	}
-
-	fprintf(stderr, "Couldn't find piece '%c' number %u\n", piece, num);
-	exit(1);
+	uint64_t xa = *(const uint64_t *)a, xb = *(const uint64_t *)b;
+	return (xa > xb) - (xa < xb);
 }
 
-void execute_move(char *board, char *castling_rights, int inverted, char *ep_square, int from_square, int to_square)
+// Benchmark mode: looks up every position in <in> (one FEN per line; only
+// the first four fields are used), and reports how fast it went. In warm
+// mode, we do an untimed pass first to get everything into the page cache;
+// in cold mode, we evict the book before every lookup instead. The time
+// breakdown comes from a separate pass, since measuring it slows things
+// down a bit. With a cache, the warm pass fills it, so the timed passes
+// measure cache hits (as far as it has room).
+void bench(struct book *book, FILE *in, int cold)
 {
-	int black_ks, black_qs, white_ks, white_qs;
-
-	// fudge
-	from_square = (7 - (from_square / 8)) * 8 + (from_square % 8);
-	to_square = (7 - (to_square / 8)) * 8 + (to_square % 8);
-
-	// compute the new castling rights
-	black_ks = (strchr(castling_rights, 'k') != NULL);
-	black_qs = (strchr(castling_rights, 'q') != NULL);
-	white_ks = (strchr(castling_rights, 'K') != NULL);
-	white_qs = (strchr(castling_rights, 'Q') != NULL);
-
-	if (board[from_square] == 'K') {
-		if (inverted)
-			black_ks = black_qs = 0;
-		else
-			white_ks = white_qs = 0;
-	}
-	if (board[from_square] == 'R') {
-		if (inverted) {
-			if (from_square == 56) // h1
-				black_qs = 0;
-			else if (from_square == 63) // h8
-				black_ks = 0;
-		} else {
-			if (from_square == 56) // a1
-				white_qs = 0;
-			else if (from_square == 63) // a8
-				white_ks = 0;
+	char (*fens)[4][128] = NULL;
+	uint64_t *latencies;
+	size_t num_fens = 0, fens_size = 0, num_found = 0, i;
+	uint64_t total_ns, total_profiled;
+	unsigned long long probes, pages_read;
+	struct book_entry *entry = malloc(sizeof(*entry));
+	struct book_cache_stats stats;
+	struct book_query q;
+	char line[1024];
+	int pass;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (num_fens == fens_size) {
+			fens_size = (fens_size == 0) ? 1024 : fens_size * 2;
+			fens = realloc(fens, fens_size * sizeof(*fens));
+			if (fens == NULL) {
+				perror("realloc");
+				exit(1);
+			}
 		}
+		if (sscanf(line, "%127s %127s %127s %127s", fens[num_fens][0], fens[num_fens][1], fens[num_fens][2], fens[num_fens][3]) == 4)
+			++num_fens;
 	}
-	if (board[to_square] == 'r') {
-		if (inverted) {
-			if (to_square == 0) // h1
-				white_qs = 0;
-			else if (to_square == 7) // h8
-				white_ks = 0;
-		} else {
-			if (to_square == 0) // a1
-				black_qs = 0;
-			else if (to_square == 7) // a8
-				black_ks = 0;
-		}
+	if (num_fens == 0) {
+		fprintf(stderr, "No positions to look up\n");
+		exit(1);
 	}
-
-	if ((black_ks | black_qs | white_ks | white_qs) == 0) {
-		strcpy(castling_rights, "-");
-	} else {
-		strcpy(castling_rights, "");
-
-		if (white_ks)
-			strcat(castling_rights, "K");
-		if (white_qs)
-			strcat(castling_rights, "Q");
-		if (black_ks)
-			strcat(castling_rights, "k");
-		if (black_qs)
-			strcat(castling_rights, "q");
+	latencies = malloc(num_fens * sizeof(uint64_t));
+	if (entry == NULL || latencies == NULL) {
+		perror("malloc");
+		exit(1);
 	}
 
-	// now the ep square
-	if (board[from_square] == 'P' && to_square - from_square == -16) {
-		sprintf(ep_square, "%c%u", "abcdefgh"[from_square % 8], from_square / 8);
-	} else {
-		strcpy(ep_square, "-");
+	memset(&q, 0, sizeof(q));
+	if (!cold) {
+		for (i = 0; i < num_fens; ++i)
+			book_lookup(book, &q, fens[i][0], fens[i][1], fens[i][2], fens[i][3], entry);
 	}
 
-	// is this move an en passant capture?
-	if (board[from_square] == 'P' && board[to_square] == ' ' &&
-	    (to_square - from_square == -9 || to_square - from_square == -7)) {
-	 	board[to_square + 8] = ' ';   	
-	}
+	// pass 0 is for latency and I/O, pass 1 for the time breakdown
+	total_ns = 0;
+	probes = pages_read = 0;
+	for (pass = 0; pass < 2; ++pass) {
+		memset(&q, 0, sizeof(q));
+		q.profile = pass;
+		for (i = 0; i < num_fens; ++i) {
+			uint64_t start;
+			int ret;
 
-	// make the move
-	board[to_square] = board[from_square];
-	board[from_square] = ' ';
-
-	// promotion
-	if (board[to_square] == 'P' && to_square < 8)
-		board[to_square] = 'Q';
-
-	if (board[to_square] == 'K' && to_square - from_square == 2) {
-		// short castling
-		board[to_square - 1] = 'R';
-		board[to_square + 1] = ' ';
-	} else if (board[to_square] == 'K' && to_square - from_square == -2) {
-		// long castling
-		board[to_square + 1] = 'R';
-		board[to_square - 2] = ' ';
-	}
+			if (cold)
+				book_drop_cache(book);
+			q.probes = q.pages_read = 0;
 
-#if 0
-	// dump the board
-	{
-		int y, x;
-		printf("\n\n");
-		for (y = 0; y < 8; ++y) {
-			for (x = 0; x < 8; ++x) {
-				putchar(board[y * 8 + x]);
-			}
-			putchar('\n');
+			start = now_ns();
+			ret = book_lookup(book, &q, fens[i][0], fens[i][1], fens[i][2], fens[i][3], entry);
+			if (pass == 1)
+				continue;
+
+			latencies[i] = now_ns() - start;
+			total_ns += latencies[i];
+			probes += q.probes;
+			pages_read += q.pages_read;
+			if (ret == 1)
+				++num_found;
 		}
 	}
-	printf("cr='%s' ep='%s'\n", castling_rights, ep_square);
-#endif
+	total_profiled = q.ns_encode + q.ns_hash + q.ns_search + q.ns_decode;
+	if (total_profiled == 0)
+		total_profiled = 1;
+
+	qsort(latencies, num_fens, sizeof(uint64_t), compare_u64);
+
+	printf("%zu positions (%zu found), %s cache\n", num_fens, num_found, cold ? "cold" : "warm");
+	printf("%.0f lookups/sec\n", num_fens * 1e9 / (total_ns ? total_ns : 1));
+	printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		latencies[num_fens / 2] * 1e-3,
+		latencies[num_fens * 99 / 100] * 1e-3,
+		latencies[num_fens - 1] * 1e-3);
+	printf("per lookup: %.2f probes, %.2f pages read\n",
+		(double)probes / num_fens, (double)pages_read / num_fens);
+	printf("time: encode %.1f%%, hash %.1f%%, search %.1f%%, move decode %.1f%%\n",
+		100.0 * q.ns_encode / total_profiled,
+		100.0 * q.ns_hash / total_profiled,
+		100.0 * q.ns_search / total_profiled,
+		100.0 * q.ns_decode / total_profiled);
+	if (book_get_cache_stats(book, &stats) == 0) {
+		printf("cache: %llu hits, %llu misses, %llu evictions, %zu/%zu entries\n",
+			(unsigned long long)stats.hits, (unsigned long long)stats.misses,
+			(unsigned long long)stats.evictions, stats.entries, stats.capacity);
+	}
+
+	free(fens);
+	free(latencies);
+	free(entry);
 }
 
-void dump_move(char *board, char *castling_rights, char *ep_col, int invert, int flip, char move, char annotation)
+int main(int argc, char **argv)
 {
-	int i;
-	char newboard[64], nkr[5], neps[3];
-	for (i = 0; i < sizeof(movetable)/sizeof(movetable[0]); ++i) {
-		int from_square, from_row, from_col;
-		int to_square, to_row, to_col;
-		int ret;
-		char result[256];
-
-		if (move != movetable[i].encoding)
-			continue;
-
-		from_square = find_piece(board, movetable[i].piece, movetable[i].num);
-		from_row = from_square / 8;
-		from_col = from_square % 8;
-
-		to_row = (from_row + 8 + movetable[i].forward) % 8;
-		to_col = (from_col + 8 + movetable[i].right) % 8;
-		to_square = to_row * 8 + to_col;
-		
-		// do the move, and look up the new position
-		memcpy(newboard, board, 64);
-		strcpy(nkr, castling_rights);
-		execute_move(newboard, nkr, invert, neps, from_square, to_square);
-		invert_board(newboard);
-		
-		if (needs_flipping(newboard, nkr)) {
-			flip_board(newboard, neps);
-			flip = !flip;
-		}
-		
-		encode_position(newboard, !invert, nkr, neps);
-		ret = lookup_position(position, pos_len, result);
-		if (!ret) {
-#if DUMP_FEN
-			if (!invert) 
-				invert_board(newboard);
-
-			dump_fen(newboard, !invert, flip, nkr, neps);
-#endif
-			fprintf(stderr, "Destination move not found in book.\n");
-			exit(1);
-		}
-
-#if DUMP_FEN
-		// very useful for regression testing (some shell and
-		// you can walk the entire book quite easily)
-		if (!invert) 
-			invert_board(newboard);
-		dump_fen(newboard, !invert, flip, nkr, neps);
-		return;
-#endif
-
-		// output the move
-		{
-			int fromcol = from_square % 8;
-			int fromrow = from_square / 8;
-			int tocol = to_square % 8;
-			int torow = to_square / 8;
-
-			if (invert) {
-				fromrow = 7 - fromrow;
-				torow = 7 - torow;
-			}
-			if (flip) {
-				fromcol = 7 - fromcol;
-				tocol = 7 - tocol;
-			}
-
-			printf("%c%u%c%u,",
-				"abcdefgh"[fromcol], fromrow + 1,
-				"abcdefgh"[tocol], torow + 1);
-		}
+	char *progname = argv[0];
+	char *book_name = "RybkaII", *index_filename = NULL, *cache_filename = NULL;
+	size_t cache_size = 0;
+	char error[BOOK_ERROR_SIZE];
+	struct book *book;
+	struct book_query q;
+	int ret;
 
-		// annotation
-		switch (annotation) {
-		case 0x00:
-			break;
-		case 0x01:
-			printf("!");
-			break;
-		case 0x02:
-			printf("?");
-			break;
-		case 0x03:
-			printf("!!");
-			break;
-		case 0x04:
-			printf("??");
-			break;
-		case 0x05:
-			printf("!?");
-			break;
-		case 0x06:
-			printf("?!");
-			break;
-		case 0x08:
-			printf(" (only move)");
-			break;
-		case 0x16:
-			printf(" (zugzwang)");
+	for ( ;; ) {
+		if (argc >= 3 && strcmp(argv[1], "--book") == 0) {
+			book_name = argv[2];
+		} else if (argc >= 3 && strcmp(argv[1], "--index") == 0) {
+			index_filename = argv[2];
+		} else if (argc >= 3 && strcmp(argv[1], "--cache") == 0) {
+			cache_size = strtoul(argv[2], NULL, 10);
+		} else if (argc >= 3 && strcmp(argv[1], "--cache-file") == 0) {
+			cache_filename = argv[2];
+		} else {
 			break;
-		default:
-			printf(" (unknown status 0x%02x)", annotation);
 		}
-		printf(",");
+		argc -= 2;
+		argv += 2;
+	}
 
-		output_stats(result, invert);
-		return;
+	// the cache is one mmap()ed file with a mutex in our own memory, so it
+	// can't be used from the forked dump workers (and an index build
+	// wouldn't get anything out of it anyway)
+	if ((cache_size != 0 || cache_filename != NULL) && argc >= 2 &&
+	    (strcmp(argv[1], "--dump-book") == 0 || strcmp(argv[1], "--build-index") == 0)) {
+		fprintf(stderr, "%s: --cache and --cache-file can't be used with %s\n", progname, argv[1]);
+		exit(1);
 	}
 
-	fprintf(stderr, "ERROR: Unknown move 0x%02x\n", move);
-	exit(1);
-}
+	if (index_filename != NULL) {
+		book = book_open_index(index_filename, error);
+	} else {
+		char ctg_filename[1024], cto_filename[1024], ctb_filename[1024];
+		snprintf(ctg_filename, sizeof(ctg_filename), "%s.ctg", book_name);
+		snprintf(cto_filename, sizeof(cto_filename), "%s.cto", book_name);
+		snprintf(ctb_filename, sizeof(ctb_filename), "%s.ctb", book_name);
+		book = book_open(ctg_filename, cto_filename, ctb_filename, error);
+	}
+	if (book == NULL) {
+		fprintf(stderr, "%s\n", error);
+		exit(1);
+	}
+	if (cache_size != 0 || cache_filename != NULL) {
+		if (cache_size == 0)
+			cache_size = 4096;
 
-void dump_info(char *board, char *castling_rights, char *ep_col, int invert, int flip, char *result)
-{
-	int book_moves = result[0] >> 1;
-	int i;
-	
-#if !DUMP_FEN
-	printf(",,");	
-	output_stats(result, !invert);
-#endif
-
-	for (i = 0; i < book_moves; ++i) {
-		dump_move(board, castling_rights, ep_col, invert, flip, result[i * 2 + 1], result[i * 2 + 2]);
+		// a cache file we can't use (typically because another process
+		// has it) shouldn't stop us from serving lookups
+		if (cache_filename != NULL && book_cache_open(book, cache_size, cache_filename, error) == -1) {
+			fprintf(stderr, "%s; keeping the cache in memory only\n", error);
+			cache_filename = NULL;
+		}
+		if (cache_filename == NULL && book_cache_open(book, cache_size, NULL, error) == -1) {
+			fprintf(stderr, "%s\n", error);
+			exit(1);
+		}
 	}
-}
 
-int main(int argc, char **argv)
-{
-	// encode the position
-	char board[64], result[256];
-	int invert = 0, flip;
-	int ret;
-	
-	ctg_fd = open("RybkaII.ctg", O_RDONLY);
-	cto_fd = open("RybkaII.cto", O_RDONLY);
-	ctb_fd = open("RybkaII.ctb", O_RDONLY);
-	decode_fen_board(argv[1], board);
-	
-	// always from white's position
-	if (argv[2][0] == 'b') {
-		invert = 1;
-		invert_board(board);
+	// (book_close() marks the cache file as cleanly closed)
+	if (argc == 2 && strcmp(argv[1], "--server") == 0) {
+		serve(book, stdin, 0);
+		book_close(book);
+		exit(0);
 	}
-	
-	// and the white king is always in the right half
-	flip = needs_flipping(board, argv[3]);
-	if (flip) {
-		flip_board(board, argv[4]);
+	if ((argc == 2 || (argc == 3 && strcmp(argv[2], "--cold") == 0)) && strcmp(argv[1], "--bench") == 0) {
+		bench(book, stdin, argc == 3);
+		book_close(book);
+		exit(0);
 	}
-
-
-#if 0
-	// dump the board
-	{
-		int y, x;
-		for (y = 0; y < 8; ++y) {
-			for (x = 0; x < 8; ++x) {
-				putchar(board[y * 8 + x]);
-			}
-			putchar('\n');
-		}
+	if (argc == 3 && strcmp(argv[1], "--socket") == 0) {
+		ret = serve_socket(book, argv[2]);
+		book_close(book);
+		exit(ret == 0 ? 0 : 1);
+	}
+	if (index_filename == NULL && (argc == 2 || argc == 3) && strcmp(argv[1], "--dump-book") == 0) {
+		int num_workers = (argc == 3) ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+		dump_book(book, num_workers > 0 ? num_workers : 1);
+		book_close(book);
+		exit(0);
 	}
-#endif
+	if (index_filename == NULL && argc == 3 && strcmp(argv[1], "--build-index") == 0) {
+		size_t num_indexed, num_failed;
 
-	encode_position(board, invert, argv[3], argv[4]);
-	ret = lookup_position(position, pos_len, result);
-	if (!ret) {
-		//fprintf(stderr, "Not found in book.\n");
+		memset(&q, 0, sizeof(q));
+		if (book_build_index(book, &q, argv[2], &num_indexed, &num_failed) == -1) {
+			fprintf(stderr, "%s\n", q.error);
+			book_close(book);
+			exit(1);
+		}
+		fprintf(stderr, "%zu positions (%zu failed lookups)\n", num_indexed, num_failed);
+		book_close(book);
+		exit(0);
+	}
+	if (argc < 5) {
+		fprintf(stderr, "Usage: %s [BOOK] [CACHE] BOARD TOPLAY CASTLING EP [...]\n", progname);
+		fprintf(stderr, "       %s [BOOK] [CACHE] --server\n", progname);
+		fprintf(stderr, "       %s [BOOK] [CACHE] --socket PATH\n", progname);
+		fprintf(stderr, "       %s [BOOK] [CACHE] --bench [--cold] < FENS\n", progname);
+		fprintf(stderr, "       %s [--book NAME] --dump-book [NUM_WORKERS]\n", progname);
+		fprintf(stderr, "       %s [--book NAME] --build-index FILE\n", progname);
+		fprintf(stderr, "\nBOOK is --book NAME or --index FILE; NAME defaults to RybkaII, for RybkaII.ctg/.cto/.ctb.\n");
+		fprintf(stderr, "CACHE is --cache ENTRIES and/or --cache-file FILE (default 4096 entries).\n");
 		exit(1);
 	}
 
-	dump_info(board, argv[3], argv[4], invert, flip, result);
-	exit(0);
+	memset(&q, 0, sizeof(q));
+	ret = lookup_and_output(book, &q, argv[1], argv[2], argv[3], argv[4]);
+	book_close(book);
+	exit(ret == 1 ? 0 : 1);
 }
-
@@ -0,0 +1,152 @@
+#ifndef _BOOKLOOK_H
+#define _BOOKLOOK_H 1
+
+// Looking up positions in ChessBase CTG opening books (or index files built
+// from them). A book is read-only once opened, so any number of threads can
+// look up positions in it at the same time, as long as each of them uses
+// its own struct book_query.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOOK_ERROR_SIZE 256
+
+struct book;
+
+struct book_stats {
+	unsigned wins, draws, losses;
+	unsigned rating, rating_div;   // rating is 0 if rating_div is 0
+};
+
+struct book_move {
+	// in the normalized board (white to move, white king in the right
+	// half), as y * 8 + x with y = 0 being the first rank
+	int from_square, to_square;
+	unsigned char annotation;
+
+	// the position after the move (the key and FEN are not available
+	// when looking up in an index file)
+	struct book_stats stats;
+	unsigned char child_key[32];
+	int child_key_len;
+	char child_fen[96];   // only if list_children is set
+};
+
+// everything the book has to say about a single position
+struct book_entry {
+	// stats are from the point of view of the side to move
+	struct book_stats stats;
+
+	// how the position was normalized to look it up; to get the moves
+	// in terms of the original position, flip them vertically if
+	// <invert> is set, and horizontally if <flip> is set
+	int invert, flip;
+
+	// the position as encoded in the book
+	unsigned char key[32];
+	int key_len;
+
+	int num_moves;
+	struct book_move moves[128];
+};
+
+// State for a single thread doing lookups. Zero it before use.
+struct book_query {
+	// if set, lookups also fill in child_fen for each move
+	int list_children;
+
+	// how much of the book we had to look at; these are only ever
+	// increased, so reset them yourself as needed. With an index file,
+	// <probes> counts index records and <pages_read> stays at zero.
+	unsigned probes, pages_read;
+
+	// if set, the time spent in each part of the lookups is added to
+	// these (in nanoseconds), at the cost of some extra overhead;
+	// <ns_encode> includes parsing the FEN, and <ns_decode> includes
+	// playing the book moves
+	int profile;
+	uint64_t ns_encode, ns_hash, ns_search, ns_decode;
+
+	// set whenever a function returns -1
+	char error[BOOK_ERROR_SIZE];
+
+	// used while encoding positions
+	unsigned char position[32];
+	int pos_len;
+};
+
+// Opens the given book; the CTB file is optional. Returns NULL on error,
+// with a message in <error> (which must have room for BOOK_ERROR_SIZE bytes).
+struct book *book_open(const char *ctg_filename, const char *cto_filename, const char *ctb_filename, char *error);
+
+// Same, for an index file written by book_build_index().
+struct book *book_open_index(const char *filename, char *error);
+
+void book_close(struct book *book);
+
+// Evicts the book (except for the small CTO file) from the page cache,
+// for measuring lookups on a cold cache.
+void book_drop_cache(struct book *book);
+
+// Looks up the position given by the first four fields of a FEN.
+// Returns 1 if the position was found, 0 if not, and -1 on error.
+int book_lookup(struct book *book, struct book_query *q,
+                const char *fen_board, const char *toplay, const char *castling_rights, const char *ep_square,
+                struct book_entry *entry);
+
+// Gives the book an LRU cache of up to <capacity> lookup results (including
+// positions that were not found), so that positions we've seen before don't
+// need to go to the book files again. Lookups with list_children set bypass
+// the cache. If <filename> is non-NULL, the cache is kept in that file, so
+// that it survives restarts; it is thrown away if the book has changed, or
+// if the last process using it didn't exit cleanly (through book_close()).
+// Only one process can use a cache file at a time, and the book must not be
+// used across fork() once it has a cache. Each entry takes about
+// 3 kB. Call this before any lookups. Returns 0 on success, and -1 on
+// error, with a message in <error>.
+int book_cache_open(struct book *book, size_t capacity, const char *filename, char *error);
+
+struct book_cache_stats {
+	// counted since the cache was created, so with a cache file,
+	// these include earlier processes
+	uint64_t hits, misses, evictions;
+	size_t entries, capacity;
+};
+
+// Returns -1 if the book has no cache.
+int book_get_cache_stats(struct book *book, struct book_cache_stats *stats);
+
+// Walks the entire book from the start position, and writes everything
+// in it to <filename> as an index file, which can be searched much faster.
+// Positions that fail to look up are left out, and counted in <num_failed>.
+// Returns 0 on success, and -1 on error.
+int book_build_index(struct book *book, struct book_query *q, const char *filename, size_t *num_indexed, size_t *num_failed);
+
+// The 64-bit key the index file uses for the given encoded position.
+uint64_t book_position_key(const unsigned char *pos, int len);
+
+// Helpers for walking the book.
+
+// Set of encoded positions. Open addressing; an empty slot has a zero
+// header byte, which no encoded position can have. Zero it before use.
+struct key_set {
+	unsigned char (*keys)[32];
+	size_t size, used;
+};
+
+// Returns 1 if the key was not already in the set, 0 if it was,
+// and -1 if we ran out of memory.
+int key_set_insert(struct key_set *set, const unsigned char *key, int len);
+void key_set_free(struct key_set *set);
+
+// FIFO of FENs. Zero it before use.
+struct fen_queue {
+	char **fens;
+	size_t head, tail, size;
+};
+
+// Adds a copy of <fen>; returns -1 if we ran out of memory.
+int fen_queue_push(struct fen_queue *queue, const char *fen);
+void fen_queue_free(struct fen_queue *queue);
+
+#endif  // !defined(_BOOKLOOK_H)
@@ -16,6 +16,10 @@ our $pgn_filter = undef;
 #	return $pgn->round() eq '7' && $pgn->white eq 'Carlsen,M';
 #};
 
+# Set to 1 if the PGN file is only ever appended to (e.g. a live file with
+# all the games of a round), so that we can fetch only the new part of it.
+our $pgn_append_only = 0;
+
 # Set to non-undef to override the clock information with our own calculations.
 # The example implements a simple 60+60 (with bonus added before the move).
 # FIXME(sesse): We might not see all moves in a PGN individually, so this might
@@ -38,6 +42,18 @@ our $adjust_clocks_before_move = undef;
 our $json_output = "/srv/analysis.sesse.net/www/analysis.json";
 our $json_history_dir = "/srv/analysis.sesse.net/www/history/";  # undef for none.
 
+# Unix socket to push new versions of the JSON to serve-analysis.js over
+# (its seventh argument), instead of it picking up $json_output; undef
+# for none. $json_output is then only a snapshot, and can be undef.
+our $json_socket = undef;
+
+# How often (in seconds) to write queued scores for the history to the database.
+our $score_flush_interval = 1.0;
+
+# How often (in seconds) to read the list of other games going on from the
+# database. (What we show about each of them is updated as they change.)
+our $games_refresh_interval = 10;
+
 our $engine_cmdline = "./stockfish";
 our %engine_config = (
 # 	'NalimovPath' => '/srv/tablebase',
@@ -55,21 +71,66 @@ our %engine2_config = (
 	'Threads' => '8',
 );
 
+# Set to analyze several games at once (from PGN over HTTP only), sharing
+# a pool of engines between them; $target, $json_output and $pgn_filter
+# above are then ignored. The id is the one in the current_games table,
+# where the priorities are taken from.
+our @games = ();
+#our @games = (
+#	{ id => 'board1', target => 'http://example.com/round7.pgn', json_output => '/srv/analysis.sesse.net/www/board1.json',
+#	  pgn_filter => sub { my $pgn = shift; return $pgn->white eq 'Carlsen,M'; } },
+#	{ id => 'board2', target => 'http://example.com/round7.pgn', json_output => '/srv/analysis.sesse.net/www/board2.json',
+#	  pgn_filter => sub { my $pgn = shift; return $pgn->white eq 'Caruana,F'; } },
+#);
+our $engine_pool_size = 2;      # Number of engines to share between the games.
+our $engine_pool_threads = 8;   # Total, split between the engines by priority.
+our $engine_pool_hash = 2048;   # Total, in MB, split evenly between the engines.
+our $engine_pool_slice = 30;    # Seconds a quiet game gets before it has to give up its engine.
+our $game_active_time = 300;    # Seconds since the last move for a game to count as active.
+
+# Set to 1 to have the second engine (if any) analyze the position after
+# the main engine's expected move once the game has been quiet for
+# $speculation_delay seconds, so that we have deep analysis right away
+# if that move is played. The refutation lines stop updating meanwhile.
+our $speculative_analysis = 0;
+our $speculation_delay = 30;
+
 our $uci_assume_full_compliance = 0;                    # dangerous :-)
 our $update_max_interval = 1.0;
 our @masters = (
 	'Sesse',
 );
 
-# Command line to run the Fathom tablebase lookup program, if installed,
-# including the --path= argument.
-our $fathom_cmdline = undef;
+# Directory with Syzygy tablebases (several can be given, separated by
+# colons), for the ./syzygy probe server (see syzygy.c); undef for no probes.
+# (This replaces $fathom_cmdline; if only that is set, its --path is used.)
+our $syzygy_path = undef;
+
+# Set to 1 to show book moves on the screen, from a ./booklook --server
+# process (see booklook.c); needs the book files.
+our $book_lookups = 0;
+
+# How many book lookups the booklook server keeps cached, and a file to
+# keep them in across restarts (undef for memory only).
+our $book_cache_size = 4096;
+our $book_cache_file = "booklook.cache";
 
 # ChessOK serial key (of the form NNNNN-NNNNN-NNNNN-NNNNN-NNNNN-NNNNN)
 # for looking up 7-man tablebases; undef means no lookup. Note that
 # you probably need specific prior permission to use this.
 our $tb_serial_key = undef;
 
+# Where to send the tablebase lookups (point this to a local stub that
+# mimics the addtask API for testing), how many to run at the same time,
+# how many of the second engine's lines to look for endgames in, and
+# where to keep the results across restarts (undef for memory only;
+# either way, only the $tb_cache_size most recently used are kept).
+our $tb_url = "http://158.250.18.203:6904/tasks/addtask";
+our $tb_max_lookups = 4;
+our $tb_prefetch_lines = 8;
+our $tb_cache_file = "tb-cache.json";
+our $tb_cache_size = 10000;
+
 # Credits to show in the footer.
 our $engine_url = "http://www.stockfishchess.org/";
 our $engine_details = undef;  # For hardware.
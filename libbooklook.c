@@ -0,0 +1,1954 @@
+// Looking up positions in ChessBase CTG opening books; see booklook.h.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "booklook.h"
+
+#define DUMP_FEN 0
+#define DUMP_ENC 0
+
+// what cto_page() and first_slot() return if there is nothing to look at
+#define NO_PAGE UINT_MAX
+
+// a CTG entry is at most 255 + 33 bytes (see search_pos())
+#define CTG_RESULT_SIZE 288
+
+struct book {
+	// the book files are mapped into memory once, when opening the book
+	unsigned char *cto_map, *ctg_map;
+	size_t cto_size, ctg_size;
+	int ctg_fd;   // kept open for book_drop_cache()
+	unsigned cto_entries, ctg_pages;
+
+	// range of CTO entries that are in use, from the CTB file
+	unsigned page_bounds_low, page_bounds_high;
+
+	// the index file from book_build_index(), if we're using that
+	// instead of the CTG files
+	unsigned char *index_map;
+	size_t index_size, index_positions, index_moves;
+	int index_fd;
+
+	// from book_cache_open(), if any
+	struct book_cache *cache;
+};
+
+static void cache_free(struct book_cache *cache);
+
+static uint64_t profile_now(struct book_query *q)
+{
+	struct timespec ts;
+
+	if (!q->profile)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Adds the time since <*start> to <*counter>, and restarts <*start>.
+static void profile_lap(struct book_query *q, uint64_t *start, uint64_t *counter)
+{
+	uint64_t now;
+
+	if (!q->profile)
+		return;
+	now = profile_now(q);
+	*counter += now - *start;
+	*start = now;
+}
+
+static const unsigned int tbl2[] = {
+	0x3100d2bf, 0x3118e3de, 0x34ab1372, 0x2807a847,
+	0x1633f566, 0x2143b359, 0x26d56488, 0x3b9e6f59,
+	0x37755656, 0x3089ca7b, 0x18e92d85, 0x0cd0e9d8,
+	0x1a9e3b54, 0x3eaa902f, 0x0d9bfaae, 0x2f32b45b,
+	0x31ed6102, 0x3d3c8398, 0x146660e3, 0x0f8d4b76,
+	0x02c77a5f, 0x146c8799, 0x1c47f51f, 0x249f8f36,
+	0x24772043, 0x1fbc1e4d, 0x1e86b3fa, 0x37df36a6,
+	0x16ed30e4, 0x02c3148e, 0x216e5929, 0x0636b34e,
+	0x317f9f56, 0x15f09d70, 0x131026fb, 0x38c784b1,
+	0x29ac3305, 0x2b485dc5, 0x3c049ddc, 0x35a9fbcd,
+	0x31d5373b, 0x2b246799, 0x0a2923d3, 0x08a96e9d,
+	0x30031a9f, 0x08f525b5, 0x33611c06, 0x2409db98,
+	0x0ca4feb2, 0x1000b71e, 0x30566e32, 0x39447d31,
+	0x194e3752, 0x08233a95, 0x0f38fe36, 0x29c7cd57,
+	0x0f7b3a39, 0x328e8a16, 0x1e7d1388, 0x0fba78f5,
+	0x274c7e7c, 0x1e8be65c, 0x2fa0b0bb, 0x1eb6c371
+};
+
+// Reads the stats that follow the move list of a book record. Note that
+// they are from the point of view of the side to move in that position.
+static void get_stats(char *result, struct book_stats *stats)
+{
+	unsigned char *ptr = result;
+	ptr += *ptr;
+	ptr += 3;
+
+	// wins-draw-loss
+	stats->wins = (ptr[0] << 16) | (ptr[1] << 8) | ptr[2];
+	stats->losses = (ptr[3] << 16) | (ptr[4] << 8) | ptr[5];
+	stats->draws = (ptr[6] << 16) | (ptr[7] << 8) | ptr[8];
+
+	ptr += 9;
+	ptr += 4;
+	ptr += 7;
+
+	// rating
+	{
+		int rat2_sum, rat2_div;
+		rat2_div = (ptr[0] << 16) | (ptr[1] << 8) | ptr[2];
+		rat2_sum = (ptr[3] << 24) | (ptr[4] << 16) | (ptr[5] << 8) | ptr[6];
+
+		stats->rating_div = rat2_div;
+		stats->rating = (rat2_div == 0) ? 0 : rat2_sum / rat2_div;
+	}
+}
+
+// Each nibble n of the key advances the state by (15 - n) * 4 + 1 and then
+// adds the table entry for it. Only the low six bits of the state are ever
+// used, so it doesn't matter that the original code kept it in a short.
+static unsigned int gen_hash(const unsigned char *ptr, unsigned len)
+{
+	unsigned hash = 0, tmp = 0;
+	unsigned i;
+
+	for (i = 0; i < len; ++i) {
+		tmp += 61 - 4 * (ptr[i] & 0x0f);
+		hash += tbl2[tmp & 0x3f];
+		tmp += 61 - 4 * (ptr[i] >> 4);
+		hash += tbl2[tmp & 0x3f];
+	}
+	return hash;
+}
+
+static int decode_fen_board(struct book_query *q, const char *str, char *board)
+{
+	char *end = board + 64;
+
+	while (*str) {
+		// make sure we don't run off the end of the board
+		int squares = 1;
+		if (*str >= '1' && *str <= '8')
+			squares = *str - '0';
+		else if (*str == '/')
+			squares = 0;
+
+		if (board + squares > end) {
+			snprintf(q->error, BOOK_ERROR_SIZE, "Too many squares in FEN board");
+			return -1;
+		}
+
+		switch (*str) {
+		case 'r':
+		case 'n':
+		case 'b':
+		case 'q':
+		case 'k':
+		case 'p':
+		case 'R':
+		case 'N':
+		case 'B':
+		case 'Q':
+		case 'K':
+		case 'P':
+			*board++ = *str;
+			break;
+		case '8':
+			*board++ = ' ';
+			// fall through
+		case '7':
+			*board++ = ' ';
+			// fall through
+		case '6':
+			*board++ = ' ';
+			// fall through
+		case '5':
+			*board++ = ' ';
+			// fall through
+		case '4':
+			*board++ = ' ';
+			// fall through
+		case '3':
+			*board++ = ' ';
+			// fall through
+		case '2':
+			*board++ = ' ';
+			// fall through
+		case '1':
+			*board++ = ' ';
+			break;
+		case '/':
+			// ignore
+			break;
+		default:
+			snprintf(q->error, BOOK_ERROR_SIZE, "Unknown FEN board character '%c'", *str);
+			return -1;
+		}
+
+		++str;
+	}
+
+	if (board != end) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "Too few squares in FEN board");
+		return -1;
+	}
+	return 0;
+}
+
+// The board is eight rows of eight bytes, so we can work on a whole row at
+// a time. memcpy() keeps this safe from alignment and aliasing trouble;
+// the compiler turns it into plain loads and stores.
+static uint64_t load_row(const char *board, int y)
+{
+	uint64_t row;
+	memcpy(&row, board + y * 8, 8);
+	return row;
+}
+
+static void store_row(char *board, int y, uint64_t row)
+{
+	memcpy(board + y * 8, &row, 8);
+}
+
+// Pieces are letters, which all have 0x40 set, and empty squares are spaces,
+// which don't; so this swaps the case of all the pieces in the row.
+static uint64_t swap_colors(uint64_t row)
+{
+	return row ^ ((row & 0x4040404040404040ULL) >> 1);
+}
+
+static void invert_board(char *board)
+{
+	int y;
+
+	// flip the board and invert the colors
+	for (y = 0; y < 4; ++y) {
+		uint64_t top = load_row(board, y), bottom = load_row(board, 7 - y);
+		store_row(board, y, swap_colors(bottom));
+		store_row(board, 7 - y, swap_colors(top));
+	}
+}
+
+static int needs_flipping(char *board, char *castling_rights)
+{
+	uint32_t found = 0;
+	int y;
+
+	// never flip if either side can castle
+	if (strcmp(castling_rights, "-") != 0)
+		return 0;
+
+	// look for a 'K' in the left half of each row; a byte in <x> is zero
+	// exactly where there is one, and the usual trick finds zero bytes
+	for (y = 0; y < 8; ++y) {
+		uint32_t x;
+		memcpy(&x, board + y * 8, 4);
+		x ^= 0x4b4b4b4b;
+		found |= (x - 0x01010101) & ~x & 0x80808080;
+	}
+
+	return found != 0;
+}
+
+// horizontal flip
+static void flip_board(char *board, char *eps)
+{
+	int y;
+
+	// flip the board; reversing the bytes of a row does that regardless
+	// of endianness
+	for (y = 0; y < 8; ++y)
+		store_row(board, y, __builtin_bswap64(load_row(board, y)));
+
+	// flip the en passant square
+	if (strcmp(eps, "-") != 0) {
+		int epsc = eps[0] - 'a';
+		eps[0] = 'a' + (7 - epsc);
+	}
+}
+
+// Collects bits for encode_position(), most significant bit first, and
+// writes them out a byte at a time. <acc> has <num_bits> bits in it that
+// are not written out yet, which is less than eight after flush_bits().
+struct bit_writer {
+	unsigned char *out;
+	int len;
+	uint64_t acc;
+	int num_bits;
+};
+
+static void put_bits(struct bit_writer *w, unsigned bits, int len)
+{
+	w->acc = (w->acc << len) | bits;
+	w->num_bits += len;
+}
+
+static void flush_bits(struct bit_writer *w)
+{
+	while (w->num_bits >= 8) {
+		w->num_bits -= 8;
+		w->out[w->len++] = w->acc >> w->num_bits;
+	}
+}
+
+// Writes out the given position as a FEN (at most 96 bytes, including
+// the terminating zero).
+static void format_fen(char *out, char *board, int invert, int flip, char *castling_rights, char *ep_square)
+{
+	int y, x;
+	for (y = 0; y < 8; ++y) {
+		int space = 0;
+		for (x = 0; x < 8; ++x) {
+			int xx = (flip) ? (7-x) : x;
+
+			if (board[y * 8 + xx] == ' ') {
+				++space;
+			} else {
+				if (space != 0)
+					*out++ = '0' + space;
+				*out++ = board[y * 8 + xx];
+				space = 0;
+			}
+		}
+		if (space != 0)
+			*out++ = '0' + space;
+		if (y != 7)
+			*out++ = '/';
+	}
+	*out++ = ' ';
+
+	if (invert)
+		*out++ = 'b';
+	else
+		*out++ = 'w';
+
+	// we only keep track of the en passant column, so the row is implied
+	out += sprintf(out, " %s ", castling_rights);
+	if (strcmp(ep_square, "-") == 0) {
+		sprintf(out, "- 0 0");
+	} else if (flip) {
+		sprintf(out, "%c%c 0 0", 'a' + (7 - (ep_square[0] - 'a')), invert ? '3' : '6');
+	} else {
+		sprintf(out, "%c%c 0 0", ep_square[0], invert ? '3' : '6');
+	}
+}
+
+// Huffman-style code for each board square, indexed by the board character;
+// anything else (which can't happen) is left out of the encoding.
+struct square_code {
+	unsigned char bits, len;
+};
+
+static const struct square_code square_codes[128] = {
+	[' '] = { 0x00, 1 },
+	['p'] = { 0x07, 3 }, ['P'] = { 0x06, 3 },
+	['r'] = { 0x17, 5 }, ['R'] = { 0x16, 5 },
+	['b'] = { 0x15, 5 }, ['B'] = { 0x14, 5 },
+	['n'] = { 0x13, 5 }, ['N'] = { 0x12, 5 },
+	['q'] = { 0x23, 6 }, ['Q'] = { 0x22, 6 },
+	['k'] = { 0x21, 6 }, ['K'] = { 0x20, 6 },
+};
+
+static int encode_position(struct book_query *q, char *board, int invert, char *castling_rights, char *ep_column)
+{
+	// big enough for a board full of queens, which we reject below
+	unsigned char out[64];
+	struct bit_writer w = { out, 1, 0, 0 };   // leave room for the header byte
+	int castling = (strcmp(castling_rights, "-") != 0);
+	int x, y;
+	int ep_any = 0;
+
+	// slightly unusual ordering; a column is at most 48 bits, so it
+	// fits in the accumulator together with what's left over
+	for (x = 0; x < 8; ++x) {
+		for (y = 0; y < 8; ++y) {
+			const struct square_code *code = &square_codes[board[(7-y) * 8 + x] & 0x7f];
+			put_bits(&w, code->bits, code->len);
+		}
+		flush_bits(&w);
+	}
+
+	if (strcmp(ep_column, "-") != 0) {
+		int epcn = ep_column[0] - 'a';
+
+		if ((epcn > 0 && board[3*8 + epcn - 1] == 'P') ||
+		    (epcn < 7 && board[3*8 + epcn + 1] == 'P')) {
+			ep_any = 1;
+		}
+	}
+
+	// really odd padding
+	{
+		int nb = 0;
+		int bits_left = 8 - w.num_bits;
+
+		// find the right number of bits
+		int right = (ep_any) ? 3 : 8;
+
+		// castling needs four more
+		if (castling) {
+			right = right + 4;
+			if (right > 8)
+				right %= 8;
+		}
+
+		if (bits_left > right)
+			nb = bits_left - right;
+		else if (bits_left < right)
+			nb = bits_left + 8 - right;
+
+		if (bits_left == 8 && !castling && !ep_any)
+			nb = 8;
+
+		put_bits(&w, 0, nb);
+	}
+
+	// en passant
+	if (ep_any)
+		put_bits(&w, (ep_column[0] - 'a') & 0x07, 3);
+
+	// castling rights
+	if (castling) {
+		unsigned white = (strchr(castling_rights, 'K') != NULL) << 1 | (strchr(castling_rights, 'Q') != NULL);
+		unsigned black = (strchr(castling_rights, 'k') != NULL) << 1 | (strchr(castling_rights, 'q') != NULL);
+		put_bits(&w, invert ? (white << 2 | black) : (black << 2 | white), 4);
+	}
+
+	// padding stuff
+	flush_bits(&w);
+	if (w.num_bits != 0) {
+		put_bits(&w, 0, 8 - w.num_bits);
+		flush_bits(&w);
+	}
+
+	if (w.len > 32) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "Too many pieces on the board");
+		return -1;
+	}
+
+	// and the header byte
+	out[0] = w.len;
+	if (castling)
+		out[0] |= 0x40;
+	if (ep_any)
+		out[0] |= 0x20;
+
+	memcpy(q->position, out, w.len);
+	memset(q->position + w.len, 0, 32 - w.len);
+	q->pos_len = w.len;
+
+#if DUMP_ENC
+	{
+		int i;
+		for (i = 0; i < q->pos_len; ++i) {
+			printf("%02x ", q->position[i]);
+		}
+		printf("\n");
+	}
+#endif
+	return 0;
+}
+
+// Returns the CTG page the given CTO entry points to, or NO_PAGE if none.
+// (ctg_pages only counts whole pages, so all of it is within the map.)
+static unsigned cto_page(struct book *book, unsigned c)
+{
+	unsigned page;
+
+	if (c >= book->cto_entries)
+		return NO_PAGE;
+
+	page = ntohl(*((unsigned *)(book->cto_map + c * 4 + 16)));
+	if (page >= book->ctg_pages)
+		return NO_PAGE;
+	return page;
+}
+
+static int search_pos(struct book *book, struct book_query *q, unsigned c, unsigned char *key, unsigned len, char *result)
+{
+	unsigned char *pagebuf;
+	unsigned page;
+
+	++q->probes;
+	page = cto_page(book, c);
+	if (page == NO_PAGE)
+		return 0;
+
+	++q->pages_read;
+	pagebuf = book->ctg_map + (size_t)page * 4096 + 4096;
+
+	// search the page
+	{
+		int pos = 4;
+		int page_end = ntohs(*((unsigned short *)(pagebuf + 2)));
+
+		if (page_end > 4096)
+			page_end = 4096;
+
+		// a broken page could point us past its end (and past the
+		// end of the map, on the last page), so check before every read
+		while (pos < page_end) {
+			int entry_len;
+
+			if (pagebuf[pos] != key[0] ||
+			    (int)len > page_end - pos ||
+			    memcmp(pagebuf + pos, key, len) != 0) {
+				// no match, skip through
+				pos += pagebuf[pos] & 0x1f;
+				if (pos >= page_end)
+					break;
+				pos += pagebuf[pos];
+				pos += 33;
+				continue;
+			}
+			pos += pagebuf[pos] & 0x1f;
+			if (pos >= page_end)
+				break;
+			entry_len = pagebuf[pos] + 33;
+			if (entry_len > page_end - pos)
+				entry_len = page_end - pos;
+			if (entry_len > CTG_RESULT_SIZE)
+				entry_len = CTG_RESULT_SIZE;
+			memcpy(result, pagebuf + pos, entry_len);
+			memset(result + entry_len, 0, CTG_RESULT_SIZE - entry_len);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// The first CTO entry lookup_position() will look at, or NO_PAGE if none.
+// This is nearly always the one holding the position, if it's in the book.
+static unsigned first_slot(struct book *book, struct book_query *q, unsigned char *pos, unsigned len)
+{
+	uint64_t start = profile_now(q);
+	int hash = gen_hash(pos, len);
+	int n;
+
+	profile_lap(q, &start, &q->ns_hash);
+
+	for (n = 0; n < 0x7fffffff; n = 2 * n + 1) {
+		unsigned c = (hash & n) + n;
+
+		if (c >= book->page_bounds_low)
+			return c;
+	}
+	return NO_PAGE;
+}
+
+static int lookup_position(struct book *book, struct book_query *q, unsigned char *pos, unsigned len, char *result)
+{
+	uint64_t start = profile_now(q);
+	int hash = gen_hash(pos, len);
+	int n, found = 0;
+
+	profile_lap(q, &start, &q->ns_hash);
+
+	for (n = 0; n < 0x7fffffff; n = 2 * n + 1) {
+		unsigned c = (hash & n) + n;
+
+		if (c < book->page_bounds_low)
+			continue;
+
+		if (search_pos(book, q, c, pos, len, result)) {
+			found = 1;
+			break;
+		}
+
+		if (c >= book->page_bounds_high)
+			break;
+	}
+
+	profile_lap(q, &start, &q->ns_search);
+	return found;
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+	unsigned pa = *(const unsigned *)a, pb = *(const unsigned *)b;
+	return (pa > pb) - (pa < pb);
+}
+
+// Tells the kernel we're about to need the given CTG pages, so that
+// reading them in (if they're not in the page cache already) happens in
+// parallel instead of one page fault at a time. Sorts <pages>.
+static void prefetch_pages(struct book *book, unsigned *pages, int num_pages)
+{
+	int i, j;
+
+	qsort(pages, num_pages, sizeof(unsigned), compare_pages);
+
+	// one call per run of adjacent pages
+	for (i = 0; i < num_pages; i = j) {
+		size_t start, end;
+
+		for (j = i + 1; j < num_pages && pages[j] <= pages[j - 1] + 1; ++j)
+			;
+		start = (size_t)pages[i] * 4096 + 4096;
+		end = (size_t)pages[j - 1] * 4096 + 8192;
+		start &= ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+		madvise(book->ctg_map + start, end - start, MADV_WILLNEED);
+	}
+}
+
+// If <fd_out> is non-NULL, the file is kept open and its descriptor stored there.
+static unsigned char *map_file(const char *filename, size_t *size, int flags, int *fd_out, char *error)
+{
+	struct stat st;
+	void *ptr;
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		snprintf(error, BOOK_ERROR_SIZE, "%s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		snprintf(error, BOOK_ERROR_SIZE, "%s: %s", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | flags, fd, 0);
+	if (ptr == MAP_FAILED) {
+		snprintf(error, BOOK_ERROR_SIZE, "%s: %s", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (fd_out != NULL)
+		*fd_out = fd;
+	else
+		close(fd);
+
+	*size = st.st_size;
+	return ptr;
+}
+
+struct book *book_open(const char *ctg_filename, const char *cto_filename, const char *ctb_filename, char *error)
+{
+	struct book *book;
+	unsigned char header[12];
+	int ctb_fd;
+
+	book = calloc(1, sizeof(*book));
+	if (book == NULL) {
+		snprintf(error, BOOK_ERROR_SIZE, "Out of memory");
+		return NULL;
+	}
+	book->ctg_fd = book->index_fd = -1;
+
+	// The CTO file is small and is hit on every probe, so make sure
+	// all of it is in RAM right away.
+	book->cto_map = map_file(cto_filename, &book->cto_size, MAP_POPULATE, NULL, error);
+	if (book->cto_map == NULL) {
+		book_close(book);
+		return NULL;
+	}
+	book->cto_entries = (book->cto_size < 16) ? 0 : (book->cto_size - 16) / 4;
+
+	// The CTG file is big, and we only ever touch single pages of it.
+	book->ctg_map = map_file(ctg_filename, &book->ctg_size, 0, &book->ctg_fd, error);
+	if (book->ctg_map == NULL) {
+		book_close(book);
+		return NULL;
+	}
+	book->ctg_pages = (book->ctg_size < 4096) ? 0 : (book->ctg_size - 4096) / 4096;
+	madvise(book->ctg_map, book->ctg_size, MADV_RANDOM);
+
+	// The CTB file holds the range of CTO entries that are in use.
+	// If we can't get at it, fall back to the values for RybkaII.
+	book->page_bounds_low = 0x80e0;
+	book->page_bounds_high = 0x1fd00;
+	ctb_fd = open(ctb_filename, O_RDONLY);
+	if (ctb_fd != -1) {
+		if (read(ctb_fd, header, 12) == 12) {
+			book->page_bounds_low = ntohl(*((unsigned *)(header + 4)));
+			book->page_bounds_high = ntohl(*((unsigned *)(header + 8)));
+		}
+		close(ctb_fd);
+	}
+	return book;
+}
+
+void book_close(struct book *book)
+{
+	if (book->cto_map != NULL)
+		munmap(book->cto_map, book->cto_size);
+	if (book->ctg_map != NULL)
+		munmap(book->ctg_map, book->ctg_size);
+	if (book->index_map != NULL)
+		munmap(book->index_map, book->index_size);
+	if (book->ctg_fd != -1)
+		close(book->ctg_fd);
+	if (book->index_fd != -1)
+		close(book->index_fd);
+	if (book->cache != NULL)
+		cache_free(book->cache);
+	free(book);
+}
+
+void book_drop_cache(struct book *book)
+{
+	// our own mapping keeps the pages in the cache, so drop that first
+	if (book->ctg_map != NULL) {
+		madvise(book->ctg_map, book->ctg_size, MADV_DONTNEED);
+		posix_fadvise(book->ctg_fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	if (book->index_map != NULL) {
+		madvise(book->index_map, book->index_size, MADV_DONTNEED);
+		posix_fadvise(book->index_fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+}
+
+// A book can be converted (with book_build_index()) into a flat file of
+// fixed-size records sorted by a 64-bit hash of the encoded position,
+// which can be searched directly instead of going through the CTO and CTG
+// pages, and already has the moves decoded. All numbers are big-endian.
+//
+//   header (32 bytes):     "BOOKIDX1", number of positions (4 bytes),
+//                          number of moves (4 bytes), 16 reserved bytes
+//   position (40 bytes):   key (8 bytes), index of first move (4 bytes),
+//                          number of moves (4 bytes), stats (20 bytes),
+//                          4 reserved bytes
+//   move (24 bytes):       from square, to square, annotation, 1 reserved
+//                          byte, stats for the position after the move
+//                          (20 bytes)
+//
+// Stats are wins, draws, losses, rating and rating_div, four bytes each.
+// Squares and stats are as in struct book_move and struct book_stats.
+#define INDEX_HEADER_SIZE 32
+#define INDEX_POSITION_SIZE 40
+#define INDEX_MOVE_SIZE 24
+
+// FNV-1a
+uint64_t book_position_key(const unsigned char *pos, int len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= pos[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static unsigned get_be32(unsigned char *ptr)
+{
+	return ((unsigned)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+}
+
+static uint64_t get_be64(unsigned char *ptr)
+{
+	return ((uint64_t)get_be32(ptr) << 32) | get_be32(ptr + 4);
+}
+
+static void put_be32(unsigned char *ptr, unsigned x)
+{
+	ptr[0] = x >> 24;
+	ptr[1] = x >> 16;
+	ptr[2] = x >> 8;
+	ptr[3] = x;
+}
+
+static void put_be64(unsigned char *ptr, uint64_t x)
+{
+	put_be32(ptr, x >> 32);
+	put_be32(ptr + 4, x);
+}
+
+static void get_index_stats(unsigned char *ptr, struct book_stats *stats)
+{
+	stats->wins = get_be32(ptr);
+	stats->draws = get_be32(ptr + 4);
+	stats->losses = get_be32(ptr + 8);
+	stats->rating = get_be32(ptr + 12);
+	stats->rating_div = get_be32(ptr + 16);
+}
+
+static void put_index_stats(unsigned char *ptr, struct book_stats *stats)
+{
+	put_be32(ptr, stats->wins);
+	put_be32(ptr + 4, stats->draws);
+	put_be32(ptr + 8, stats->losses);
+	put_be32(ptr + 12, stats->rating);
+	put_be32(ptr + 16, stats->rating_div);
+}
+
+struct book *book_open_index(const char *filename, char *error)
+{
+	struct book *book;
+
+	book = calloc(1, sizeof(*book));
+	if (book == NULL) {
+		snprintf(error, BOOK_ERROR_SIZE, "Out of memory");
+		return NULL;
+	}
+	book->ctg_fd = book->index_fd = -1;
+
+	book->index_map = map_file(filename, &book->index_size, 0, &book->index_fd, error);
+	if (book->index_map == NULL) {
+		book_close(book);
+		return NULL;
+	}
+	if (book->index_size < INDEX_HEADER_SIZE || memcmp(book->index_map, "BOOKIDX1", 8) != 0) {
+		snprintf(error, BOOK_ERROR_SIZE, "%s: Not a book index", filename);
+		book_close(book);
+		return NULL;
+	}
+	book->index_positions = get_be32(book->index_map + 8);
+	book->index_moves = get_be32(book->index_map + 12);
+	if (book->index_size < INDEX_HEADER_SIZE + book->index_positions * INDEX_POSITION_SIZE + book->index_moves * INDEX_MOVE_SIZE) {
+		snprintf(error, BOOK_ERROR_SIZE, "%s: Truncated book index", filename);
+		book_close(book);
+		return NULL;
+	}
+	madvise(book->index_map, book->index_size, MADV_RANDOM);
+	return book;
+}
+
+static uint64_t index_key(struct book *book, struct book_query *q, size_t i)
+{
+	++q->probes;
+	return get_be64(book->index_map + INDEX_HEADER_SIZE + i * INDEX_POSITION_SIZE);
+}
+
+// Finds the given key in the index, and fills in <entry> (except for the
+// child keys and FENs, which we don't store). The keys are hashes, and thus
+// close to uniformly distributed, so we use interpolation search, which
+// only needs a couple of probes even for big books.
+static int index_lookup(struct book *book, struct book_query *q, uint64_t key, struct book_entry *entry)
+{
+	size_t lo = 0, hi = book->index_positions;   // [lo, hi)
+	unsigned char *ptr, *move_ptr;
+	unsigned first_move;
+	int i;
+
+	while (lo < hi) {
+		uint64_t lo_key = index_key(book, q, lo), hi_key = index_key(book, q, hi - 1), mid_key;
+		size_t mid;
+
+		if (key < lo_key || key > hi_key)
+			return 0;
+		if (hi_key == lo_key)
+			mid = lo;
+		else
+			mid = lo + (size_t)((double)(key - lo_key) / (double)(hi_key - lo_key) * (hi - 1 - lo));
+
+		mid_key = index_key(book, q, mid);
+		if (mid_key == key) {
+			lo = mid;
+			break;
+		}
+		if (mid_key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo >= hi)
+		return 0;
+
+	ptr = book->index_map + INDEX_HEADER_SIZE + lo * INDEX_POSITION_SIZE;
+	first_move = get_be32(ptr + 8);
+	entry->num_moves = get_be32(ptr + 12);
+	if (entry->num_moves > 128 || first_move + entry->num_moves > book->index_moves) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "Corrupted book index");
+		return -1;
+	}
+	get_index_stats(ptr + 16, &entry->stats);
+
+	move_ptr = book->index_map + INDEX_HEADER_SIZE + book->index_positions * INDEX_POSITION_SIZE + (size_t)first_move * INDEX_MOVE_SIZE;
+	for (i = 0; i < entry->num_moves; ++i, move_ptr += INDEX_MOVE_SIZE) {
+		struct book_move *move = &entry->moves[i];
+		move->from_square = move_ptr[0] & 63;
+		move->to_square = move_ptr[1] & 63;
+		move->annotation = move_ptr[2];
+		get_index_stats(move_ptr + 4, &move->stats);
+		move->child_key_len = 0;
+	}
+	return 1;
+}
+
+// The result cache from book_cache_open(). It is a single mapping
+// (anonymous, or of the cache file), laid out as
+//
+//   struct cache_header
+//   bucket heads (num_buckets * 4 bytes)
+//   slots (capacity * struct cache_slot)
+//
+// Slots are chained from their hash bucket and kept in a doubly linked
+// list in LRU order; links are slot numbers, with -1 meaning none. Slots
+// are handed out in order until the cache is full, and after that, we
+// reuse the least recently used one. Everything is in host byte order,
+// so the file is not meant to be moved between machines.
+#define CACHE_MAGIC "BOOKCCH1"
+
+struct cache_header {
+	char magic[8];
+	uint32_t capacity, num_buckets, slot_size;
+
+	// cleared while the file is in use, so that if a process dies in the
+	// middle of an update, the next one starts over instead of trusting
+	// half-updated links
+	uint32_t clean;
+
+	// the book file the results came from, so that we don't serve stale
+	// results after the book is replaced
+	uint64_t book_size, book_mtime;
+
+	int32_t lru_head, lru_tail;   // most and least recently used
+	uint32_t used;
+	uint64_t hits, misses, evictions;
+};
+
+struct cache_move {
+	unsigned char from_square, to_square, annotation, reserved;
+	struct book_stats stats;
+};
+
+struct cache_slot {
+	int32_t prev, next;   // in LRU order
+	int32_t chain;        // next slot in the same bucket
+	unsigned char key[32];
+	unsigned char key_len, found, num_moves, reserved;
+	struct book_stats stats;
+	struct cache_move moves[128];
+};
+
+struct book_cache {
+	// flock() on the file keeps other processes out of it, and the mutex
+	// only protects it between our own threads; it lives in our memory,
+	// not in the map, so the cache must not be used across fork()
+	// (booklook only opens it in its single-process modes)
+	pthread_mutex_t mutex;
+	unsigned char *map;
+	size_t map_size;
+	int fd;
+
+	struct cache_header *header;
+	int32_t *buckets;
+	struct cache_slot *slots;
+};
+
+static void cache_reset(struct book_cache *cache, uint32_t capacity, uint32_t num_buckets, struct stat *book_st)
+{
+	struct cache_header *header = cache->header;
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, CACHE_MAGIC, 8);
+	header->capacity = capacity;
+	header->num_buckets = num_buckets;
+	header->slot_size = sizeof(struct cache_slot);
+	header->book_size = book_st->st_size;
+	header->book_mtime = book_st->st_mtime;
+	header->lru_head = header->lru_tail = -1;
+	memset(cache->buckets, 0xff, num_buckets * sizeof(int32_t));
+}
+
+static void cache_free(struct book_cache *cache)
+{
+	if (cache->map != NULL) {
+		cache->header->clean = 1;
+		munmap(cache->map, cache->map_size);
+	}
+	if (cache->fd != -1)
+		close(cache->fd);
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+int book_cache_open(struct book *book, size_t capacity, const char *filename, char *error)
+{
+	struct book_cache *cache;
+	struct cache_header *header;
+	struct stat book_st;
+	uint32_t num_buckets = 2;
+	void *map;
+
+	if (book->cache != NULL) {
+		snprintf(error, BOOK_ERROR_SIZE, "Book already has a cache");
+		return -1;
+	}
+	if (capacity == 0 || capacity > (1 << 24)) {
+		snprintf(error, BOOK_ERROR_SIZE, "Invalid cache size %zu", capacity);
+		return -1;
+	}
+	while (num_buckets < capacity * 2)
+		num_buckets *= 2;
+	if (fstat(book->index_map != NULL ? book->index_fd : book->ctg_fd, &book_st) == -1) {
+		snprintf(error, BOOK_ERROR_SIZE, "fstat: %s", strerror(errno));
+		return -1;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		snprintf(error, BOOK_ERROR_SIZE, "Out of memory");
+		return -1;
+	}
+	pthread_mutex_init(&cache->mutex, NULL);
+	cache->fd = -1;
+	cache->map_size = sizeof(struct cache_header) + num_buckets * sizeof(int32_t) + capacity * sizeof(struct cache_slot);
+
+	if (filename == NULL) {
+		map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		struct stat st;
+
+		cache->fd = open(filename, O_RDWR | O_CREAT, 0644);
+		if (cache->fd == -1) {
+			snprintf(error, BOOK_ERROR_SIZE, "%.200s: %s", filename, strerror(errno));
+			cache_free(cache);
+			return -1;
+		}
+		if (flock(cache->fd, LOCK_EX | LOCK_NB) == -1) {
+			snprintf(error, BOOK_ERROR_SIZE, "%.200s: %s", filename,
+				(errno == EWOULDBLOCK) ? "In use by another process" : strerror(errno));
+			cache_free(cache);
+			return -1;
+		}
+
+		// the file is sparse, so slots we never use don't take up disk space
+		if (fstat(cache->fd, &st) == -1 ||
+		    ((size_t)st.st_size != cache->map_size && ftruncate(cache->fd, cache->map_size) == -1)) {
+			snprintf(error, BOOK_ERROR_SIZE, "%.200s: %s", filename, strerror(errno));
+			cache_free(cache);
+			return -1;
+		}
+		map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		snprintf(error, BOOK_ERROR_SIZE, "mmap: %s", strerror(errno));
+		cache_free(cache);
+		return -1;
+	}
+
+	cache->map = map;
+	cache->header = header = map;
+	cache->buckets = (int32_t *)(cache->map + sizeof(struct cache_header));
+	cache->slots = (struct cache_slot *)(cache->buckets + num_buckets);
+
+	if (memcmp(header->magic, CACHE_MAGIC, 8) != 0 ||
+	    header->capacity != capacity ||
+	    header->num_buckets != num_buckets ||
+	    header->slot_size != sizeof(struct cache_slot) ||
+	    !header->clean ||
+	    header->book_size != (uint64_t)book_st.st_size ||
+	    header->book_mtime != (uint64_t)book_st.st_mtime) {
+		cache_reset(cache, capacity, num_buckets, &book_st);
+	}
+	header->clean = 0;
+
+	book->cache = cache;
+	return 0;
+}
+
+int book_get_cache_stats(struct book *book, struct book_cache_stats *stats)
+{
+	struct book_cache *cache = book->cache;
+
+	if (cache == NULL)
+		return -1;
+
+	pthread_mutex_lock(&cache->mutex);
+	stats->hits = cache->header->hits;
+	stats->misses = cache->header->misses;
+	stats->evictions = cache->header->evictions;
+	stats->entries = cache->header->used;
+	stats->capacity = cache->header->capacity;
+	pthread_mutex_unlock(&cache->mutex);
+	return 0;
+}
+
+static int32_t *cache_bucket(struct book_cache *cache, const unsigned char *key, int len)
+{
+	return &cache->buckets[book_position_key(key, len) & (cache->header->num_buckets - 1)];
+}
+
+static int32_t cache_find(struct book_cache *cache, const unsigned char *key, int len)
+{
+	int32_t i;
+
+	for (i = *cache_bucket(cache, key, len); i != -1; i = cache->slots[i].chain) {
+		struct cache_slot *slot = &cache->slots[i];
+		if (slot->key_len == len && memcmp(slot->key, key, len) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void cache_unlink(struct book_cache *cache, int32_t i)
+{
+	struct cache_slot *slot = &cache->slots[i];
+
+	if (slot->prev == -1)
+		cache->header->lru_head = slot->next;
+	else
+		cache->slots[slot->prev].next = slot->next;
+	if (slot->next == -1)
+		cache->header->lru_tail = slot->prev;
+	else
+		cache->slots[slot->next].prev = slot->prev;
+}
+
+static void cache_push_front(struct book_cache *cache, int32_t i)
+{
+	struct cache_slot *slot = &cache->slots[i];
+
+	slot->prev = -1;
+	slot->next = cache->header->lru_head;
+	if (slot->next == -1)
+		cache->header->lru_tail = i;
+	else
+		cache->slots[slot->next].prev = i;
+	cache->header->lru_head = i;
+}
+
+// If the position in entry->key is in the cache, fills in the rest of
+// <entry> like index_lookup() would, sets <*found> and returns 1.
+static int cache_get(struct book_cache *cache, struct book_entry *entry, int *found)
+{
+	struct cache_slot *slot;
+	int32_t i;
+	int j;
+
+	pthread_mutex_lock(&cache->mutex);
+	i = cache_find(cache, entry->key, entry->key_len);
+	if (i == -1) {
+		++cache->header->misses;
+		pthread_mutex_unlock(&cache->mutex);
+		return 0;
+	}
+	++cache->header->hits;
+	cache_unlink(cache, i);
+	cache_push_front(cache, i);
+
+	slot = &cache->slots[i];
+	*found = slot->found;
+	entry->stats = slot->stats;
+	entry->num_moves = (slot->num_moves > 128) ? 128 : slot->num_moves;
+	for (j = 0; j < entry->num_moves; ++j) {
+		struct book_move *move = &entry->moves[j];
+		move->from_square = slot->moves[j].from_square & 63;
+		move->to_square = slot->moves[j].to_square & 63;
+		move->annotation = slot->moves[j].annotation;
+		move->stats = slot->moves[j].stats;
+		move->child_key_len = 0;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return 1;
+}
+
+static void cache_put(struct book_cache *cache, struct book_entry *entry, int found)
+{
+	struct cache_header *header = cache->header;
+	struct cache_slot *slot;
+	int32_t *bucket, i;
+	int j;
+
+	pthread_mutex_lock(&cache->mutex);
+	i = cache_find(cache, entry->key, entry->key_len);
+	if (i != -1) {
+		// another thread got here first; the result is the same
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+
+	if (header->used < header->capacity) {
+		i = header->used++;
+	} else {
+		i = header->lru_tail;
+		slot = &cache->slots[i];
+		cache_unlink(cache, i);
+		for (bucket = cache_bucket(cache, slot->key, slot->key_len); *bucket != i; bucket = &cache->slots[*bucket].chain)
+			;
+		*bucket = slot->chain;
+		++header->evictions;
+	}
+
+	slot = &cache->slots[i];
+	memcpy(slot->key, entry->key, entry->key_len);
+	slot->key_len = entry->key_len;
+	slot->found = found;
+	slot->num_moves = found ? entry->num_moves : 0;
+	memset(&slot->stats, 0, sizeof(slot->stats));
+	if (found)
+		slot->stats = entry->stats;
+	for (j = 0; j < slot->num_moves; ++j) {
+		struct book_move *move = &entry->moves[j];
+		slot->moves[j].from_square = move->from_square;
+		slot->moves[j].to_square = move->to_square;
+		slot->moves[j].annotation = move->annotation;
+		slot->moves[j].reserved = 0;
+		slot->moves[j].stats = move->stats;
+	}
+
+	bucket = cache_bucket(cache, entry->key, entry->key_len);
+	slot->chain = *bucket;
+	*bucket = i;
+	cache_push_front(cache, i);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+// indexed by the move's encoding byte; piece == 0 means an unknown encoding
+struct moveenc {
+	char piece;
+	int num;
+	int forward, right;
+};
+static const struct moveenc movetable[256] = {
+	[0x00] = { 'P', 5,  1,  1 },
+	[0x01] = { 'N', 2, -1, -2 },
+	[0x03] = { 'Q', 2,  0,  2 },
+	[0x04] = { 'P', 2,  1,  0 },
+	[0x05] = { 'Q', 1,  1,  0 },
+	[0x06] = { 'P', 4,  1, -1 },
+	[0x08] = { 'Q', 2,  0,  4 },
+	[0x09] = { 'B', 2,  6,  6 },
+	[0x0a] = { 'K', 1, -1,  0 },
+	[0x0c] = { 'P', 1,  1, -1 },
+	[0x0d] = { 'B', 1,  3,  3 },
+	[0x0e] = { 'R', 2,  0,  3 },
+	[0x0f] = { 'N', 1, -1, -2 },
+	[0x12] = { 'B', 1,  7,  7 },
+	[0x13] = { 'K', 1,  1,  0 },
+	[0x14] = { 'P', 8,  1,  1 },
+	[0x15] = { 'B', 1,  5,  5 },
+	[0x18] = { 'P', 7,  1,  0 },
+	[0x1a] = { 'Q', 2,  6,  0 },
+	[0x1b] = { 'B', 1,  1, -1 },
+	[0x1d] = { 'B', 2,  7,  7 },
+	[0x21] = { 'R', 2,  0,  7 },
+	[0x22] = { 'B', 2,  2, -2 },
+	[0x23] = { 'Q', 2,  6,  6 },
+	[0x24] = { 'P', 8,  1, -1 },
+	[0x26] = { 'B', 1,  7, -7 },
+	[0x27] = { 'P', 3,  1, -1 },
+	[0x28] = { 'Q', 1,  5,  5 },
+	[0x29] = { 'Q', 1,  0,  6 },
+	[0x2a] = { 'N', 2, -2,  1 },
+	[0x2d] = { 'P', 6,  1,  1 },
+	[0x2e] = { 'B', 1,  1,  1 },
+	[0x2f] = { 'Q', 1,  0,  1 },
+	[0x30] = { 'N', 2, -2, -1 },
+	[0x31] = { 'Q', 1,  0,  3 },
+	[0x32] = { 'B', 2,  5,  5 },
+	[0x34] = { 'N', 1,  2,  1 },
+	[0x36] = { 'N', 1,  1,  2 },
+	[0x37] = { 'Q', 1,  4,  0 },
+	[0x38] = { 'Q', 2,  4, -4 },
+	[0x39] = { 'Q', 1,  0,  5 },
+	[0x3a] = { 'B', 1,  6,  6 },
+	[0x3b] = { 'Q', 2,  5, -5 },
+	[0x3c] = { 'B', 1,  5, -5 },
+	[0x41] = { 'Q', 2,  5,  5 },
+	[0x42] = { 'Q', 1,  7, -7 },
+	[0x44] = { 'K', 1, -1,  1 },
+	[0x45] = { 'Q', 1,  3,  3 },
+	[0x4a] = { 'P', 8,  2,  0 },
+	[0x4b] = { 'Q', 1,  5, -5 },
+	[0x4c] = { 'N', 2,  2,  1 },
+	[0x4d] = { 'Q', 2,  1,  0 },
+	[0x50] = { 'R', 1,  6,  0 },
+	[0x52] = { 'R', 1,  0,  6 },
+	[0x54] = { 'B', 2,  1, -1 },
+	[0x55] = { 'P', 3,  1,  0 },
+	[0x5c] = { 'P', 7,  1,  1 },
+	[0x5f] = { 'P', 5,  2,  0 },
+	[0x61] = { 'Q', 1,  6,  6 },
+	[0x62] = { 'P', 2,  2,  0 },
+	[0x63] = { 'Q', 2,  7, -7 },
+	[0x66] = { 'B', 1,  3, -3 },
+	[0x67] = { 'K', 1,  1,  1 },
+	[0x69] = { 'R', 2,  7,  0 },
+	[0x6a] = { 'B', 1,  4,  4 },
+	[0x6b] = { 'K', 1,  0,  2 },   /* short castling */
+	[0x6e] = { 'R', 1,  0,  5 },
+	[0x6f] = { 'Q', 2,  7,  7 },
+	[0x72] = { 'B', 2,  7, -7 },
+	[0x74] = { 'Q', 1,  0,  2 },
+	[0x79] = { 'B', 2,  6, -6 },
+	[0x7a] = { 'R', 1,  3,  0 },
+	[0x7b] = { 'R', 2,  6,  0 },
+	[0x7c] = { 'P', 3,  1,  1 },
+	[0x7d] = { 'R', 2,  1,  0 },
+	[0x7e] = { 'Q', 1,  3, -3 },
+	[0x7f] = { 'R', 1,  0,  1 },
+	[0x80] = { 'Q', 1,  6, -6 },
+	[0x81] = { 'R', 1,  1,  0 },
+	[0x82] = { 'P', 6,  1, -1 },
+	[0x85] = { 'N', 1,  2, -1 },
+	[0x86] = { 'R', 1,  0,  7 },
+	[0x87] = { 'R', 1,  5,  0 },
+	[0x8a] = { 'N', 1, -2,  1 },
+	[0x8b] = { 'P', 1,  1,  1 },
+	[0x8c] = { 'K', 1, -1, -1 },
+	[0x8e] = { 'Q', 2,  2, -2 },
+	[0x8f] = { 'Q', 1,  0,  7 },
+	[0x92] = { 'Q', 2,  1,  1 },
+	[0x94] = { 'Q', 1,  3,  0 },
+	[0x96] = { 'P', 2,  1,  1 },
+	[0x97] = { 'K', 1,  0, -1 },
+	[0x98] = { 'R', 1,  0,  3 },
+	[0x99] = { 'R', 1,  4,  0 },
+	[0x9a] = { 'Q', 1,  6,  0 },
+	[0x9b] = { 'P', 3,  2,  0 },
+	[0x9d] = { 'Q', 1,  2,  0 },
+	[0x9f] = { 'B', 2,  4, -4 },
+	[0xa0] = { 'Q', 2,  3,  0 },
+	[0xa2] = { 'Q', 1,  2,  2 },
+	[0xa3] = { 'P', 8,  1,  0 },
+	[0xa5] = { 'R', 2,  5,  0 },
+	[0xa9] = { 'R', 2,  0,  2 },
+	[0xab] = { 'Q', 2,  6, -6 },
+	[0xad] = { 'R', 2,  0,  4 },
+	[0xae] = { 'Q', 2,  3,  3 },
+	[0xb0] = { 'Q', 2,  4,  0 },
+	[0xb1] = { 'P', 6,  2,  0 },
+	[0xb2] = { 'B', 1,  6, -6 },
+	[0xb5] = { 'R', 2,  0,  5 },
+	[0xb7] = { 'Q', 1,  5,  0 },
+	[0xb9] = { 'B', 2,  3,  3 },
+	[0xbb] = { 'P', 5,  1,  0 },
+	[0xbc] = { 'Q', 2,  0,  5 },
+	[0xbd] = { 'Q', 2,  2,  0 },
+	[0xbe] = { 'K', 1,  0,  1 },
+	[0xc1] = { 'B', 1,  2,  2 },
+	[0xc2] = { 'B', 2,  2,  2 },
+	[0xc3] = { 'B', 1,  2, -2 },
+	[0xc4] = { 'R', 2,  0,  1 },
+	[0xc5] = { 'R', 2,  4,  0 },
+	[0xc6] = { 'Q', 2,  5,  0 },
+	[0xc7] = { 'P', 7,  1, -1 },
+	[0xc8] = { 'P', 7,  2,  0 },
+	[0xc9] = { 'Q', 2,  7,  0 },
+	[0xca] = { 'B', 2,  3, -3 },
+	[0xcb] = { 'P', 6,  1,  0 },
+	[0xcc] = { 'B', 2,  5, -5 },
+	[0xcd] = { 'R', 1,  0,  2 },
+	[0xcf] = { 'P', 4,  1,  0 },
+	[0xd1] = { 'P', 2,  1, -1 },
+	[0xd2] = { 'N', 2,  1,  2 },
+	[0xd3] = { 'N', 2,  1, -2 },
+	[0xd7] = { 'Q', 1,  1, -1 },
+	[0xd8] = { 'R', 2,  0,  6 },
+	[0xd9] = { 'Q', 1,  2, -2 },
+	[0xda] = { 'N', 1, -2, -1 },
+	[0xdb] = { 'P', 1,  2,  0 },
+	[0xde] = { 'P', 5,  1, -1 },
+	[0xdf] = { 'K', 1,  1, -1 },
+	[0xe0] = { 'N', 2, -1,  2 },
+	[0xe1] = { 'R', 1,  7,  0 },
+	[0xe3] = { 'R', 2,  3,  0 },
+	[0xe5] = { 'Q', 1,  0,  4 },
+	[0xe6] = { 'P', 4,  2,  0 },
+	[0xe7] = { 'Q', 1,  4,  4 },
+	[0xe8] = { 'R', 1,  2,  0 },
+	[0xe9] = { 'N', 1, -1,  2 },
+	[0xeb] = { 'P', 4,  1,  1 },
+	[0xec] = { 'P', 1,  1,  0 },
+	[0xed] = { 'Q', 1,  7,  7 },
+	[0xee] = { 'Q', 2,  1, -1 },
+	[0xef] = { 'R', 1,  0,  4 },
+	[0xf0] = { 'Q', 2,  0,  7 },
+	[0xf1] = { 'Q', 1,  1,  1 },
+	[0xf3] = { 'N', 2,  2, -1 },
+	[0xf4] = { 'R', 2,  2,  0 },
+	[0xf5] = { 'B', 2,  1,  1 },
+	[0xf6] = { 'K', 1,  0, -2 },   /* long castling */
+	[0xf7] = { 'N', 1,  1, -2 },
+	[0xf8] = { 'Q', 2,  0,  1 },
+	[0xf9] = { 'Q', 2,  6,  0 },
+	[0xfa] = { 'Q', 2,  0,  3 },
+	[0xfb] = { 'Q', 2,  2,  2 },
+	[0xfd] = { 'Q', 1,  7,  0 },
+	[0xfe] = { 'Q', 2,  3, -3 }
+};
+
+// the squares of each of our pieces, in the order the move encoding
+// counts them (file by file, from the bottom up)
+struct piece_list {
+	int count[6];
+	int square[6][16];
+};
+
+// 0 = none; otherwise one more than the index into struct piece_list
+static const signed char piece_type[128] = {
+	['P'] = 1, ['N'] = 2, ['B'] = 3, ['R'] = 4, ['Q'] = 5, ['K'] = 6
+};
+
+static void find_pieces(char *board, struct piece_list *pieces)
+{
+	int y, x;
+
+	memset(pieces->count, 0, sizeof(pieces->count));
+	for (x = 0; x < 8; ++x) {
+		for (y = 0; y < 8; ++y) {
+			int type = piece_type[board[(7-y) * 8 + x] & 0x7f] - 1;
+			if (type == -1 || pieces->count[type] == 16)
+				continue;
+			pieces->square[type][pieces->count[type]++] = y * 8 + x;
+		}
+	}
+}
+
+static int find_piece(struct book_query *q, struct piece_list *pieces, char piece, int num)
+{
+	int type = piece_type[piece & 0x7f] - 1;
+	if (type != -1 && num >= 1 && num <= pieces->count[type])
+		return pieces->square[type][num - 1];
+
+	snprintf(q->error, BOOK_ERROR_SIZE, "Couldn't find piece '%c' number %u", piece, num);
+	return -1;
+}
+
+static void execute_move(char *board, char *castling_rights, int inverted, char *ep_square, int from_square, int to_square)
+{
+	int black_ks, black_qs, white_ks, white_qs;
+
+	// fudge
+	from_square = (7 - (from_square / 8)) * 8 + (from_square % 8);
+	to_square = (7 - (to_square / 8)) * 8 + (to_square % 8);
+
+	// compute the new castling rights
+	black_ks = (strchr(castling_rights, 'k') != NULL);
+	black_qs = (strchr(castling_rights, 'q') != NULL);
+	white_ks = (strchr(castling_rights, 'K') != NULL);
+	white_qs = (strchr(castling_rights, 'Q') != NULL);
+
+	if (board[from_square] == 'K') {
+		if (inverted)
+			black_ks = black_qs = 0;
+		else
+			white_ks = white_qs = 0;
+	}
+	if (board[from_square] == 'R') {
+		if (inverted) {
+			if (from_square == 56) // h1
+				black_qs = 0;
+			else if (from_square == 63) // h8
+				black_ks = 0;
+		} else {
+			if (from_square == 56) // a1
+				white_qs = 0;
+			else if (from_square == 63) // a8
+				white_ks = 0;
+		}
+	}
+	if (board[to_square] == 'r') {
+		if (inverted) {
+			if (to_square == 0) // h1
+				white_qs = 0;
+			else if (to_square == 7) // h8
+				white_ks = 0;
+		} else {
+			if (to_square == 0) // a1
+				black_qs = 0;
+			else if (to_square == 7) // a8
+				black_ks = 0;
+		}
+	}
+
+	if ((black_ks | black_qs | white_ks | white_qs) == 0) {
+		strcpy(castling_rights, "-");
+	} else {
+		strcpy(castling_rights, "");
+
+		if (white_ks)
+			strcat(castling_rights, "K");
+		if (white_qs)
+			strcat(castling_rights, "Q");
+		if (black_ks)
+			strcat(castling_rights, "k");
+		if (black_qs)
+			strcat(castling_rights, "q");
+	}
+
+	// now the ep square
+	if (board[from_square] == 'P' && to_square - from_square == -16) {
+		sprintf(ep_square, "%c%c", "abcdefgh"[from_square % 8], '0' + from_square / 8);
+	} else {
+		strcpy(ep_square, "-");
+	}
+
+	// is this move an en passant capture?
+	if (board[from_square] == 'P' && board[to_square] == ' ' &&
+	    (to_square - from_square == -9 || to_square - from_square == -7)) {
+	 	board[to_square + 8] = ' ';   	
+	}
+
+	// make the move
+	board[to_square] = board[from_square];
+	board[from_square] = ' ';
+
+	// promotion
+	if (board[to_square] == 'P' && to_square < 8)
+		board[to_square] = 'Q';
+
+	if (board[to_square] == 'K' && to_square - from_square == 2) {
+		// short castling
+		board[to_square - 1] = 'R';
+		board[to_square + 1] = ' ';
+	} else if (board[to_square] == 'K' && to_square - from_square == -2) {
+		// long castling
+		board[to_square + 1] = 'R';
+		board[to_square - 2] = ' ';
+	}
+
+#if 0
+	// dump the board
+	{
+		int y, x;
+		printf("\n\n");
+		for (y = 0; y < 8; ++y) {
+			for (x = 0; x < 8; ++x) {
+				putchar(board[y * 8 + x]);
+			}
+			putchar('\n');
+		}
+	}
+	printf("cr='%s' ep='%s'\n", castling_rights, ep_square);
+#endif
+}
+
+// Plays the given book move, and fills in everything in <out> except the
+// stats, which need a lookup of out->child_key.
+static int decode_move(struct book_query *q, char *board, struct piece_list *pieces, char *castling_rights, int invert, int flip, char move, char annotation, struct book_move *out)
+{
+	const struct moveenc *enc = &movetable[(unsigned char)move];
+	int from_square, from_row, from_col;
+	int to_square, to_row, to_col;
+	char newboard[64], nkr[5], neps[3];
+	uint64_t start = profile_now(q);
+
+	if (enc->piece == 0) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "Unknown move 0x%02x", (unsigned char)move);
+		return -1;
+	}
+
+	from_square = find_piece(q, pieces, enc->piece, enc->num);
+	if (from_square == -1)
+		return -1;
+	from_row = from_square / 8;
+	from_col = from_square % 8;
+
+	to_row = (from_row + 8 + enc->forward) % 8;
+	to_col = (from_col + 8 + enc->right) % 8;
+	to_square = to_row * 8 + to_col;
+
+	// do the move, and encode the new position
+	memcpy(newboard, board, 64);
+	strcpy(nkr, castling_rights);
+	execute_move(newboard, nkr, invert, neps, from_square, to_square);
+	invert_board(newboard);
+
+	if (needs_flipping(newboard, nkr)) {
+		flip_board(newboard, neps);
+		flip = !flip;
+	}
+
+	profile_lap(q, &start, &q->ns_decode);
+	if (encode_position(q, newboard, !invert, nkr, neps) == -1)
+		return -1;
+	profile_lap(q, &start, &q->ns_encode);
+
+	out->from_square = from_square;
+	out->to_square = to_square;
+	out->annotation = annotation;
+	memcpy(out->child_key, q->position, q->pos_len);
+	out->child_key_len = q->pos_len;
+
+#if DUMP_FEN
+	// very useful for regression testing (some shell and
+	// you can walk the entire book quite easily; --dump-book does that)
+	if (!invert)
+		invert_board(newboard);
+	format_fen(out->child_fen, newboard, !invert, flip, nkr, neps);
+	printf("%s\n", out->child_fen);
+	return 0;
+#endif
+
+	if (q->list_children) {
+		if (!invert)
+			invert_board(newboard);
+		format_fen(out->child_fen, newboard, !invert, flip, nkr, neps);
+	}
+	profile_lap(q, &start, &q->ns_decode);
+	return 0;
+}
+
+static int decode_entry(struct book *book, struct book_query *q, char *board, char *castling_rights, int invert, int flip, char *result, struct book_entry *entry)
+{
+	int book_moves = result[0] >> 1;
+	int i, num_pages = 0;
+	unsigned pages[128];
+	struct piece_list pieces;
+	uint64_t start;
+
+	find_pieces(board, &pieces);
+	get_stats(result, &entry->stats);
+
+	// Play all the moves first, so that we can ask for all the pages
+	// we need for the lookups in one go; otherwise, we'd wait for one
+	// page fault after the other on a cold cache.
+	for (i = 0; i < book_moves; ++i) {
+		struct book_move *move = &entry->moves[i];
+		unsigned page;
+
+		if (decode_move(q, board, &pieces, castling_rights, invert, flip, result[i * 2 + 1], result[i * 2 + 2], move) == -1)
+			return -1;
+
+		page = cto_page(book, first_slot(book, q, move->child_key, move->child_key_len));
+		if (page != NO_PAGE)
+			pages[num_pages++] = page;
+	}
+	start = profile_now(q);
+	prefetch_pages(book, pages, num_pages);
+	profile_lap(q, &start, &q->ns_search);
+
+	entry->num_moves = 0;
+	for (i = 0; i < book_moves; ++i) {
+		struct book_move *move = &entry->moves[i];
+		char child_result[CTG_RESULT_SIZE];
+
+		if (!lookup_position(book, q, move->child_key, move->child_key_len, child_result)) {
+			snprintf(q->error, BOOK_ERROR_SIZE, "Destination move not found in book");
+			return -1;
+		}
+		get_stats(child_result, &move->stats);
+		++entry->num_moves;
+	}
+	return 0;
+}
+
+// Puts the given position into the normalized form the book uses (white to
+// move, white king in the right half), and encodes it into q->position.
+// <castling_rights> and <ep_square> are copied, since we need to modify them.
+static int prepare_position(struct book_query *q, const char *fen_board, const char *toplay, const char *castling_rights, const char *ep_square,
+                            char *board, char *ncr, char *neps, int *invert, int *flip)
+{
+	uint64_t start = profile_now(q);
+
+	// execute_move() and friends have fixed-size buffers for these
+	if (strlen(castling_rights) > 4 || strlen(ep_square) > 2) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "Malformed castling rights or en passant square");
+		return -1;
+	}
+	strcpy(ncr, castling_rights);
+	strcpy(neps, ep_square);
+
+	if (decode_fen_board(q, fen_board, board) == -1)
+		return -1;
+
+	// always from white's position
+	*invert = 0;
+	if (toplay[0] == 'b') {
+		*invert = 1;
+		invert_board(board);
+	}
+
+	// and the white king is always in the right half
+	*flip = needs_flipping(board, ncr);
+	if (*flip) {
+		flip_board(board, neps);
+	}
+
+
+#if 0
+	// dump the board
+	{
+		int y, x;
+		for (y = 0; y < 8; ++y) {
+			for (x = 0; x < 8; ++x) {
+				putchar(board[y * 8 + x]);
+			}
+			putchar('\n');
+		}
+	}
+#endif
+
+	if (encode_position(q, board, *invert, ncr, neps) == -1)
+		return -1;
+	profile_lap(q, &start, &q->ns_encode);
+	return 0;
+}
+
+int book_lookup(struct book *book, struct book_query *q, const char *fen_board, const char *toplay, const char *castling_rights, const char *ep_square, struct book_entry *entry)
+{
+	char board[64], result[CTG_RESULT_SIZE], ncr[5], neps[3];
+	int invert, flip, use_cache, ret;
+
+	if (prepare_position(q, fen_board, toplay, castling_rights, ep_square, board, ncr, neps, &invert, &flip) == -1)
+		return -1;
+
+	entry->invert = invert;
+	entry->flip = flip;
+	memcpy(entry->key, q->position, q->pos_len);
+	entry->key_len = q->pos_len;
+
+	// cached entries have no child keys or FENs, so they're no use
+	// for walking the book
+	use_cache = (book->cache != NULL && !q->list_children);
+	if (use_cache) {
+		uint64_t start = profile_now(q);
+		int hit = cache_get(book->cache, entry, &ret);
+
+		profile_lap(q, &start, &q->ns_search);
+		if (hit)
+			return ret;
+	}
+
+	if (book->index_map != NULL) {
+		uint64_t start = profile_now(q);
+		uint64_t key = book_position_key(entry->key, entry->key_len);
+
+		profile_lap(q, &start, &q->ns_hash);
+		ret = index_lookup(book, q, key, entry);
+		profile_lap(q, &start, &q->ns_search);
+	} else if (!lookup_position(book, q, entry->key, entry->key_len, result)) {
+		ret = 0;
+	} else if (decode_entry(book, q, board, ncr, invert, flip, result, entry) == -1) {
+		ret = -1;
+	} else {
+		ret = 1;
+	}
+
+	if (use_cache && ret != -1)
+		cache_put(book->cache, entry, ret);
+	return ret;
+}
+
+// Returns 1 if the key was not already in the set, -1 if out of memory.
+int key_set_insert(struct key_set *set, const unsigned char *key, int len)
+{
+	size_t i;
+
+	if (set->used * 2 >= set->size) {
+		struct key_set new_set;
+		new_set.size = (set->size == 0) ? 65536 : set->size * 2;
+		new_set.used = 0;
+		new_set.keys = calloc(new_set.size, 32);
+		if (new_set.keys == NULL)
+			return -1;
+		for (i = 0; i < set->size; ++i) {
+			if (set->keys[i][0] != 0)
+				key_set_insert(&new_set, set->keys[i], 32);
+		}
+		free(set->keys);
+		*set = new_set;
+	}
+
+	i = gen_hash(key, key[0] & 0x1f) & (set->size - 1);
+	while (set->keys[i][0] != 0) {
+		if (memcmp(set->keys[i], key, len) == 0)
+			return 0;
+		i = (i + 1) & (set->size - 1);
+	}
+
+	memset(set->keys[i], 0, 32);
+	memcpy(set->keys[i], key, len);
+	++set->used;
+	return 1;
+}
+
+void key_set_free(struct key_set *set)
+{
+	free(set->keys);
+	set->keys = NULL;
+	set->size = set->used = 0;
+}
+
+int fen_queue_push(struct fen_queue *queue, const char *fen)
+{
+	if (queue->tail == queue->size) {
+		// compact if that frees up at least half, otherwise grow
+		if (queue->head >= queue->size / 2 && queue->head > 0) {
+			memmove(queue->fens, queue->fens + queue->head, (queue->tail - queue->head) * sizeof(char *));
+			queue->tail -= queue->head;
+			queue->head = 0;
+		} else {
+			size_t new_size = (queue->size == 0) ? 1024 : queue->size * 2;
+			char **new_fens = realloc(queue->fens, new_size * sizeof(char *));
+			if (new_fens == NULL)
+				return -1;
+			queue->fens = new_fens;
+			queue->size = new_size;
+		}
+	}
+	queue->fens[queue->tail] = strdup(fen);
+	if (queue->fens[queue->tail] == NULL)
+		return -1;
+	++queue->tail;
+	return 0;
+}
+
+void fen_queue_free(struct fen_queue *queue)
+{
+	while (queue->head != queue->tail)
+		free(queue->fens[queue->head++]);
+	free(queue->fens);
+	queue->fens = NULL;
+	queue->head = queue->tail = queue->size = 0;
+}
+
+static int compare_index_positions(const void *a, const void *b)
+{
+	// the keys are big-endian, so this sorts them numerically
+	return memcmp(a, b, 8);
+}
+
+static int write_index(struct book_query *q, const char *filename, unsigned char *positions, size_t num_positions, unsigned char *moves, size_t num_moves)
+{
+	char tmp_filename[4096];
+	unsigned char header[INDEX_HEADER_SIZE];
+	FILE *fp;
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "BOOKIDX1", 8);
+	put_be32(header + 8, num_positions);
+	put_be32(header + 12, num_moves);
+
+	// write to a temporary file first, so that nobody sees a half-written index
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+	fp = fopen(tmp_filename, "wb");
+	if (fp == NULL) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "%.200s: %s", tmp_filename, strerror(errno));
+		return -1;
+	}
+	if (fwrite(header, sizeof(header), 1, fp) != 1 ||
+	    fwrite(positions, INDEX_POSITION_SIZE, num_positions, fp) != num_positions ||
+	    fwrite(moves, INDEX_MOVE_SIZE, num_moves, fp) != num_moves) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "%.200s: %s", tmp_filename, strerror(errno));
+		fclose(fp);
+		return -1;
+	}
+	if (fclose(fp) != 0) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "%.200s: %s", tmp_filename, strerror(errno));
+		return -1;
+	}
+	if (rename(tmp_filename, filename) == -1) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "%s: %s", filename, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int book_build_index(struct book *book, struct book_query *q, const char *filename, size_t *num_indexed, size_t *num_failed)
+{
+	struct key_set seen = { NULL, 0, 0 };
+	struct fen_queue queue = { NULL, 0, 0, 0 };
+	unsigned char *positions = NULL, *moves = NULL;
+	size_t num_positions = 0, num_moves = 0, positions_size = 0, moves_size = 0;
+	const char *start_fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+	struct book_entry *entry = NULL;
+	int old_list_children = q->list_children;
+	int ret = -1;
+	size_t i;
+
+	if (book->index_map != NULL) {
+		snprintf(q->error, BOOK_ERROR_SIZE, "Can't build an index from an index");
+		return -1;
+	}
+
+	*num_indexed = *num_failed = 0;
+	entry = malloc(sizeof(*entry));
+	if (entry == NULL || fen_queue_push(&queue, start_fen) == -1)
+		goto oom;
+	q->list_children = 1;
+
+	while (queue.head != queue.tail) {
+		char *fen = queue.fens[queue.head++];
+		char fen_board[128], toplay[8], castling_rights[8], ep_square[8];
+		unsigned char *ptr;
+		int j, found;
+
+		if (sscanf(fen, "%127s %7s %7s %7s", fen_board, toplay, castling_rights, ep_square) != 4) {
+			snprintf(q->error, BOOK_ERROR_SIZE, "Invalid FEN '%s'", fen);
+			free(fen);
+			goto out;
+		}
+		found = book_lookup(book, q, fen_board, toplay, castling_rights, ep_square, entry);
+		free(fen);
+		if (seen.used == 0 && key_set_insert(&seen, entry->key, entry->key_len) == -1)
+			goto oom;
+		if (found != 1) {
+			// leave it out, like dump_book would
+			++*num_failed;
+			continue;
+		}
+
+		if (num_positions == positions_size) {
+			size_t new_size = (positions_size == 0) ? 65536 : positions_size * 2;
+			unsigned char *new_positions = realloc(positions, new_size * INDEX_POSITION_SIZE);
+			if (new_positions == NULL)
+				goto oom;
+			positions = new_positions;
+			positions_size = new_size;
+		}
+		if (num_moves + entry->num_moves > moves_size) {
+			size_t new_size = (moves_size == 0) ? 262144 : moves_size * 2;
+			unsigned char *new_moves = realloc(moves, new_size * INDEX_MOVE_SIZE);
+			if (new_moves == NULL)
+				goto oom;
+			moves = new_moves;
+			moves_size = new_size;
+		}
+
+		ptr = positions + num_positions++ * INDEX_POSITION_SIZE;
+		memset(ptr, 0, INDEX_POSITION_SIZE);
+		put_be64(ptr, book_position_key(entry->key, entry->key_len));
+		put_be32(ptr + 8, num_moves);
+		put_be32(ptr + 12, entry->num_moves);
+		put_index_stats(ptr + 16, &entry->stats);
+
+		for (j = 0; j < entry->num_moves; ++j) {
+			struct book_move *move = &entry->moves[j];
+			int inserted;
+
+			ptr = moves + num_moves++ * INDEX_MOVE_SIZE;
+			ptr[0] = move->from_square;
+			ptr[1] = move->to_square;
+			ptr[2] = move->annotation;
+			ptr[3] = 0;
+			put_index_stats(ptr + 4, &move->stats);
+
+			inserted = key_set_insert(&seen, move->child_key, move->child_key_len);
+			if (inserted == -1 || (inserted == 1 && fen_queue_push(&queue, move->child_fen) == -1))
+				goto oom;
+		}
+	}
+
+	qsort(positions, num_positions, INDEX_POSITION_SIZE, compare_index_positions);
+	for (i = 1; i < num_positions; ++i) {
+		if (memcmp(positions + (i - 1) * INDEX_POSITION_SIZE, positions + i * INDEX_POSITION_SIZE, 8) == 0) {
+			snprintf(q->error, BOOK_ERROR_SIZE, "Hash collision between two book positions; can't build index");
+			goto out;
+		}
+	}
+
+	ret = write_index(q, filename, positions, num_positions, moves, num_moves);
+	*num_indexed = num_positions;
+	goto out;
+
+oom:
+	snprintf(q->error, BOOK_ERROR_SIZE, "Out of memory");
+out:
+	q->list_children = old_list_children;
+	key_set_free(&seen);
+	fen_queue_free(&queue);
+	free(positions);
+	free(moves);
+	free(entry);
+	return ret;
+}
@@ -0,0 +1,526 @@
+// Turns a board and a PV in UCI notation into short algebraic notation,
+// exactly like Board::prettyprint_move() does (including its quirks; see
+// below), but a lot faster. Build with
+//
+//   gcc -O2 -o prettyprint prettyprint.c
+//
+// Like Board.pm, we don't know whose move it is, whether castling is
+// allowed, or where the en passant square is; we only have the pieces,
+// and go by the color of the piece being moved.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+// Squares are numbered row * 8 + col, with row 0 being the eighth rank
+// and col 0 the a file, like in Board.pm. Empty squares are '-'.
+struct board {
+	char sq[64];
+
+	// one bit per square, for each of the twelve pieces and for each color
+	uint64_t pieces[12];
+	uint64_t white, black;
+};
+
+#define BIT(sq) (1ULL << (sq))
+
+static const char piece_chars[] = "PNBRQKpnbrqk";
+
+// index into board->pieces, or -1 if not a piece
+static int piece_index(char piece)
+{
+	const char *ptr = (piece == '\0') ? NULL : strchr(piece_chars, piece);
+	return (ptr == NULL) ? -1 : ptr - piece_chars;
+}
+
+static uint64_t knight_attacks[64], king_attacks[64];
+
+// squares a pawn of the given color on a given square attacks
+static uint64_t white_pawn_attacks[64], black_pawn_attacks[64];
+
+static uint64_t step_targets(int sq, const int (*steps)[2], int num_steps)
+{
+	uint64_t targets = 0;
+	int i;
+
+	for (i = 0; i < num_steps; ++i) {
+		int row = sq / 8 + steps[i][0], col = sq % 8 + steps[i][1];
+		if (row >= 0 && row < 8 && col >= 0 && col < 8)
+			targets |= BIT(row * 8 + col);
+	}
+	return targets;
+}
+
+static void init_tables(void)
+{
+	static const int knight_steps[8][2] = {
+		{ -2, -1 }, { -2, 1 }, { -1, -2 }, { -1, 2 }, { 1, -2 }, { 1, 2 }, { 2, -1 }, { 2, 1 }
+	};
+	static const int king_steps[8][2] = {
+		{ -1, -1 }, { -1, 0 }, { -1, 1 }, { 0, -1 }, { 0, 1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }
+	};
+	static const int white_pawn_steps[2][2] = { { -1, -1 }, { -1, 1 } };
+	static const int black_pawn_steps[2][2] = { { 1, -1 }, { 1, 1 } };
+	int sq;
+
+	for (sq = 0; sq < 64; ++sq) {
+		knight_attacks[sq] = step_targets(sq, knight_steps, 8);
+		king_attacks[sq] = step_targets(sq, king_steps, 8);
+		white_pawn_attacks[sq] = step_targets(sq, white_pawn_steps, 2);
+		black_pawn_attacks[sq] = step_targets(sq, black_pawn_steps, 2);
+	}
+}
+
+static uint64_t slide(int sq, uint64_t occupied, int drow, int dcol)
+{
+	uint64_t targets = 0;
+	int row = sq / 8 + drow, col = sq % 8 + dcol;
+
+	while (row >= 0 && row < 8 && col >= 0 && col < 8) {
+		targets |= BIT(row * 8 + col);
+		if (occupied & BIT(row * 8 + col))
+			break;
+		row += drow;
+		col += dcol;
+	}
+	return targets;
+}
+
+static uint64_t rook_attacks(int sq, uint64_t occupied)
+{
+	return slide(sq, occupied, -1, 0) | slide(sq, occupied, 1, 0) |
+		slide(sq, occupied, 0, -1) | slide(sq, occupied, 0, 1);
+}
+
+static uint64_t bishop_attacks(int sq, uint64_t occupied)
+{
+	return slide(sq, occupied, -1, -1) | slide(sq, occupied, -1, 1) |
+		slide(sq, occupied, 1, -1) | slide(sq, occupied, 1, 1);
+}
+
+static int is_white(char piece)
+{
+	return isupper((unsigned char)piece);
+}
+
+static void set_square(struct board *board, int sq, char piece)
+{
+	int old = piece_index(board->sq[sq]), new = piece_index(piece);
+
+	if (old != -1)
+		board->pieces[old] &= ~BIT(sq);
+	board->white &= ~BIT(sq);
+	board->black &= ~BIT(sq);
+
+	board->sq[sq] = piece;
+	if (new != -1)
+		board->pieces[new] |= BIT(sq);
+	if (piece != '-') {
+		if (is_white(piece))
+			board->white |= BIT(sq);
+		else
+			board->black |= BIT(sq);
+	}
+}
+
+// Reads the board part of a FEN. Returns -1 if it's malformed.
+static int parse_board(const char *str, struct board *board)
+{
+	int sq = 0;
+
+	memset(board, 0, sizeof(*board));
+	memset(board->sq, '-', 64);
+	for ( ; *str != '\0'; ++str) {
+		if (*str == '/') {
+			if (sq % 8 != 0)
+				return -1;
+		} else if (*str >= '1' && *str <= '8') {
+			sq += *str - '0';
+			if (sq > 64)
+				return -1;
+		} else if (piece_index(*str) != -1 && sq < 64) {
+			set_square(board, sq++, *str);
+		} else {
+			return -1;
+		}
+	}
+	return (sq == 64) ? 0 : -1;
+}
+
+// Board::can_reach(): whether the piece on <from> could move to <to>,
+// not caring about check. Note that a pawn can always capture en passant
+// if there's an enemy pawn to capture, since we don't know the last move.
+static int can_reach(struct board *board, int from, int to)
+{
+	char piece = board->sq[from], dest = board->sq[to];
+	uint64_t occupied = board->white | board->black;
+	int from_row = from / 8, from_col = from % 8;
+	int to_row = to / 8, to_col = to % 8;
+
+	// can't eat your own piece
+	if (dest != '-' && is_white(piece) == is_white(dest))
+		return 0;
+
+	switch (piece) {
+	case 'p':
+		if (to_col == from_col && to_row == from_row + 1)
+			return dest == '-';
+		if (to_col == from_col && from_row == 1 && to_row == 3)
+			return dest == '-' && board->sq[2 * 8 + to_col] == '-';
+		if (black_pawn_attacks[from] & BIT(to)) {
+			if (dest == '-')
+				return to_row == 5 && board->sq[4 * 8 + to_col] == 'P';
+			return 1;
+		}
+		return 0;
+	case 'P':
+		if (to_col == from_col && to_row == from_row - 1)
+			return dest == '-';
+		if (to_col == from_col && from_row == 6 && to_row == 4)
+			return dest == '-' && board->sq[5 * 8 + to_col] == '-';
+		if (white_pawn_attacks[from] & BIT(to)) {
+			if (dest == '-')
+				return to_row == 2 && board->sq[3 * 8 + to_col] == 'p';
+			return 1;
+		}
+		return 0;
+	case 'n':
+	case 'N':
+		return (knight_attacks[from] & BIT(to)) != 0;
+	case 'b':
+	case 'B':
+		return (bishop_attacks(from, occupied) & BIT(to)) != 0;
+	case 'r':
+	case 'R':
+		return (rook_attacks(from, occupied) & BIT(to)) != 0;
+	case 'q':
+	case 'Q':
+		return ((rook_attacks(from, occupied) | bishop_attacks(from, occupied)) & BIT(to)) != 0;
+	case 'k':
+	case 'K':
+		return (king_attacks[from] & BIT(to)) != 0;
+	}
+	return 0;
+}
+
+// Board::make_move(). <promo> is the promotion piece, or '\0' for none.
+static void make_move(struct board *board, int from, int to, char promo)
+{
+	char piece = board->sq[from];
+
+	// castling is recognized by the king's move alone
+	if (piece == 'K' && from == 7 * 8 + 4 && (to == 7 * 8 + 6 || to == 7 * 8 + 2) && promo == '\0') {
+		int kingside = (to == 7 * 8 + 6);
+		set_square(board, from, '-');
+		set_square(board, to, piece);
+		set_square(board, kingside ? 7 * 8 + 7 : 7 * 8 + 0, '-');
+		set_square(board, kingside ? 7 * 8 + 5 : 7 * 8 + 3, 'R');
+		return;
+	}
+	if (piece == 'k' && from == 0 * 8 + 4 && (to == 0 * 8 + 6 || to == 0 * 8 + 2) && promo == '\0') {
+		int kingside = (to == 0 * 8 + 6);
+		set_square(board, from, '-');
+		set_square(board, to, piece);
+		set_square(board, kingside ? 0 * 8 + 7 : 0 * 8 + 0, '-');
+		set_square(board, kingside ? 0 * 8 + 5 : 0 * 8 + 3, 'r');
+		return;
+	}
+
+	if (piece == 'p' || piece == 'P') {
+		// a diagonal move to an empty square is en passant
+		if (from % 8 != to % 8 && board->sq[to] == '-')
+			set_square(board, (piece == 'p') ? to - 8 : to + 8, '-');
+		if (promo != '\0')
+			piece = (piece == 'p') ? tolower((unsigned char)promo) : toupper((unsigned char)promo);
+	}
+
+	set_square(board, from, '-');
+	set_square(board, to, piece);
+}
+
+// Board::in_check(); <king> is 'K' or 'k'.
+static int in_check(struct board *board, char king)
+{
+	uint64_t kings = board->pieces[piece_index(king)];
+	uint64_t occupied = board->white | board->black;
+	const uint64_t *p;
+	int sq;
+
+	if (kings == 0)
+		return 0;
+	sq = __builtin_ctzll(kings);
+
+	// the pieces of the other side
+	p = board->pieces + ((king == 'K') ? 6 : 0);
+	return ((king == 'K' ? white_pawn_attacks[sq] : black_pawn_attacks[sq]) & p[0]) ||
+		(knight_attacks[sq] & p[1]) ||
+		(bishop_attacks(sq, occupied) & (p[2] | p[4])) ||
+		(rook_attacks(sq, occupied) & (p[3] | p[4])) ||
+		(king_attacks[sq] & p[5]);
+}
+
+// All squares can_reach() allows the piece on <from> to move to.
+static uint64_t reachable(struct board *board, int from)
+{
+	char piece = board->sq[from];
+	uint64_t own = is_white(piece) ? board->white : board->black;
+	uint64_t occupied = board->white | board->black;
+	uint64_t targets = 0;
+	int row = from / 8;
+
+	switch (piece) {
+	case 'p':
+	case 'P': {
+		int dir = (piece == 'p') ? 8 : -8;
+		uint64_t attacks = (piece == 'p') ? black_pawn_attacks[from] : white_pawn_attacks[from];
+		uint64_t t;
+
+		if (row != ((piece == 'p') ? 7 : 0) && !(occupied & BIT(from + dir))) {
+			targets |= BIT(from + dir);
+			if (row == ((piece == 'p') ? 1 : 6) && !(occupied & BIT(from + 2 * dir)))
+				targets |= BIT(from + 2 * dir);
+		}
+		targets |= attacks & (is_white(piece) ? board->black : board->white);
+
+		// en passant, as can_reach() sees it
+		for (t = attacks & ~occupied; t != 0; t &= t - 1) {
+			int to = __builtin_ctzll(t);
+			if (can_reach(board, from, to))
+				targets |= BIT(to);
+		}
+		return targets;
+	}
+	case 'n':
+	case 'N':
+		targets = knight_attacks[from];
+		break;
+	case 'b':
+	case 'B':
+		targets = bishop_attacks(from, occupied);
+		break;
+	case 'r':
+	case 'R':
+		targets = rook_attacks(from, occupied);
+		break;
+	case 'q':
+	case 'Q':
+		targets = rook_attacks(from, occupied) | bishop_attacks(from, occupied);
+		break;
+	case 'k':
+	case 'K':
+		targets = king_attacks[from];
+		break;
+	}
+	return targets & ~own;
+}
+
+// Board::can_legally_reach().
+static int can_legally_reach(struct board *board, int from, int to)
+{
+	struct board nb;
+
+	if (!can_reach(board, from, to))
+		return 0;
+
+	nb = *board;
+	make_move(&nb, from, to, '\0');
+	return !in_check(&nb, is_white(board->sq[from]) ? 'K' : 'k');
+}
+
+// Board::in_mate(), for a side that is in check.
+static int in_mate(struct board *board, char king)
+{
+	uint64_t own = (king == 'K') ? board->white : board->black;
+
+	for ( ; own != 0; own &= own - 1) {
+		int from = __builtin_ctzll(own);
+		uint64_t targets;
+
+		for (targets = reachable(board, from); targets != 0; targets &= targets - 1) {
+			struct board nb = *board;
+			make_move(&nb, from, __builtin_ctzll(targets), '\0');
+			if (!in_check(&nb, king))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// Parses a move in UCI notation. Returns -1 if it's malformed.
+static int parse_uci_move(const char *move, int *from, int *to, char *promo)
+{
+	if (strlen(move) < 4 || strlen(move) > 5 ||
+	    move[0] < 'a' || move[0] > 'h' || move[1] < '1' || move[1] > '8' ||
+	    move[2] < 'a' || move[2] > 'h' || move[3] < '1' || move[3] > '8')
+		return -1;
+
+	*from = (7 - (move[1] - '1')) * 8 + (move[0] - 'a');
+	*to = (7 - (move[3] - '1')) * 8 + (move[2] - 'a');
+	*promo = move[4];
+	return 0;
+}
+
+// Board::prettyprint_move(): writes the move in short algebraic notation
+// to <out> (at most 16 bytes, including the terminating zero), and makes it.
+// Returns -1 if there's no piece to move.
+static int prettyprint_move(struct board *board, const char *move, char *out)
+{
+	int from, to;
+	char promo, piece, other_king;
+	int check;
+
+	if (parse_uci_move(move, &from, &to, &promo) == -1)
+		return -1;
+	piece = board->sq[from];
+	if (piece == '-')
+		return -1;
+
+	if ((piece == 'K' && from == 7 * 8 + 4 && promo == '\0' && (to == 7 * 8 + 6 || to == 7 * 8 + 2)) ||
+	    (piece == 'k' && from == 0 * 8 + 4 && promo == '\0' && (to == 0 * 8 + 6 || to == 0 * 8 + 2))) {
+		strcpy(out, (to % 8 == 6) ? "O-O" : "O-O-O");
+	} else if (piece == 'p' || piece == 'P') {
+		if (from % 8 != to % 8)
+			out += sprintf(out, "%cx", move[0]);
+		out += sprintf(out, "%c%c", move[2], move[3]);
+		if (promo != '\0')
+			sprintf(out, "=%c", toupper((unsigned char)promo));
+	} else {
+		// see how many of these pieces could go here, in all,
+		// and how many of them are on the same row or column
+		int num_total = 0, num_row = 0, num_col = 0;
+		uint64_t same;
+
+		for (same = board->pieces[piece_index(piece)]; same != 0; same &= same - 1) {
+			int sq = __builtin_ctzll(same);
+			if (!can_legally_reach(board, sq, to))
+				continue;
+			++num_total;
+			if (sq / 8 == from / 8)
+				++num_row;
+			if (sq % 8 == from % 8)
+				++num_col;
+		}
+
+		*out++ = toupper((unsigned char)piece);
+		if (num_total > 1) {
+			if (num_col == 1) {
+				*out++ = move[0];
+			} else if (num_row == 1) {
+				*out++ = move[1];
+			} else {
+				*out++ = move[0];
+				*out++ = move[1];
+			}
+		}
+		if (board->sq[to] != '-')
+			*out++ = 'x';
+		sprintf(out, "%c%c", move[2], move[3]);
+	}
+
+	make_move(board, from, to, promo);
+
+	other_king = is_white(piece) ? 'k' : 'K';
+	check = in_check(board, other_king);
+	if (check && in_mate(board, other_king))
+		strcat(out, "#");
+	else if (check)
+		strcat(out, "+");
+	return 0;
+}
+
+// Prints the PV given as UCI moves in <moves> (separated by whitespace,
+// which may be modified) in short algebraic notation, separated by spaces,
+// followed by a newline. On error, prints nothing and returns -1.
+static int prettyprint_pv(const char *fen_board, char *moves)
+{
+	struct board board;
+	char output[8192], *out = output, *move;
+
+	if (parse_board(fen_board, &board) == -1) {
+		fprintf(stderr, "Malformed board '%s'\n", fen_board);
+		return -1;
+	}
+
+	*out = '\0';
+	for (move = strtok(moves, " \t\n"); move != NULL; move = strtok(NULL, " \t\n")) {
+		if (out + 16 + 2 > output + sizeof(output)) {
+			fprintf(stderr, "PV too long\n");
+			return -1;
+		}
+		if (out != output)
+			*out++ = ' ';
+		if (prettyprint_move(&board, move, out) == -1) {
+			fprintf(stderr, "Invalid move %s\n", move);
+			return -1;
+		}
+		out += strlen(out);
+	}
+	printf("%s\n", output);
+	return 0;
+}
+
+// Server mode, so that the caller doesn't have to start a new process for
+// every PV. Reads one request per line, of the form
+//
+//   <id> <board> [<move>...]
+//
+// where <id> is an arbitrary token chosen by the client, <board> is the
+// first field of a FEN, and the moves are in UCI notation. The response
+// is one line with the moves in short algebraic notation, followed by
+//
+//   end <id> <status>
+//
+// where <status> is "ok" or "error". On error, there is no line with moves.
+static void serve(FILE *in)
+{
+	char line[8192];
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char id[64], fen_board[128];
+		int n, ret = -1;
+		int consumed = 0;
+
+		n = sscanf(line, "%63s %127s %n", id, fen_board, &consumed);
+		if (n <= 0)
+			continue;
+
+		if (n != 2) {
+			fprintf(stderr, "Malformed request '%s'\n", id);
+		} else {
+			ret = prettyprint_pv(fen_board, line + consumed);
+		}
+
+		printf("end %s %s\n", id, (ret == 0) ? "ok" : "error");
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	init_tables();
+
+	if (argc == 2 && strcmp(argv[1], "--server") == 0) {
+		serve(stdin);
+		exit(0);
+	}
+	if (argc >= 2) {
+		char moves[8192] = "";
+		int i;
+
+		for (i = 2; i < argc; ++i) {
+			if (strlen(moves) + strlen(argv[i]) + 2 > sizeof(moves)) {
+				fprintf(stderr, "PV too long\n");
+				exit(1);
+			}
+			strcat(moves, argv[i]);
+			strcat(moves, " ");
+		}
+		exit(prettyprint_pv(argv[1], moves) == 0 ? 0 : 1);
+	}
+
+	fprintf(stderr, "Usage: %s BOARD [MOVE...]\n", argv[0]);
+	fprintf(stderr, "       %s --server\n", argv[0]);
+	exit(1);
+}
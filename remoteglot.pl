@@ -12,16 +12,18 @@
 use AnyEvent;
 use AnyEvent::Handle;
 use AnyEvent::HTTP;
+use AnyEvent::Socket;
 use Chess::PGN::Parse;
 use EV;
 use Net::Telnet;
+use File::Basename;
 use File::Slurp;
 use IPC::Open2;
 use Time::HiRes;
 use JSON::XS;
 use URI::Escape;
 use DBI;
-use DBD::Pg;
+use DBD::Pg qw(:async);
 require 'Position.pm';
 require 'Engine.pm';
 require 'config.pm';
@@ -35,10 +37,35 @@ my $output_timer = undef;
 my $http_timer = undef;
 my $stop_pgn_fetch = 0;
 my $tb_retry_timer = undef;
+my $tb_server_timer = undef;
+my $tb_server_backoff = 0;
 my %tb_cache = ();
-my $tb_lookup_running = 0;
+my $tb_save_timer = undef;
+my %tb_lookups = ();
+my $tb_lookups_running = 0;
 my $last_written_json = undef;
 
+# The games we follow; see switch_to_game().
+my @games = ();
+my $current_game = undef;
+my @engine_pool = ();
+my $game_schedule_timer = undef;
+
+# The list of other games going on (see output_json()). The rows of
+# current_games are read every $remoteglotconf::games_refresh_interval
+# seconds, and what we show about each game (the players, and the score
+# or result) is kept in %game_summaries, keyed by its json_path. Every
+# remoteglot writes a small summary next to its JSON, which we watch
+# for with inotify; thus, writing our own JSON costs no extra I/O.
+# (Without Linux::Inotify2, we read them again along with the list.)
+my @current_games_rows = ();
+my %game_summaries = ();
+my $games_refresh_timer = undef;
+my $inotify = undef;
+my $inotify_io = undef;
+my $inotify_failed = 0;
+my %inotify_watched_dirs = ();
+
 # Persisted so we can restart.
 # TODO: Figure out an appropriate way to deal with database restarts
 # and/or Postgres going away entirely.
@@ -69,26 +96,87 @@ $| = 1;
 select(STDOUT);
 umask 0022;
 
-# open the chess engine
-my $engine = open_engine($remoteglotconf::engine_cmdline, 'E1', sub { handle_uci(@_, 1); });
-my $engine2 = open_engine($remoteglotconf::engine2_cmdline, 'E2', sub { handle_uci(@_, 0); });
+load_tb_cache();
+
+# Tablebase probes used to be done by running Fathom ($fathom_cmdline,
+# with --path=); keep older configurations working.
+if (!defined($remoteglotconf::syzygy_path) && defined($remoteglotconf::fathom_cmdline)) {
+	if ($remoteglotconf::fathom_cmdline =~ /--path[= ](\S+)/) {
+		$remoteglotconf::syzygy_path = $1;
+		warn "\$fathom_cmdline is obsolete; using its path ($1) for ./syzygy\n";
+	} else {
+		warn "\$fathom_cmdline is obsolete and gives no --path; set \$syzygy_path for tablebase probes\n";
+	}
+}
+
+# open the chess engine(s)
+my ($engine, $engine2);
 my $last_move;
 my $last_text = '';
 my ($pos_waiting, $pos_calculating, $pos_calculating_second_engine);
+my ($pos_speculating, $speculation_started);  # See speculate().
 
-uciprint($engine, "setoption name UCI_AnalyseMode value true");
-while (my ($key, $value) = each %remoteglotconf::engine_config) {
-	uciprint($engine, "setoption name $key value $value");
-}
-uciprint($engine, "ucinewgame");
+if (scalar @remoteglotconf::games == 0) {
+	$engine = open_engine($remoteglotconf::engine_cmdline, 'E1', sub { handle_uci(@_, 1); });
+	$engine2 = open_engine($remoteglotconf::engine2_cmdline, 'E2', sub { handle_uci(@_, 0); });
 
-if (defined($engine2)) {
-	uciprint($engine2, "setoption name UCI_AnalyseMode value true");
-	while (my ($key, $value) = each %remoteglotconf::engine2_config) {
-		uciprint($engine2, "setoption name $key value $value");
+	uciprint($engine, "setoption name UCI_AnalyseMode value true");
+	while (my ($key, $value) = each %remoteglotconf::engine_config) {
+		uciprint($engine, "setoption name $key value $value");
+	}
+	uciprint($engine, "ucinewgame");
+
+	if (defined($engine2)) {
+		uciprint($engine2, "setoption name UCI_AnalyseMode value true");
+		while (my ($key, $value) = each %remoteglotconf::engine2_config) {
+			uciprint($engine2, "setoption name $key value $value");
+		}
+		uciprint($engine2, "setoption name MultiPV value 500");
+		uciprint($engine2, "ucinewgame");
+	}
+
+	# Just the one game, which the globals are already set up for.
+	$current_game = {
+		id => 'default',
+		target => $remoteglotconf::target,
+		json_output => $remoteglotconf::json_output,
+		json_socket => $remoteglotconf::json_socket,
+		pgn_filter => $remoteglotconf::pgn_filter,
+		engine => $engine,
+		engine2 => $engine2,
+	};
+	push @games, $current_game;
+	$engine->{'game'} = $current_game;
+	$engine2->{'game'} = $current_game if (defined($engine2));
+} else {
+	# A pool of engines, given out to the games by schedule_games().
+	# The hash is split evenly, once and for all, since changing it
+	# means throwing away what's in it; the threads follow the games.
+	my $pool_hash = int($remoteglotconf::engine_pool_hash / $remoteglotconf::engine_pool_size);
+	for my $i (1..$remoteglotconf::engine_pool_size) {
+		my $pool_engine = open_engine($remoteglotconf::engine_cmdline, "E$i", sub { handle_uci(@_, 1); });
+		uciprint($pool_engine, "setoption name UCI_AnalyseMode value true");
+		while (my ($key, $value) = each %remoteglotconf::engine_config) {
+			next if ($key eq 'Threads' || $key eq 'Hash');
+			uciprint($pool_engine, "setoption name $key value $value");
+		}
+		uciprint($pool_engine, "setoption name Hash value $pool_hash");
+		$pool_engine->{'hash'} = $pool_hash;
+		uciprint($pool_engine, "ucinewgame");
+		$pool_engine->{'game'} = undef;
+		push @engine_pool, $pool_engine;
+	}
+	for my $game_config (@remoteglotconf::games) {
+		push @games, {
+			json_output => undef,
+			json_socket => undef,
+			pgn_filter => undef,
+			priority => 0,
+			%$game_config,
+			engine => undef,
+			engine2 => undef,
+		};
 	}
-	uciprint($engine2, "setoption name MultiPV value 500");
-	uciprint($engine2, "ucinewgame");
 }
 
 print "Chess engine ready.\n";
@@ -120,7 +208,20 @@ my $ev1 = AnyEvent->io(
 		}
 	}
 );
-if (defined($remoteglotconf::target)) {
+if (scalar @engine_pool > 0) {
+	for my $game (@games) {
+		switch_to_game($game);
+		fetch_pgn($game->{'target'});
+	}
+	$game_schedule_timer = AnyEvent->timer(
+		after => $remoteglotconf::engine_pool_slice,
+		interval => $remoteglotconf::engine_pool_slice,
+		cb => sub {
+			update_game_priorities();
+			schedule_games();
+		}
+	);
+} elsif (defined($remoteglotconf::target)) {
 	if ($remoteglotconf::target =~ /^http:/) {
 		fetch_pgn($remoteglotconf::target);
 	} else {
@@ -129,6 +230,13 @@ if (defined($remoteglotconf::target)) {
 }
 print "FICS ready.\n";
 
+refresh_current_games();
+$games_refresh_timer = AnyEvent->timer(
+	after => $remoteglotconf::games_refresh_interval,
+	interval => $remoteglotconf::games_refresh_interval,
+	cb => \&refresh_current_games
+);
+
 # Engine events have already been set up by Engine.pm.
 EV::run;
 
@@ -139,11 +247,37 @@ sub handle_uci {
 
 	$line =~ s/  / /g;  # Sometimes needed for Zappa Mexico
 	print UCILOG localtime() . " $engine->{'tag'} <= $line\n";
+
+	# A pool engine that was just taken from another game is still
+	# finishing that game's search; ignore it until it has stopped,
+	# and then start on the new game (see schedule_games()). Likewise,
+	# the second engine's old search says nothing about the position it
+	# is going to (see stop_second_engine()).
+	if ($engine->{'discard_until_bestmove'}) {
+		return if ($line !~ /^bestmove/);
+		delete $engine->{'discard_until_bestmove'};
+		if ($primary) {
+			return if (!defined($engine->{'game'}));
+			switch_to_game($engine->{'game'});
+			set_engine_resources($engine, $current_game, 1);
+			if (defined($pos_calculating)) {
+				uciprint($engine, "position fen " . $pos_calculating->fen());
+				uciprint($engine, "go infinite");
+			}
+			return;
+		}
+	}
+
+	# An engine in the pool that isn't analyzing any game right now
+	# (see schedule_games()) has nothing to say that we care about.
+	return if (!defined($engine->{'game'}));
+	switch_to_game($engine->{'game'});
+
 	if ($line =~ /^info/) {
 		my (@infos) = split / /, $line;
 		shift @infos;
 
-		parse_infos($engine, @infos);
+		queue_infos($engine, @infos);
 	}
 	if ($line =~ /^id/) {
 		my (@ids) = split / /, $line;
@@ -160,9 +294,15 @@ sub handle_uci {
 
 				$pos_calculating = $pos_waiting;
 				$pos_waiting = undef;
+				clear_infos($engine);
+				promote_speculation() if (delete $engine->{'promote_speculation'});
 			}
+		} elsif (defined($pos_speculating)) {
+			clear_infos($engine2);
+			uciprint($engine2, "position fen " . $pos_speculating->fen());
+			uciprint($engine2, "go infinite");
 		} else {
-			$engine2->{'info'} = {};
+			clear_infos($engine2);
 			my $pos = $pos_waiting // $pos_calculating;
 			uciprint($engine2, "position fen " . $pos->fen());
 			uciprint($engine2, "go infinite");
@@ -254,12 +394,78 @@ sub handle_fics {
 	#print "FICS: [$line]\n";
 }
 
+# What we know about each PGN URL we poll, so that we can ask the server
+# for only what has changed (if it supports that), and not parse anything
+# if nothing has. Several games can follow the same URL, and each of them
+# needs to see every change, so it's kept per game.
+my %pgn_fetch_state = ();
+
+sub pgn_fetch_state {
+	my $url = shift;
+	return ($pgn_fetch_state{$current_game->{'id'} . ' ' . $url} //= {});
+}
+
 # Starts periodic fetching of PGNs from the given URL.
 sub fetch_pgn {
 	my ($url) = @_;
-	AnyEvent::HTTP::http_get($url, sub {
+	my $state = pgn_fetch_state($url);
+
+	my %headers = ();
+	if (defined($state->{'body'})) {
+		$headers{'If-None-Match'} = $state->{'etag'} if (defined($state->{'etag'}));
+		$headers{'If-Modified-Since'} = $state->{'last_modified'} if (defined($state->{'last_modified'}));
+		if ($remoteglotconf::pgn_append_only && length($state->{'body'}) > 0) {
+			# Ask for only the new bytes, with some overlap, so that we
+			# can check that the file really was only appended to.
+			my $overlap = length($state->{'body'}) < 1024 ? length($state->{'body'}) : 1024;
+			$state->{'range_start'} = length($state->{'body'}) - $overlap;
+			$headers{'Range'} = 'bytes=' . $state->{'range_start'} . '-';
+		}
+	}
+	AnyEvent::HTTP::http_get($url, headers => \%headers, in_this_game(sub {
 		handle_pgn(@_, $url);
-	});
+	}));
+}
+
+# Works out the entire PGN from a (possibly conditional or partial) response.
+# Returns the PGN, and whether it has changed since the last time; the PGN
+# is undef on errors, or if we need to fetch all of it again.
+sub pgn_from_response {
+	my ($body, $header, $url) = @_;
+	my $state = pgn_fetch_state($url);
+	my $range_start = delete $state->{'range_start'};
+	my $status = $header->{'Status'};
+
+	if ($status == 304) {
+		return ($state->{'body'}, 0);
+	}
+	if ($status == 416) {
+		# The file has shrunk, so it wasn't append-only after all.
+		%$state = ();
+		return (undef, 0);
+	}
+	if ($status !~ /^2/) {
+		warn "Error in fetching PGN from $url: $status $header->{'Reason'}\n";
+		return (undef, 0);
+	}
+	if ($status == 206) {
+		my $old_body = $state->{'body'};
+		if (!defined($range_start) || !defined($old_body) ||
+		    substr($body, 0, length($old_body) - $range_start) ne substr($old_body, $range_start)) {
+			warn "PGN from $url was not just appended to; fetching all of it again\n";
+			%$state = ();
+			return (undef, 0);
+		}
+		$body = substr($old_body, 0, $range_start) . $body;
+	}
+
+	$state->{'etag'} = $header->{'etag'};
+	$state->{'last_modified'} = $header->{'last-modified'};
+	if (defined($state->{'body'}) && $body eq $state->{'body'}) {
+		return ($body, 0);
+	}
+	$state->{'body'} = $body;
+	return ($body, 1);
 }
 
 my ($last_pgn_white, $last_pgn_black);
@@ -275,6 +481,17 @@ sub handle_pgn {
 		return;
 	}
 
+	# If nothing has changed, there's nothing to do, unless we are waiting
+	# to see whether a shorter PGN sticks (see below).
+	my $changed;
+	($body, $changed) = pgn_from_response($body, $header, $url);
+	if (!defined($body) || (!$changed && $pgn_hysteresis_counter == 0)) {
+		$http_timer = AnyEvent->timer(after => 1.0, cb => in_this_game(sub {
+			fetch_pgn($url);
+		}));
+		return;
+	}
+
 	my $pgn = Chess::PGN::Parse->new(undef, $body);
 	if (!defined($pgn)) {
 		warn "Error in parsing PGN from $url [body='$body']\n";
@@ -285,8 +502,8 @@ sub handle_pgn {
 	} else {
 		eval {
 			# Skip to the right game.
-			while (defined($remoteglotconf::pgn_filter) &&
-			       !&$remoteglotconf::pgn_filter($pgn)) {
+			my $pgn_filter = $current_game->{'pgn_filter'};
+			while (defined($pgn_filter) && !&$pgn_filter($pgn)) {
 				$pgn->read_game() or die "Out of games during filtering";
 			}
 
@@ -295,20 +512,9 @@ sub handle_pgn {
 			my $black = $pgn->black;
 			$white =~ s/,.*//;  # Remove first name.
 			$black =~ s/,.*//;  # Remove first name.
-			my $pos = Position->start_pos($white, $black);
-			my $moves = $pgn->moves;
-			my @uci_moves = ();
-			my @repretty_moves = ();
-			for my $move (@$moves) {
-				my ($npos, $uci_move) = $pos->make_pretty_move($move);
-				push @uci_moves, $uci_move;
-
-				# Re-prettyprint the move.
-				my ($from_row, $from_col, $to_row, $to_col, $promo) = parse_uci_move($uci_move);
-				my ($pretty, undef) = $pos->{'board'}->prettyprint_move($from_row, $from_col, $to_row, $to_col, $promo);
-				push @repretty_moves, $pretty;
-				$pos = $npos;
-			}
+			my ($pos, $uci_moves, $repretty_moves) = replay_pgn_moves($white, $black, $pgn->moves);
+			my @uci_moves = @$uci_moves;
+			my @repretty_moves = @$repretty_moves;
 			if ($pgn->result eq '1-0' || $pgn->result eq '1/2-1/2' || $pgn->result eq '0-1') {
 				$pos->{'result'} = $pgn->result;
 			}
@@ -342,14 +548,66 @@ sub handle_pgn {
 		}
 	}
 	
-	$http_timer = AnyEvent->timer(after => 1.0, cb => sub {
+	$http_timer = AnyEvent->timer(after => 1.0, cb => in_this_game(sub {
 		fetch_pgn($url);
-	});
+	}));
+}
+
+# The moves from the last PGN we replayed, and the position after each
+# of them, so that when the PGN changes, we only need to replay the moves
+# that are new (usually one).
+my %pgn_replay = ();
+
+# Plays the given moves (as in the PGN) from the start position. Returns the
+# final position, and the moves in UCI notation and re-prettyprinted.
+sub replay_pgn_moves {
+	my ($white, $black, $moves) = @_;
+
+	if (!exists($pgn_replay{'moves'}) ||
+	    $pgn_replay{'white'} ne $white || $pgn_replay{'black'} ne $black) {
+		%pgn_replay = (
+			white => $white,
+			black => $black,
+			moves => [],
+			uci_moves => [],
+			repretty_moves => [],
+			positions => [ Position->start_pos($white, $black) ],  # before each move, and after the last
+		);
+	}
+
+	my $common = 0;
+	my $cached = $pgn_replay{'moves'};
+	while ($common < scalar @$moves && $common < scalar @$cached &&
+	       $moves->[$common] eq $cached->[$common]) {
+		++$common;
+	}
+	splice(@{$pgn_replay{'moves'}}, $common);
+	splice(@{$pgn_replay{'uci_moves'}}, $common);
+	splice(@{$pgn_replay{'repretty_moves'}}, $common);
+	splice(@{$pgn_replay{'positions'}}, $common + 1);
+
+	my $pos = $pgn_replay{'positions'}[$common];
+	for my $move (@{$moves}[$common..$#$moves]) {
+		my ($npos, $uci_move) = $pos->make_pretty_move($move);
+
+		# make_move() has re-prettyprinted the move for us.
+		push @{$pgn_replay{'moves'}}, $move;
+		push @{$pgn_replay{'uci_moves'}}, $uci_move;
+		push @{$pgn_replay{'repretty_moves'}}, $npos->{'last_move'};
+		push @{$pgn_replay{'positions'}}, $npos;
+		$pos = $npos;
+	}
+
+	# The caller adds the result, clocks and so on to the position it
+	# gets, so give it a copy of ours.
+	$pos = bless { %$pos }, 'Position';
+	return ($pos, [ @{$pgn_replay{'uci_moves'}} ], [ @{$pgn_replay{'repretty_moves'}} ]);
 }
 
 sub handle_position {
 	my ($pos) = @_;
 	find_clock_start($pos, $pos_calculating);
+	$current_game->{'finished'} = defined($pos->{'result'});
 		
 	# if this is already in the queue, ignore it (just update the result)
 	if (defined($pos_waiting) && $pos->fen() eq $pos_waiting->fen()) {
@@ -365,6 +623,19 @@ sub handle_position {
 		return;
 	}
 
+	$current_game->{'last_move_time'} = time;
+
+	# if we don't have an engine right now, remember the position
+	# until we get one (which should be right away, since the game
+	# now has had a move)
+	if (!defined($engine)) {
+		$pos_calculating = $pos;
+		$pos_waiting = undef;
+		$last_move = time;
+		schedule_games();
+		return;
+	}
+
 	# if we're already thinking on something, stop and wait for the engine
 	# to approve
 	if (defined($pos_calculating)) {
@@ -379,17 +650,25 @@ sub handle_position {
 		$pos_calculating->{'black_clock'} = $pos->{'black_clock'};
 		delete $pos_calculating->{'white_clock_target'};
 		delete $pos_calculating->{'black_clock_target'};
+		flush_infos($engine);
+		flush_infos($engine2);
 		output_json(1);
 
-		if (!defined($pos_waiting)) {
-			uciprint($engine, "stop");
-		}
-		if ($remoteglotconf::uci_assume_full_compliance) {
-			$pos_waiting = $pos;
-		} else {
-			uciprint($engine, "position fen " . $pos->fen());
-			uciprint($engine, "go infinite");
+		if ($engine->{'discard_until_bestmove'}) {
+			# The engine hasn't started on this game yet;
+			# it will start on this position when it does.
 			$pos_calculating = $pos;
+		} else {
+			if (!defined($pos_waiting)) {
+				uciprint($engine, "stop");
+			}
+			if ($remoteglotconf::uci_assume_full_compliance) {
+				$pos_waiting = $pos;
+			} else {
+				uciprint($engine, "position fen " . $pos->fen());
+				uciprint($engine, "go infinite");
+				$pos_calculating = $pos;
+			}
 		}
 	} else {
 		# it's wrong just to give the FEN (the move history is useful,
@@ -400,22 +679,49 @@ sub handle_position {
 		$pos_calculating = $pos;
 	}
 
-	if (defined($engine2)) {
+	# If the second engine guessed this move, it's already analyzing
+	# the right position, so just let it go on; otherwise, restart it.
+	my $speculation_hit = (defined($engine2) && defined($pos_speculating) &&
+		tb_cache_key($pos) eq tb_cache_key($pos_speculating));
+	if ($speculation_hit) {
+		flush_infos($engine2);
+		$pos_calculating_second_engine = $pos;
+		$pos_speculating = undef;
+		delete $engine2->{'frozen_info'};
+	} elsif (defined($engine2)) {
+		$pos_speculating = undef;
+		delete $engine2->{'frozen_info'};
 		if (defined($pos_calculating_second_engine)) {
-			uciprint($engine2, "stop");
+			stop_second_engine();
 		} else {
 			uciprint($engine2, "position fen " . $pos->fen());
 			uciprint($engine2, "go infinite");
 			$pos_calculating_second_engine = $pos;
 		}
-		$engine2->{'info'} = {};
+		clear_infos($engine2);
 	}
 
-	$engine->{'info'} = {};
+	clear_infos($engine);
+
+	# The main engine's analysis can only be started off with the second
+	# engine's once it's on the same position; with
+	# $remoteglotconf::uci_assume_full_compliance, that's not until its
+	# bestmove (see handle_uci()).
+	delete $engine->{'promote_speculation'};
+	if ($speculation_hit) {
+		if (defined($pos_waiting)) {
+			$engine->{'promote_speculation'} = 1;
+		} else {
+			promote_speculation();
+		}
+	}
 	$last_move = time;
 
 	schedule_tb_lookup();
 
+	# The game being active may have changed its share of the engines.
+	schedule_games() if (scalar @engine_pool > 0);
+
 	# 
 	# Output a command every move to note that we're
 	# still paying attention -- this is a good tradeoff,
@@ -426,6 +732,122 @@ sub handle_position {
 	$t->cmd("date");
 }
 
+# With $remoteglotconf::speculative_analysis, the second engine leaves
+# the current position once the game has been quiet for a while, and
+# goes on to the position after the move the main engine expects.
+# What it found about the current position (the refutation lines) is kept
+# and shown in the meantime. If the move is then played, the second engine
+# simply goes on, and its main line is promoted to the main analysis
+# (see promote_speculation()); if not, it starts over on the right position.
+sub speculate {
+	return if (!$remoteglotconf::speculative_analysis || !defined($engine2));
+	return if (!defined($pos_calculating) || defined($pos_waiting) ||
+	           defined($pos_calculating->{'result'}) ||
+	           !defined($pos_calculating_second_engine) ||
+	           tb_cache_key($pos_calculating_second_engine) ne tb_cache_key($pos_calculating));
+	my $now = time;
+	return if (!defined($last_move) || $now - $last_move < $remoteglotconf::speculation_delay);
+
+	# Don't follow the main engine back and forth between two moves.
+	return if (defined($pos_speculating) &&
+	           $now - $speculation_started < $remoteglotconf::speculation_delay);
+
+	my $pv = $engine->{'info'}{'pv'} // $engine->{'info'}{'pv1'};
+	return if (!defined($pv) || scalar @$pv == 0);
+	my $predicted = eval { $pos_calculating->make_move(parse_uci_move($pv->[0])) };
+	return if (!defined($predicted));
+	return if (defined($pos_speculating) && $predicted->fen() eq $pos_speculating->fen());
+
+	if (!defined($pos_speculating)) {
+		$engine2->{'frozen_info'} = $engine2->{'info'};
+		clear_infos($engine2);
+	}
+	$pos_speculating = $predicted;
+	$speculation_started = $now;
+
+	# handle_uci() starts it again on $pos_speculating.
+	stop_second_engine();
+}
+
+# Stops the second engine, so that handle_uci() can start it on a new
+# position once it has given its bestmove. Until then, its info lines
+# are about the old one, so they are thrown away. If it's already
+# stopping, one bestmove is all we're going to get.
+sub stop_second_engine {
+	return if ($engine2->{'discard_until_bestmove'});
+	uciprint($engine2, "stop");
+	$engine2->{'discard_until_bestmove'} = 1;
+}
+
+# What the second engine has to say about $pos_calculating_second_engine.
+sub second_engine_info {
+	return $engine2->{'frozen_info'} // $engine2->{'info'};
+}
+
+# The second engine was already analyzing the position we just got;
+# start the main engine off with its best line, instead of from nothing.
+sub promote_speculation {
+	return if (!defined($pos_calculating_second_engine) ||
+	           tb_cache_key($pos_calculating_second_engine) ne tb_cache_key($pos_calculating));
+	my $from = $engine2->{'info'};
+	return if (!exists($from->{'pv1'}));
+
+	my $info = $engine->{'info'};
+	for my $key (qw(pv score_cp score_mate nodes nps depth seldepth tbhits)) {
+		$info->{$key} = $from->{$key . '1'} if (exists($from->{$key . '1'}));
+	}
+	$engine->{'promoted_depth'} = $from->{'depth1'};
+	++$engine->{'speculation_hits'};
+}
+
+# Engines can send hundreds of info lines a second, and nearly all of them
+# are superseded by the next one before we get to output anything. Thus,
+# we don't parse them right away, but keep only the newest line of each
+# kind until output() needs them: lines from the same engine with the same
+# multipv number and the same set of fields replace each other. Since
+# parse_infos() only ever overwrites fields, parsing the lines we kept in
+# the order they came in gives the same result as parsing all of them.
+sub queue_infos {
+	my ($engine, @x) = @_;
+	my $mpv = '';
+	my @fields = ();
+
+	for my $i (0..$#x) {
+		if ($x[$i] eq 'multipv' && $i < $#x) {
+			$mpv = $x[$i + 1];
+		}
+		next if ($x[$i] =~ /^-?\d+$/ || $x[$i] =~ /^[a-h][1-8][a-h][1-8]/);
+		push @fields, $x[$i];
+		last if ($x[$i] eq 'pv' || $x[$i] eq 'string');
+	}
+
+	my $key = join(' ', $mpv, @fields);
+	my $pending = ($engine->{'pending_infos'} //= {});
+	++$engine->{'info_lines'};
+	++$engine->{'info_lines_coalesced'} if (exists($pending->{$key}));
+	$pending->{$key} = [ ++$engine->{'info_seq'}, \@x ];
+}
+
+# Parses all the info lines queue_infos() kept.
+sub flush_infos {
+	my ($engine) = @_;
+	return if (!defined($engine) || !defined($engine->{'pending_infos'}));
+
+	my @pending = sort { $a->[0] <=> $b->[0] } values %{$engine->{'pending_infos'}};
+	$engine->{'pending_infos'} = {};
+	for my $p (@pending) {
+		parse_infos($engine, @{$p->[1]});
+	}
+}
+
+# Forgets everything the engine has told us, parsed or not.
+sub clear_infos {
+	my ($engine) = @_;
+	$engine->{'info'} = {};
+	$engine->{'pending_infos'} = {};
+	delete $engine->{'promoted_depth'};
+}
+
 sub parse_infos {
 	my ($engine, @x) = @_;
 	my $mpv = '';
@@ -440,6 +862,17 @@ sub parse_infos {
 		}
 	}
 
+	# After promote_speculation(), the engine starts over on a position
+	# we already have deeper analysis for; ignore it until it catches up.
+	if (defined($engine->{'promoted_depth'})) {
+		for my $i (0..$#x - 1) {
+			next if ($x[$i] ne 'depth');
+			return if ($x[$i + 1] < $engine->{'promoted_depth'});
+			delete $engine->{'promoted_depth'};
+			last;
+		}
+	}
+
 	while (scalar @x > 0) {
 		if ($x[0] eq 'multipv') {
 			# Dealt with above
@@ -513,6 +946,14 @@ sub parse_ids {
 sub prettyprint_pv_no_cache {
 	my ($board, @pvs) = @_;
 
+	my $pretty = prettyprint_query($board, @pvs);
+	return @$pretty if (defined($pretty));
+	return prettyprint_pv_in_perl($board, @pvs);
+}
+
+sub prettyprint_pv_in_perl {
+	my ($board, @pvs) = @_;
+
 	if (scalar @pvs == 0 || !defined($pvs[0])) {
 		return ();
 	}
@@ -520,7 +961,66 @@ sub prettyprint_pv_no_cache {
 	my $pv = shift @pvs;
 	my ($from_row, $from_col, $to_row, $to_col, $promo) = parse_uci_move($pv);
 	my ($pretty, $nb) = $board->prettyprint_move($from_row, $from_col, $to_row, $to_col, $promo);
-	return ( $pretty, prettyprint_pv_no_cache($nb, @pvs) );
+	return ( $pretty, prettyprint_pv_in_perl($nb, @pvs) );
+}
+
+# Asks the prettyprint server (see prettyprint.c) to do the same as
+# prettyprint_pv_in_perl(), only much faster. Like with booklook, we keep
+# a single process around. Returns a reference to the list of moves, or
+# undef if the server isn't available or couldn't handle the PV, in which
+# case the caller should fall back to doing it in Perl.
+my ($prettyprint_read, $prettyprint_write);
+my $prettyprint_request_id = 0;
+my $prettyprint_available;
+my $prettyprint_failed_at;  # When we last failed to start it, if ever.
+sub prettyprint_query {
+	my ($board, @pvs) = @_;
+
+	# (this file's top level never gets past EV::run, so we can't
+	# initialize this where it's declared)
+	$prettyprint_available //= (-x './prettyprint');
+	return undef if (!$prettyprint_available);
+	return undef if (grep { !defined($_) } @pvs);
+
+	if (!defined($prettyprint_write)) {
+		# If it couldn't be started, do it in Perl for a minute
+		# before trying again.
+		return undef if (defined($prettyprint_failed_at) && time - $prettyprint_failed_at < 60);
+
+		eval {
+			IPC::Open2::open2($prettyprint_read, $prettyprint_write, './prettyprint', '--server');
+		};
+		if ($@) {
+			warn "Could not start prettyprint: $@";
+			($prettyprint_read, $prettyprint_write) = (undef, undef);
+			$prettyprint_failed_at = time;
+			return undef;
+		}
+	}
+
+	my $id = ++$prettyprint_request_id;
+	{
+		# If it has died, we'll see EOF below.
+		local $SIG{PIPE} = 'IGNORE';
+		print $prettyprint_write join(' ', $id, $board->fen(), @pvs), "\n";
+	}
+
+	my $pretty;
+	while (my $line = <$prettyprint_read>) {
+		chomp $line;
+		if ($line =~ /^end (\S+) (\S+)/ && $1 eq $id) {
+			return undef if ($2 ne 'ok');
+			return [ split / /, $pretty ];
+		}
+		$pretty = $line;
+	}
+
+	# EOF; the server went away. Restart it on the next query.
+	warn "prettyprint server died";
+	close($prettyprint_read);
+	close($prettyprint_write);
+	($prettyprint_read, $prettyprint_write) = (undef, undef);
+	return undef;
 }
 
 sub prettyprint_pv {
@@ -536,93 +1036,164 @@ sub prettyprint_pv {
 	}
 }
 
-my %tbprobe_cache = ();
+# Syzygy probes are done by a ./syzygy server (see syzygy.c), which we
+# keep around so that it keeps the tables open; it also caches its answers,
+# keyed on the position probed, so we don't need to.
+my ($syzygy_read, $syzygy_write);
+my $syzygy_request_id = 0;
+my $syzygy_failed_at;  # When we last failed to start it, if ever.
 
+# Converts scores like +123.45 in the given PVs into mates, by following
+# each PV until there are few enough pieces left and splicing the best line
+# from the tablebases onto it. All the positions are probed in one go.
 sub complete_using_tbprobe {
-	my ($pos, $info, $mpv) = @_;
+	my ($pos, $info, @mpvs) = @_;
 
-	# We need Fathom installed to do standalone TB probes.
-	return if (!defined($remoteglotconf::fathom_cmdline));
+	# We need the probe server and the tables to do standalone TB probes.
+	return if (!defined($remoteglotconf::syzygy_path));
 
-	# If we already have a mate, don't bother; in some cases, it would even be
-	# better than a tablebase score.
-	return if defined($info->{'score_mate' . $mpv});
+	my @probes = ();
+	for my $mpv (@mpvs) {
+		next if (!exists($info->{'pv' . $mpv}));
 
-	# If we have a draw or near-draw score, there's also not much interesting
-	# we could add from a tablebase. We only really want mates.
-	return if ($info->{'score_cp' . $mpv} >= -12250 && $info->{'score_cp' . $mpv} <= 12250);
+		# If we already have a mate, don't bother; in some cases, it would even be
+		# better than a tablebase score.
+		next if defined($info->{'score_mate' . $mpv});
 
-	# Run through the PV until we are at a 6-man position.
-	# TODO: We could in theory only have 5-man data.
-	my @pv = @{$info->{'pv' . $mpv}};
-	my $key = $pos->fen() . " " . join('', @pv);
-	my @moves = ();
-	if (exists($tbprobe_cache{$key})) {
-		@moves = @{$tbprobe_cache{$key}};
-	} else {
-		if ($mpv ne '') {
-			# Force doing at least one move of the PV.
-			my $move = shift @pv;
-			push @moves, $move;
-			$pos = $pos->make_move(parse_uci_move($move));
-		}
+		# If we have a draw or near-draw score, there's also not much interesting
+		# we could add from a tablebase. We only really want mates.
+		next if (!defined($info->{'score_cp' . $mpv}) ||
+		         ($info->{'score_cp' . $mpv} >= -12250 && $info->{'score_cp' . $mpv} <= 12250));
 
-		while ($pos->num_pieces() > 6 && $#pv > -1) {
-			my $move = shift @pv;
-			push @moves, $move;
-			$pos = $pos->make_move(parse_uci_move($move));
-		}
+		# Run through the PV until we are at a 6-man position.
+		# TODO: We could in theory only have 5-man data.
+		my @pv = @{$info->{'pv' . $mpv}};
+		my @moves = ();
+		my $tb_pos = $pos;
+		eval {
+			if ($mpv ne '') {
+				# Force doing at least one move of the PV.
+				my $move = shift @pv;
+				push @moves, $move;
+				$tb_pos = $tb_pos->make_move(parse_uci_move($move));
+			}
 
-		return if ($pos->num_pieces() > 6);
+			while ($tb_pos->num_pieces() > 6 && $#pv > -1) {
+				my $move = shift @pv;
+				push @moves, $move;
+				$tb_pos = $tb_pos->make_move(parse_uci_move($move));
+			}
+		};
+		next if ($@ || $tb_pos->num_pieces() > 6);
 
-		my $fen = $pos->fen();
-		my $pgn_text = `fathom --path=/srv/syzygy "$fen"`;
-		my $pgn = Chess::PGN::Parse->new(undef, $pgn_text);
-		return if (!defined($pgn) || !$pgn->read_game() || ($pgn->result ne '0-1' && $pgn->result ne '1-0'));
-		$pgn->quick_parse_game;
-		$info->{'pv' . $mpv} = \@moves;
+		push @probes, [ $mpv, \@moves, $tb_pos->fen() ];
+	}
+	return if (scalar @probes == 0);
+
+	my @lines = syzygy_query(map { $_->[2] } @probes);
+	for my $i (0..$#probes) {
+		my ($mpv, $moves) = @{$probes[$i]};
+		next if (!defined($lines[$i]));
 
 		# Splice the PV from the tablebase onto what we have so far.
-		for my $move (@{$pgn->moves}) {
-			my $uci_move;
-			($pos, $uci_move) = $pos->make_pretty_move($move);
-			push @moves, $uci_move;
+		my @moves = (@$moves, @{$lines[$i]});
+		$info->{'pv' . $mpv} = \@moves;
+
+		my $matelen = int((1 + scalar @moves) / 2);
+		if ((scalar @moves) % 2 == 0) {
+			$info->{'score_mate' . $mpv} = -$matelen;
+		} else {
+			$info->{'score_mate' . $mpv} = $matelen;
 		}
+	}
+}
+
+# Asks the Syzygy probe server about the given positions. Returns, for each
+# of them, the tablebase line (as a reference to a list of UCI moves) if the
+# position is won or lost, or undef if it is drawn or unknown.
+sub syzygy_query {
+	my @fens = @_;
 
-		$tbprobe_cache{$key} = \@moves;
+	if (!defined($syzygy_write)) {
+		# If it couldn't be started, go without probes for a minute
+		# before trying again.
+		return () if (defined($syzygy_failed_at) && time - $syzygy_failed_at < 60);
+
+		eval {
+			IPC::Open2::open2($syzygy_read, $syzygy_write, './syzygy', '--path', $remoteglotconf::syzygy_path, '--server');
+		};
+		if ($@) {
+			warn "Could not start syzygy: $@";
+			($syzygy_read, $syzygy_write) = (undef, undef);
+			$syzygy_failed_at = time;
+			return ();
+		}
 	}
 
-	$info->{'pv' . $mpv} = \@moves;
+	# Send everything first, so that the server doesn't have to wait for us.
+	# (The counter starts out undef; see the comment in prettyprint_query().)
+	my $first_id = ($syzygy_request_id // 0) + 1;
+	{
+		# If it has died, we'll see EOF below.
+		local $SIG{PIPE} = 'IGNORE';
+		for my $fen (@fens) {
+			my $id = ++$syzygy_request_id;
+			print $syzygy_write "$id $fen\n";
+		}
+	}
 
-	my $matelen = int((1 + scalar @moves) / 2);
-	if ((scalar @moves) % 2 == 0) {
-		$info->{'score_mate' . $mpv} = -$matelen;
-	} else {
-		$info->{'score_mate' . $mpv} = $matelen;
+	my @lines = ();
+	my $line_moves;
+	while (scalar @lines < scalar @fens) {
+		my $line = <$syzygy_read>;
+		if (!defined($line)) {
+			# EOF; the server went away. Restart it on the next query.
+			warn "syzygy server died";
+			close($syzygy_read);
+			close($syzygy_write);
+			($syzygy_read, $syzygy_write) = (undef, undef);
+			return ();
+		}
+		chomp $line;
+		if ($line =~ /^end (\S+) (\S+)/ && $1 == $first_id + scalar @lines) {
+			push @lines, ($2 eq '1-0' || $2 eq '0-1') ? [ split ' ', $line_moves ] : undef;
+			$line_moves = undef;
+		} else {
+			$line_moves = $line;
+		}
 	}
+	return @lines;
 }
 
 sub output {
 	#return;
 
-	return if (!defined($pos_calculating));
+	# (No engine means that the game has to wait for one; see schedule_games().)
+	return if (!defined($pos_calculating) || !defined($engine));
 
-	# Don't update too often.
+	# Don't update too often. We get called for every line from the
+	# engines, so only set the timer if it isn't already running.
 	my $age = Time::HiRes::tv_interval($latest_update);
 	if ($age < $remoteglotconf::update_max_interval) {
 		my $wait = $remoteglotconf::update_max_interval + 0.01 - $age;
-		$output_timer = AnyEvent->timer(after => $wait, cb => \&output);
+		$output_timer //= AnyEvent->timer(after => $wait, cb => in_this_game(sub {
+			$output_timer = undef;
+			output();
+		}));
 		return;
 	}
-	
+
+	flush_infos($engine);
+	flush_infos($engine2);
+	speculate();
 	my $info = $engine->{'info'};
 
 	#
 	# If we have tablebase data from a previous lookup, replace the
 	# engine data with the data from the tablebase.
 	#
-	my $fen = $pos_calculating->fen();
-	if (exists($tb_cache{$fen})) {
+	my $tb_key = tb_cache_key($pos_calculating);
+	if (exists($tb_cache{$tb_key})) {
 		for my $key (qw(pv score_cp score_mate nodes nps depth seldepth tbhits)) {
 			delete $info->{$key . '1'};
 			delete $info->{$key};
@@ -633,7 +1204,8 @@ sub output {
 		$info->{'seldepth'} = 0;
 		$info->{'tbhits'} = 0;
 
-		my $t = $tb_cache{$fen};
+		my $t = $tb_cache{$tb_key};
+		$t->{'used'} = time;
 		my $pv = $t->{'pv'};
 		my $matelen = int((1 + $t->{'score'}) / 2);
 		if ($t->{'result'} eq '1/2-1/2') {
@@ -690,20 +1262,19 @@ sub output {
 		}
 	};
 	if ($@) {
-		$engine->{'info'} = {};
+		clear_infos($engine);
 		return;
 	}
 
 	# Now do our own Syzygy tablebase probes to convert scores like +123.45 to mate.
-	if (exists($info->{'pv'})) {
-		complete_using_tbprobe($pos_calculating, $info, '');
+	my @mpvs = ('');
+	for (my $mpv = 1; exists($info->{'pv' . $mpv}); ++$mpv) {
+		push @mpvs, $mpv;
 	}
+	complete_using_tbprobe($pos_calculating, $info, @mpvs);
 
-	my $mpv = 1;
-	while (exists($info->{'pv' . $mpv})) {
-		complete_using_tbprobe($pos_calculating, $info, $mpv);
-		++$mpv;
-	}
+	# The PVs may have led us to new endgames to ask the tablebases about.
+	schedule_tb_lookup();
 
 	output_screen();
 	output_json(0);
@@ -711,6 +1282,9 @@ sub output {
 }
 
 sub output_screen {
+	# With several games, we only have room for the first one.
+	return if ($current_game != $games[0]);
+
 	my $info = $engine->{'info'};
 	my $id = $engine->{'id'};
 
@@ -785,15 +1359,17 @@ sub output_screen {
 		$text .= "\n\n";
 	}
 
-	#$text .= book_info($pos_calculating->fen(), $pos_calculating->{'board'}, $pos_calculating->{'toplay'});
+	if ($remoteglotconf::book_lookups) {
+		$text .= book_info($pos_calculating->fen(), $pos_calculating->{'board'}, $pos_calculating->{'toplay'});
+	}
 
 	my @refutation_lines = ();
 	if (defined($engine2)) {
+		complete_using_tbprobe($pos_calculating_second_engine, second_engine_info(), 1..499);
 		for (my $mpv = 1; $mpv < 500; ++$mpv) {
-			my $info = $engine2->{'info'};
+			my $info = second_engine_info();
 			last if (!exists($info->{'pv' . $mpv}));
 			eval {
-				complete_using_tbprobe($pos_calculating_second_engine, $info, $mpv);
 				my $pv = $info->{'pv' . $mpv};
 				my $pretty_move = join('', prettyprint_pv($pos_calculating_second_engine, $pv->[0]));
 				my @pretty_pv = prettyprint_pv($pos_calculating_second_engine, @$pv);
@@ -820,6 +1396,20 @@ sub output_screen {
 		$text .= "\n\n";	
 	}	
 
+	for my $e ($engine, $engine2) {
+		next if (!defined($e) || !$e->{'info_lines'});
+		$text .= sprintf "%s: %u info lines, %u coalesced\n",
+			$e->{'tag'}, $e->{'info_lines'}, $e->{'info_lines_coalesced'} // 0;
+	}
+
+	if (defined($pos_speculating)) {
+		$text .= sprintf "%s: speculating on %s (%u hits so far)\n",
+			$engine2->{'tag'}, $pos_speculating->{'last_move'}, $engine->{'speculation_hits'} // 0;
+	}
+
+	$text .= score_writer_status();
+	$text .= engine_pool_status();
+
 	if ($last_text ne $text) {
 		print "[H[2J"; # clear the screen
 		print $text;
@@ -860,14 +1450,14 @@ sub output_json {
 	my %refutation_lines = ();
 	my @refutation_lines = ();
 	if (defined($engine2)) {
+		complete_using_tbprobe($pos_calculating, second_engine_info(), 1..499);
 		for (my $mpv = 1; $mpv < 500; ++$mpv) {
-			my $info = $engine2->{'info'};
+			my $info = second_engine_info();
 			my $pretty_move = "";
 			my @pretty_pv = ();
 			last if (!exists($info->{'pv' . $mpv}));
 
 			eval {
-				complete_using_tbprobe($pos_calculating, $info, $mpv);
 				my $pv = $info->{'pv' . $mpv};
 				my $pretty_move = join('', prettyprint_pv($pos_calculating, $pv->[0]));
 				my @pretty_pv = prettyprint_pv($pos_calculating, @$pv);
@@ -884,79 +1474,36 @@ sub output_json {
 
 	# Piece together historic score information, to the degree we have it.
 	if (!$historic_json_only && exists($pos_calculating->{'history'})) {
-		my %score_history = ();
-
-		my $q = $dbh->prepare('SELECT * FROM scores WHERE id=?');
-		my $pos = Position->start_pos('white', 'black');
-		my $halfmove_num = 0;
-		for my $move (@{$pos_calculating->{'history'}}) {
-			my $id = id_for_pos($pos, $halfmove_num);
-			my $ref = $dbh->selectrow_hashref($q, undef, $id);
-			if (defined($ref)) {
-				$score_history{$halfmove_num} = [
-					$ref->{'score_type'},
-					$ref->{'score_value'}
-				];
-			}
-			++$halfmove_num;
-			($pos) = $pos->make_pretty_move($move);
-		}
-		$q->finish;
-
-		# If at any point we are missing 10 consecutive moves,
-		# truncate the history there. This is so we don't get into
-		# a situation where we e.g. start analyzing at move 45,
-		# but we have analysis for 1. e4 from some completely different game
-		# and thus show a huge hole.
-		my $consecutive_missing = 0;
-		my $truncate_until = 0;
-		for (my $i = $halfmove_num; $i --> 0; ) {
-			if ($consecutive_missing >= 10) {
-				delete $score_history{$i};
-				next;
-			}
-			if (exists($score_history{$i})) {
-				$consecutive_missing = 0;
-			} else {
-				++$consecutive_missing;
-			}
-		}
-
-		$json->{'score_history'} = \%score_history;
+		$json->{'score_history'} = get_score_history($pos_calculating);
 	}
 
 	# Give out a list of other games going on. (Empty is fine.)
-	# TODO: Don't bother reading our own file, the data will be stale anyway.
+	# Our own entry comes from what we are about to write, not from the file.
 	if (!$historic_json_only) {
-		my @games = ();
-
-		my $q = $dbh->prepare('SELECT * FROM current_games ORDER BY priority DESC, id');
-		$q->execute;
-		while (my $ref = $q->fetchrow_hashref) {
+		if (defined($current_game->{'json_output'})) {
 			eval {
-				my $other_game_contents = File::Slurp::read_file($ref->{'json_path'});
-				my $other_game_json = JSON::XS::decode_json($other_game_contents);
-
-				die "Missing position" if (!exists($other_game_json->{'position'}));
-				my $white = $other_game_json->{'position'}{'player_w'} // die 'Missing white';
-				my $black = $other_game_json->{'position'}{'player_b'} // die 'Missing black';
-
-				my $game = {
-					id => $ref->{'id'},
-					name => "$white–$black",
-					url => $ref->{'url'},
-					hashurl => $ref->{'hash_url'},
-				};
-				if (defined($other_game_json->{'position'}{'result'})) {
-					$game->{'result'} = $other_game_json->{'position'}{'result'};
-				} else {
-					$game->{'score'} = $other_game_json->{'score'};
-				}
-				push @games, $game;
+				write_game_summary($current_game->{'json_output'}, game_summary($json));
 			};
-			if ($@) {
-				warn "Could not add external game " . $ref->{'json_path'} . ": $@";
+			warn "Could not write game summary: $@" if ($@);
+		}
+
+		my @games = ();
+		for my $ref (@current_games_rows) {
+			my $summary = $game_summaries{$ref->{'json_path'}};
+			next if (!defined($summary));
+
+			my $game = {
+				id => $ref->{'id'},
+				name => "$summary->{'white'}–$summary->{'black'}",
+				url => $ref->{'url'},
+				hashurl => $ref->{'hash_url'},
+			};
+			if (defined($summary->{'result'})) {
+				$game->{'result'} = $summary->{'result'};
+			} else {
+				$game->{'score'} = $summary->{'score'};
 			}
+			push @games, $game;
 		}
 
 		if (scalar @games > 0) {
@@ -967,9 +1514,12 @@ sub output_json {
 	my $json_enc = JSON::XS->new;
 	$json_enc->canonical(1);
 	my $encoded = $json_enc->encode($json);
-	unless ($historic_json_only || !defined($remoteglotconf::json_output) ||
+	unless ($historic_json_only ||
 	        (defined($last_written_json) && $last_written_json eq $encoded)) {
-		atomic_set_contents($remoteglotconf::json_output, $encoded);
+		push_json($current_game->{'json_socket'}, $encoded)
+			if (defined($current_game->{'json_socket'}));
+		atomic_set_contents($current_game->{'json_output'}, $encoded)
+			if (defined($current_game->{'json_output'}));
 		$last_written_json = $encoded;
 	}
 
@@ -991,19 +1541,315 @@ sub output_json {
 		    ($new_depth == $old_depth && $new_nodes >= $old_nodes)) {
 			atomic_set_contents($filename, $encoded);
 			if (defined($json->{'score'})) {
-				$dbh->do('INSERT INTO scores (id, score_type, score_value, engine, depth, nodes) VALUES (?,?,?,?,?,?) ' .
-				         '    ON CONFLICT (id) DO UPDATE SET ' .
-				         '        score_type=EXCLUDED.score_type, ' .
-					 '        score_value=EXCLUDED.score_value, ' .
-					 '        engine=EXCLUDED.engine, ' .
-					 '        depth=EXCLUDED.depth, ' .
-					 '        nodes=EXCLUDED.nodes',
-					undef,
-					$id, $json->{'score'}[0], $json->{'score'}[1],
-					$json->{'engine'}{'name'}, $new_depth, $new_nodes);
+				queue_score($id, $json->{'engine'}{'name'}, $new_depth, $new_nodes,
+				            $json->{'score'}[0], $json->{'score'}[1]);
+				score_history_set_score($id, $json->{'score'}[0], $json->{'score'}[1]);
+			}
+		}
+	}
+}
+
+# The score history of the game we're following, for output_json(). We keep
+# it up to date as moves come in and as we write scores, instead of
+# replaying the game and asking the database about every position for
+# every update; normally, a new move costs one position and one query,
+# and anything else costs nothing.
+# Set up by reset_score_history(); this file's top level never gets past
+# EV::run, so we can't initialize it here.
+my %score_history = ();
+
+# Scores are written through a connection of their own, asynchronously,
+# so that a slow database doesn't hold up the engines. Updates are queued
+# per position id, where a new one replaces the old (output_json() only
+# queues analysis that is better than what we have), and written in one
+# batch every $remoteglotconf::score_flush_interval seconds. We remember
+# what we have written or queued for each id, so that we only need to
+# ask the database the first time we see a position.
+# Set up by score_writer_init(); this file's top level never gets past
+# EV::run, so we can't initialize it here.
+my %score_writer = ();
+
+sub get_score_history {
+	my ($pos) = @_;
+	my $history = $pos->{'history'};
+
+	reset_score_history() if (!exists($score_history{'moves'}));
+	my $cached = $score_history{'moves'};
+
+	# Normally, the game has just gotten longer. If not (or if the
+	# new moves don't take us to the given position), start over.
+	my $start = scalar @$cached;
+	if ($start > scalar @$history ||
+	    ($start > 0 && $cached->[$start - 1] ne $history->[$start - 1])) {
+		reset_score_history();
+		$start = 0;
+	}
+	if ($start < scalar @$history) {
+		my $new_pos = extend_score_history($history, $start);
+		if ($new_pos->{'board'}->fen() ne $pos->{'board'}->fen() ||
+		    $new_pos->{'toplay'} ne $pos->{'toplay'}) {
+			reset_score_history();
+			extend_score_history($history, 0);
+		}
+	}
+
+	if (!defined($score_history{'json'})) {
+		my %json = %{$score_history{'scores'}};
+
+		# If at any point we are missing 10 consecutive moves,
+		# truncate the history there. This is so we don't get into
+		# a situation where we e.g. start analyzing at move 45,
+		# but we have analysis for 1. e4 from some completely different game
+		# and thus show a huge hole.
+		my $consecutive_missing = 0;
+		for (my $i = scalar @$history; $i --> 0; ) {
+			if ($consecutive_missing >= 10) {
+				delete $json{$i};
+				next;
+			}
+			if (exists($json{$i})) {
+				$consecutive_missing = 0;
+			} else {
+				++$consecutive_missing;
 			}
 		}
+		$score_history{'json'} = \%json;
+	}
+	return $score_history{'json'};
+}
+
+sub reset_score_history {
+	%score_history = (
+		moves => [],       # the moves we've replayed so far
+		ids => [],         # the position id before each of them
+		halfmove_by_id => {},
+		scores => {},      # halfmove number => [ score_type, score_value ]
+		last_pos => undef, # the position after the last of the moves
+		json => undef,     # what we last gave out, if nothing has changed since
+	);
+}
+
+# Replays the moves in <history> from <start> on, and fetches the scores
+# for the positions before them in one go. Returns the position after
+# the last move.
+sub extend_score_history {
+	my ($history, $start) = @_;
+	my $pos = $score_history{'last_pos'} // Position->start_pos('white', 'black');
+
+	my @new_ids = ();
+	for my $halfmove_num ($start..$#$history) {
+		my $move = $history->[$halfmove_num];
+		my $id = id_for_pos($pos, $halfmove_num);
+		push @{$score_history{'moves'}}, $move;
+		push @{$score_history{'ids'}}, $id;
+		$score_history{'halfmove_by_id'}{$id} = $halfmove_num;
+		push @new_ids, $id;
+		($pos) = $pos->make_pretty_move($move);
+	}
+	$score_history{'last_pos'} = $pos;
+	$score_history{'json'} = undef;
+
+	score_writer_init();
+	my $q = $dbh->prepare('SELECT id, score_type, score_value, engine, depth, nodes FROM scores WHERE id = ANY(?)');
+	$q->execute(\@new_ids);
+	while (my $ref = $q->fetchrow_hashref) {
+		$score_writer{'known'}{$ref->{'id'}} //=
+			[ $ref->{'engine'}, $ref->{'depth'}, $ref->{'nodes'}, $ref->{'score_type'}, $ref->{'score_value'} ];
+	}
+	$q->finish;
+
+	# Scores we've queued may not have made it to the database yet,
+	# so take them from the writer instead.
+	for my $id (@new_ids) {
+		my $row = score_writer_row($id);
+		next if (!defined($row) || !defined($row->[3]));
+		$score_history{'scores'}{$score_history{'halfmove_by_id'}{$id}} = [ $row->[3], $row->[4] ];
+	}
+
+	return $pos;
+}
+
+# Called when we've written a new score for the given position id.
+sub score_history_set_score {
+	my ($id, $score_type, $score_value) = @_;
+	my $halfmove_num = $score_history{'halfmove_by_id'}{$id};
+	return if (!defined($halfmove_num));
+
+	$score_history{'scores'}{$halfmove_num} = [ $score_type, $score_value ];
+	$score_history{'json'} = undef;
+}
+
+sub refresh_current_games {
+	my $q = $dbh->prepare('SELECT * FROM current_games ORDER BY priority DESC, id');
+	$q->execute;
+	my @rows = ();
+	while (my $ref = $q->fetchrow_hashref) {
+		push @rows, $ref;
+		my $path = $ref->{'json_path'};
+		next if (grep { ($_->{'json_output'} // '') eq $path } @games);  # See output_json().
+		my $watched = watch_game_summary($path);
+		load_game_summary($path) if (!$watched || !exists($game_summaries{$path}));
 	}
+	@current_games_rows = @rows;
+
+	my %live = map { $_->{'json_path'} => 1 } @rows;
+	for my $path (keys %game_summaries) {
+		delete $game_summaries{$path} if (!$live{$path});
+	}
+}
+
+# What the game list needs to know about a game, from its full JSON.
+sub game_summary {
+	my $json = shift;
+	die "Missing position" if (!exists($json->{'position'}));
+	my $summary = {
+		white => $json->{'position'}{'player_w'} // die('Missing white'),
+		black => $json->{'position'}{'player_b'} // die('Missing black'),
+	};
+	if (defined($json->{'position'}{'result'})) {
+		$summary->{'result'} = $json->{'position'}{'result'};
+	} else {
+		$summary->{'score'} = $json->{'score'};
+	}
+	return $summary;
+}
+
+# Written next to the game's JSON, whenever it changes.
+sub write_game_summary {
+	my ($path, $summary) = @_;
+	my $encoded = JSON::XS->new->canonical(1)->encode($summary);
+	$game_summaries{$path} = $summary;
+	return if (defined($current_game->{'last_written_summary'}) &&
+	           $current_game->{'last_written_summary'} eq $encoded);
+	atomic_set_contents($path . ".summary", $encoded);
+	$current_game->{'last_written_summary'} = $encoded;
+}
+
+# Games that don't write a summary (e.g. from an older remoteglot)
+# are read in full, but only when their JSON changes.
+sub load_game_summary {
+	my $path = shift;
+	my $summary = eval {
+		if (-e $path . ".summary") {
+			JSON::XS::decode_json(File::Slurp::read_file($path . ".summary"));
+		} else {
+			game_summary(JSON::XS::decode_json(File::Slurp::read_file($path)));
+		}
+	};
+	if ($@) {
+		warn "Could not add external game $path: $@";
+	}
+	$game_summaries{$path} = $summary;
+}
+
+# Returns whether we'll hear about changes to the game; if not, the caller
+# has to read it again every time.
+sub watch_game_summary {
+	my $path = shift;
+	my $dir = File::Basename::dirname($path);
+	return $inotify_watched_dirs{$dir} if (exists($inotify_watched_dirs{$dir}));
+
+	if (!defined($inotify)) {
+		return 0 if ($inotify_failed);
+		$inotify = eval {
+			require Linux::Inotify2;
+			Linux::Inotify2->new or die "$!\n";
+		};
+		if (!defined($inotify)) {
+			warn "Could not set up inotify, reading other games every $remoteglotconf::games_refresh_interval seconds instead: $@";
+			$inotify_failed = 1;
+			return 0;
+		}
+		$inotify->blocking(0);
+		$inotify_io = AnyEvent->io(fh => $inotify->fileno, poll => 'r', cb => sub { $inotify->poll });
+	}
+
+	# atomic_set_contents() renames the new file into place.
+	my $watch = $inotify->watch($dir, Linux::Inotify2::IN_MOVED_TO() | Linux::Inotify2::IN_CLOSE_WRITE(), sub {
+		my $event = shift;
+		my $name = $event->fullname;
+		(my $path = $name) =~ s/\.summary$//;
+		return if (!exists($game_summaries{$path}));
+		return if (grep { ($_->{'json_output'} // '') eq $path } @games);
+		return if ($name eq $path && -e $path . ".summary");
+		load_game_summary($path);
+	});
+	if (!defined($watch)) {
+		warn "Could not watch $dir for other games: $!";
+		$inotify_watched_dirs{$dir} = 0;
+		return 0;
+	}
+	$inotify_watched_dirs{$dir} = 1;
+	return 1;
+}
+
+# New versions of the JSON are pushed straight to serve-analysis.js over
+# its Unix socket, one line each ("<version> <json>"), so that it doesn't
+# need to wait for the file, nor read it back. If the server is slow to
+# take them, only the newest one waits to be sent; if it's not there,
+# we try again every few seconds, and send the newest one when we get
+# through. Keyed by socket path.
+my %json_push = ();
+
+sub push_json {
+	my ($path, $encoded) = @_;
+	my $push = ($json_push{$path} //= { version => 0 });
+
+	# The version takes the place of the file's mtime, so it's in milliseconds.
+	my $version = int(Time::HiRes::time() * 1000);
+	$version = $push->{'version'} + 1 if ($version <= $push->{'version'});
+	$push->{'version'} = $version;
+	$push->{'pending'} = "$version $encoded\n";
+
+	if (defined($push->{'handle'})) {
+		send_pushed_json($push);
+	} elsif (!defined($push->{'retry_timer'}) && !$push->{'connecting'}) {
+		connect_json_push($path, $push);
+	}
+}
+
+# Only one version is written at a time; 'writing' is cleared by on_drain
+# (which can be called from within push_write(), so it's set before).
+sub send_pushed_json {
+	my $push = shift;
+	return if (!defined($push->{'pending'}) || $push->{'writing'});
+	my $line = delete $push->{'pending'};
+	$push->{'writing'} = 1;
+	$push->{'handle'}->push_write($line);
+}
+
+sub connect_json_push {
+	my ($path, $push) = @_;
+	$push->{'connecting'} = 1;
+	AnyEvent::Socket::tcp_connect('unix/', $path, sub {
+		my ($fh) = @_;
+		$push->{'connecting'} = 0;
+		if (!defined($fh)) {
+			warn "Could not connect to $path: $!";
+			$push->{'retry_timer'} = AnyEvent->timer(after => 5.0, cb => sub {
+				delete $push->{'retry_timer'};
+				connect_json_push($path, $push) if (defined($push->{'pending'}));
+			});
+			return;
+		}
+		my $lost = sub {
+			my ($handle, $fatal, $msg) = @_;
+			warn "Lost connection to $path: " . ($msg // 'EOF');
+			$handle->destroy;
+			delete $push->{'handle'};
+			delete $push->{'writing'};
+		};
+		$push->{'handle'} = AnyEvent::Handle->new(
+			fh => $fh,
+			on_error => $lost,
+			on_eof => $lost,
+			on_drain => sub {
+				$push->{'writing'} = 0;
+				send_pushed_json($push);
+			},
+		);
+		send_pushed_json($push);
+	});
 }
 
 sub atomic_set_contents {
@@ -1026,12 +1872,150 @@ sub id_for_pos {
 
 sub get_json_analysis_stats {
 	my $id = shift;
-	my $ref = $dbh->selectrow_hashref('SELECT * FROM scores WHERE id=?', undef, $id);
-	if (defined($ref)) {
-		return ($ref->{'engine'}, $ref->{'depth'}, $ref->{'nodes'});
+	my $row = score_writer_row($id);
+	if (!defined($row)) {
+		my $ref = $dbh->selectrow_hashref('SELECT * FROM scores WHERE id=?', undef, $id);
+		if (defined($ref)) {
+			$row = [ $ref->{'engine'}, $ref->{'depth'}, $ref->{'nodes'}, $ref->{'score_type'}, $ref->{'score_value'} ];
+		} else {
+			$row = [ '', 0, 0, undef, undef ];
+		}
+		$score_writer{'known'}{$id} = $row;
+	}
+	return @$row[0..2];
+}
+
+sub score_writer_init {
+	return if (exists($score_writer{'known'}));
+	%score_writer = (
+		dbh => undef,
+		known => {},         # id => [ engine, depth, nodes, score_type, score_value ]
+		pending => {},       # same, for those not sent yet
+		in_flight => undef,  # same, for the batch being written, if any
+		io => undef,
+		timer => undef,
+		flush_start => undef,
+		last_flush_ms => undef,
+		max_flush_ms => 0,
+		flushes => 0,
+		failures => 0,
+	);
+}
+
+# The last score we wrote or queued for the given id, or undef if we don't know.
+sub score_writer_row {
+	my $id = shift;
+	score_writer_init();
+	return $score_writer{'pending'}{$id} //
+		(defined($score_writer{'in_flight'}) ? $score_writer{'in_flight'}{$id} : undef) //
+		$score_writer{'known'}{$id};
+}
+
+sub queue_score {
+	my ($id, $engine, $depth, $nodes, $score_type, $score_value) = @_;
+	score_writer_init();
+
+	# Everything we need to keep is in <pending> and <in_flight>,
+	# so just start over if this gets big.
+	if (scalar keys %{$score_writer{'known'}} >= 100000) {
+		$score_writer{'known'} = {};
+	}
+
+	my $row = [ $engine, $depth, $nodes, $score_type, $score_value ];
+	$score_writer{'known'}{$id} = $row;
+	$score_writer{'pending'}{$id} = $row;
+	schedule_score_flush();
+}
+
+sub schedule_score_flush {
+	$score_writer{'timer'} //= AnyEvent->timer(after => $remoteglotconf::score_flush_interval, cb => sub {
+		$score_writer{'timer'} = undef;
+		flush_scores();
+	});
+}
+
+sub flush_scores {
+	# If a batch is still being written, finish_score_flush() will
+	# come back for the rest.
+	return if (defined($score_writer{'in_flight'}) || scalar keys %{$score_writer{'pending'}} == 0);
+
+	my $batch = $score_writer{'pending'};
+	$score_writer{'pending'} = {};
+	$score_writer{'in_flight'} = $batch;
+	$score_writer{'flush_start'} = [Time::HiRes::gettimeofday];
+
+	my @ids = sort keys %$batch;
+	my @columns = map { my $i = $_; [ map { $batch->{$_}[$i] } @ids ] } (0..4);
+	eval {
+		if (!defined($score_writer{'dbh'})) {
+			my $sdbh = DBI->connect($remoteglotconf::dbistr, $remoteglotconf::dbiuser, $remoteglotconf::dbipass)
+				or die DBI->errstr;
+			$sdbh->{RaiseError} = 1;
+			$score_writer{'dbh'} = $sdbh;
+		}
+		my $sdbh = $score_writer{'dbh'};
+		$sdbh->do('INSERT INTO scores (id, score_type, score_value, engine, depth, nodes) ' .
+		          '    SELECT * FROM unnest(?::varchar[], ?::varchar[], ?::integer[], ?::varchar[], ?::bigint[], ?::bigint[]) ' .
+		          '    ON CONFLICT (id) DO UPDATE SET ' .
+		          '        score_type=EXCLUDED.score_type, ' .
+		          '        score_value=EXCLUDED.score_value, ' .
+		          '        engine=EXCLUDED.engine, ' .
+		          '        depth=EXCLUDED.depth, ' .
+		          '        nodes=EXCLUDED.nodes',
+			{ pg_async => PG_ASYNC },
+			\@ids, $columns[3], $columns[4], $columns[0], $columns[1], $columns[2]);
+		$score_writer{'io'} = AnyEvent->io(
+			fh => $sdbh->{'pg_socket'},
+			poll => 'r',
+			cb => sub {
+				my $ok = eval {
+					return 0 if (!$sdbh->pg_ready);
+					$sdbh->pg_result;
+					1;
+				};
+				return if (defined($ok) && !$ok);  # Not done yet.
+				finish_score_flush($ok, $@);
+			}
+		);
+	};
+	if ($@) {
+		finish_score_flush(0, $@);
+	}
+}
+
+sub finish_score_flush {
+	my ($ok, $err) = @_;
+	my $batch = $score_writer{'in_flight'};
+	$score_writer{'in_flight'} = undef;
+	$score_writer{'io'} = undef;
+
+	my $elapsed_ms = 1e3 * Time::HiRes::tv_interval($score_writer{'flush_start'});
+	$score_writer{'last_flush_ms'} = $elapsed_ms;
+	$score_writer{'max_flush_ms'} = $elapsed_ms if ($elapsed_ms > $score_writer{'max_flush_ms'});
+
+	if ($ok) {
+		++$score_writer{'flushes'};
 	} else {
-		return ('', 0, 0);
+		# Put back whatever hasn't been superseded since, and reconnect
+		# for the next try.
+		warn "Writing scores failed: $err";
+		++$score_writer{'failures'};
+		$score_writer{'dbh'} = undef;
+		while (my ($id, $row) = each %$batch) {
+			$score_writer{'pending'}{$id} //= $row;
+		}
 	}
+	schedule_score_flush() if (scalar keys %{$score_writer{'pending'}} > 0);
+}
+
+# A line for the screen about how the score writes are doing, if there have been any.
+sub score_writer_status {
+	return '' if (!exists($score_writer{'known'}) || !defined($score_writer{'last_flush_ms'}));
+	my $queued = scalar keys %{$score_writer{'pending'}};
+	$queued += scalar keys %{$score_writer{'in_flight'}} if (defined($score_writer{'in_flight'}));
+	return sprintf "Scores: %u queued, last write %.1f ms (max %.1f ms), %u writes, %u failed\n",
+		$queued, $score_writer{'last_flush_ms'}, $score_writer{'max_flush_ms'},
+		$score_writer{'flushes'}, $score_writer{'failures'};
 }
 
 sub uciprint {
@@ -1161,20 +2145,20 @@ sub plot_score {
 	return undef;
 }
 
-my %book_cache = ();
+my ($booklook_read, $booklook_write);
+my $booklook_request_id = 0;
+my $booklook_failed_at;  # When we last failed to start it, if ever.
 sub book_info {
 	my ($fen, $board, $toplay) = @_;
 
-	if (exists($book_cache{$fen})) {
-		return $book_cache{$fen};
+	my @lines = booklook_query($fen);
+	if (scalar @lines == 0) {
+		return "";
 	}
 
-	my $ret = `./booklook $fen`;
-	return "" if ($ret =~ /Not found/ || $ret eq '');
-
 	my @moves = ();
 
-	for my $m (split /\n/, $ret) {
+	for my $m (@lines) {
 		my ($move, $annotation, $win, $draw, $lose, $rating, $rating_div) = split /,/, $m;
 
 		my $pmove;
@@ -1213,6 +2197,58 @@ sub book_info {
 	return $text;
 }
 
+# Asks the booklook server for the given position. We keep a single
+# booklook process around, so that we don't need to start it (and have it
+# open the book files) anew for every position; it also caches the results,
+# so we don't need to. Returns the output lines, or the empty list if the
+# position is not in the book.
+sub booklook_query {
+	my $fen = shift;
+
+	if (!defined($booklook_write)) {
+		# If it couldn't be started, go without book moves for a minute
+		# before trying again.
+		return () if (defined($booklook_failed_at) && time - $booklook_failed_at < 60);
+
+		my @cache_args = ('--cache', $remoteglotconf::book_cache_size);
+		push @cache_args, '--cache-file', $remoteglotconf::book_cache_file
+			if (defined($remoteglotconf::book_cache_file));
+		eval {
+			IPC::Open2::open2($booklook_read, $booklook_write, './booklook', @cache_args, '--server');
+		};
+		if ($@) {
+			warn "Could not start booklook: $@";
+			($booklook_read, $booklook_write) = (undef, undef);
+			$booklook_failed_at = time;
+			return ();
+		}
+	}
+
+	my $id = ++$booklook_request_id;
+	{
+		# If it has died, we'll see EOF below.
+		local $SIG{PIPE} = 'IGNORE';
+		print $booklook_write "$id $fen\n";
+	}
+
+	my @lines = ();
+	while (my $line = <$booklook_read>) {
+		chomp $line;
+		if ($line =~ /^end (\S+) (\S+)/ && $1 eq $id) {
+			return () if ($2 ne 'found');
+			return @lines;
+		}
+		push @lines, $line;
+	}
+
+	# EOF; booklook went away. Restart it on the next query.
+	warn "booklook server died";
+	close($booklook_read);
+	close($booklook_write);
+	($booklook_read, $booklook_write) = (undef, undef);
+	return ();
+}
+
 sub extract_clock {
 	my ($pgn, $pos) = @_;
 
@@ -1331,35 +2367,200 @@ sub find_clock_start {
 	$dbh->commit;
 }
 
+# Lookups in the remote tablebases. We don't only ask about the position
+# we're analyzing, but also about the first position with few enough pieces
+# along each PV, so that the answer is (hopefully) there by the time the
+# game gets there. Up to $remoteglotconf::tb_max_lookups requests run at
+# the same time, most urgent first; positions the server is still working
+# on are asked about again with exponential backoff, and if the server
+# fails to answer at all, all lookups back off. Finished results are kept
+# in $remoteglotconf::tb_cache_file, so that they survive restarts.
 sub schedule_tb_lookup {
 	return if (!defined($remoteglotconf::tb_serial_key));
 	my $pos = $pos_waiting // $pos_calculating;
-	return if (exists($tb_cache{$pos->fen()}));
+	return if (!defined($pos));
+
+	# What we'd like to know about, as key => [ position, priority ]
+	# (the number of moves until we get there).
+	my %wanted = ();
+	add_tb_candidate(\%wanted, $pos, 0);
+
+	my @pvs = ();
+	push @pvs, [ $pos_calculating, $engine->{'info'}{'pv'} ]
+		if (defined($engine) && defined($pos_calculating));
+	if (defined($engine2) && defined($pos_calculating_second_engine)) {
+		for my $mpv (1..$remoteglotconf::tb_prefetch_lines) {
+			last if (!exists(second_engine_info()->{'pv' . $mpv}));
+			push @pvs, [ $pos_calculating_second_engine, second_engine_info()->{'pv' . $mpv} ];
+		}
+	}
+	# Playing through the PVs is the expensive part, and most of the time,
+	# they haven't changed since last time, so remember what we found
+	# along each one (by the position and moves), and only walk the ones
+	# that are new.
+	my $old_walks = $current_game->{'tb_pv_walks'} // [];
+	my @walks = ();
+	for my $i (0..$#pvs) {
+		my ($pv_pos, $pv) = @{$pvs[$i]};
+		next if (!defined($pv));
+		my $walk_key = $pv_pos->fen() . ' ' . join(' ', @$pv);
+		if (defined($old_walks->[$i]) && $old_walks->[$i]{'key'} eq $walk_key) {
+			$walks[$i] = $old_walks->[$i];
+		} else {
+			$walks[$i] = { key => $walk_key, found => walk_pv_for_tb($pv_pos, $pv) };
+		}
+		add_tb_candidate(\%wanted, @{$walks[$i]{'found'}}) if (defined($walks[$i]{'found'}));
+	}
+	$current_game->{'tb_pv_walks'} = \@walks;
+
+	# Forget about lookups this game no longer cares about (other games
+	# may still want them). The ones that are running are left alone;
+	# we'll keep their answers if they are complete, and drop them otherwise.
+	my $game_id = $current_game->{'id'};
+	for my $key (keys %tb_lookups) {
+		my $lookup = $tb_lookups{$key};
+		delete $lookup->{'wanted_by'}{$game_id} if (!exists($wanted{$key}));
+		delete $tb_lookups{$key} if (!tb_lookup_wanted($lookup) && !$lookup->{'running'});
+	}
+	while (my ($key, $candidate) = each %wanted) {
+		my ($candidate_pos, $priority) = @$candidate;
+		if (exists($tb_lookups{$key})) {
+			$tb_lookups{$key}{'wanted_by'}{$game_id} = $priority;
+		} else {
+			$tb_lookups{$key} = {
+				pos => $candidate_pos,
+				wanted_by => { $game_id => $priority },  # game ID => priority
+				running => 0,
+				failed => 0,
+				delay => 0,      # how long we waited after the last QUEUED/PROCESSING
+				not_before => 0, # when to ask next
+			};
+		}
+	}
+
+	start_tb_lookups();
+}
+
+# Returns the first position along the PV with few enough pieces for the
+# tablebases, and the number of moves until we get there (or undef).
+sub walk_pv_for_tb {
+	my ($pv_pos, $pv) = @_;
+
+	# Every capture takes off one piece, so if the PV is too short
+	# to get down to seven, don't bother playing through it.
+	return undef if ($pv_pos->num_pieces() - scalar @$pv > 7);
+	my $found = undef;
+	eval {
+		for my $ply (0..$#$pv) {
+			$pv_pos = $pv_pos->make_move(parse_uci_move($pv->[$ply]));
+			if ($pv_pos->num_pieces() <= 7) {
+				$found = [ $pv_pos, $ply + 1 ];
+				last;
+			}
+		}
+	};
+	return $found;
+}
+
+sub add_tb_candidate {
+	my ($wanted, $pos, $priority) = @_;
 
 	# If there's more than seven pieces, there's not going to be an answer,
 	# so don't bother.
 	return if ($pos->num_pieces() > 7);
 
-	# Max one at a time. If it's still relevant when it returns,
-	# schedule_tb_lookup() will be called again.
-	return if ($tb_lookup_running);
+	my $key = tb_cache_key($pos);
+	return if (exists($tb_cache{$key}));
+	return if (exists($wanted->{$key}) && $wanted->{$key}[1] <= $priority);
+	$wanted->{$key} = [ $pos, $priority ];
+}
+
+sub tb_lookup_wanted {
+	my $lookup = shift;
+	return scalar keys %{$lookup->{'wanted_by'}} > 0;
+}
+
+# The most urgent of the games that want this lookup decides.
+sub tb_lookup_priority {
+	my $lookup = shift;
+	my ($priority) = sort { $a <=> $b } values %{$lookup->{'wanted_by'}};
+	return $priority;
+}
 
-	$tb_lookup_running = 1;
-	my $url = 'http://158.250.18.203:6904/tasks/addtask?auth.login=' .
+# The answer doesn't depend on the move counters, so leave them out.
+sub tb_cache_key {
+	my $pos = shift;
+	return join(' ', (split / /, $pos->fen())[0..3]);
+}
+
+sub start_tb_lookups {
+	# If the server is in trouble, leave it alone for a while.
+	return if (defined($tb_server_timer));
+
+	my $now = Time::HiRes::time();
+	my @idle = grep { !$tb_lookups{$_}{'running'} && !$tb_lookups{$_}{'failed'} } keys %tb_lookups;
+	my @ready = sort { tb_lookup_priority($tb_lookups{$a}) <=> tb_lookup_priority($tb_lookups{$b}) }
+		grep { $tb_lookups{$_}{'not_before'} <= $now } @idle;
+	while ($tb_lookups_running < $remoteglotconf::tb_max_lookups && scalar @ready > 0) {
+		start_tb_lookup(shift @ready);
+	}
+
+	# Come back when the next one is due.
+	my ($next) = sort { $a <=> $b } map { $tb_lookups{$_}{'not_before'} } grep { !$tb_lookups{$_}{'running'} } @idle;
+	if (defined($next) && $next > $now) {
+		$tb_retry_timer = AnyEvent->timer(after => $next - $now, cb => sub {
+			$tb_retry_timer = undef;
+			start_tb_lookups();
+		});
+	} else {
+		$tb_retry_timer = undef;
+	}
+}
+
+sub start_tb_lookup {
+	my $key = shift;
+	my $lookup = $tb_lookups{$key};
+	my $fen = $lookup->{'pos'}->fen();
+
+	$lookup->{'running'} = 1;
+	++$tb_lookups_running;
+
+	my $url = $remoteglotconf::tb_url . '?auth.login=' .
 		$remoteglotconf::tb_serial_key .
 		'&auth.password=aquarium&type=0&fen=' . 
-		URI::Escape::uri_escape($pos->fen());
+		URI::Escape::uri_escape($fen);
 	print TBLOG "Downloading $url...\n";
 	AnyEvent::HTTP::http_get($url, sub {
-		handle_tb_lookup_return(@_, $pos, $pos->fen());
+		handle_tb_lookup_return(@_, $key, $lookup);
 	});
 }
 
 sub handle_tb_lookup_return {
-	my ($body, $header, $pos, $fen) = @_;
+	my ($body, $header, $key, $lookup) = @_;
+	my $pos = $lookup->{'pos'};
+	my $fen = $pos->fen();
 	print TBLOG "Response for [$fen]:\n";
-	print TBLOG $header . "\n\n";
-	print TBLOG $body . "\n\n";
+	print TBLOG join("\n", map { "$_: $header->{$_}" } sort keys %$header) . "\n\n";
+	print TBLOG $body . "\n\n" if (defined($body));
+
+	$lookup->{'running'} = 0;
+	--$tb_lookups_running;
+
+	# If we didn't get an answer at all, the server is probably overloaded
+	# (or gone), so back off on all lookups.
+	if ($header->{'Status'} !~ /^2/) {
+		$tb_server_backoff = ($tb_server_backoff == 0) ? 1.0 : $tb_server_backoff * 2;
+		$tb_server_backoff = 60.0 if ($tb_server_backoff > 60.0);
+		print TBLOG "Tablebase server failed ($header->{'Status'} $header->{'Reason'}); waiting $tb_server_backoff seconds.\n";
+		$tb_server_timer = AnyEvent->timer(after => $tb_server_backoff, cb => sub {
+			$tb_server_timer = undef;
+			start_tb_lookups();
+		});
+		delete $tb_lookups{$key} if (!tb_lookup_wanted($lookup));
+		return;
+	}
+	$tb_server_backoff = 0;
+
 	eval {
 		my $response = JSON::XS::decode_json($body);
 		if ($response->{'ErrorCode'} != 0) {
@@ -1369,44 +2570,313 @@ sub handle_tb_lookup_return {
 		if ($state eq 'COMPLETE') {
 			my $pgn = Chess::PGN::Parse->new(undef, $response->{'Response'}{'Moves'});
 			if (!defined($pgn) || !$pgn->read_game()) {
-				warn "Error in parsing PGN\n";
-			} else {
-				$pgn->quick_parse_game;
-				my $pvpos = $pos;
-				my $moves = $pgn->moves;
-				my @uci_moves = ();
-				for my $move (@$moves) {
-					my $uci_move;
-					($pvpos, $uci_move) = $pvpos->make_pretty_move($move);
-					push @uci_moves, $uci_move;
-				}
-				$tb_cache{$fen} = {
-					result => $pgn->result,
-					pv => \@uci_moves,
-					score => $response->{'Response'}{'Score'},
-				};
-				output();
+				die "Error in parsing PGN\n";
 			}
+			$pgn->quick_parse_game;
+			my $pvpos = $pos;
+			my $moves = $pgn->moves;
+			my @uci_moves = ();
+			for my $move (@$moves) {
+				my $uci_move;
+				($pvpos, $uci_move) = $pvpos->make_pretty_move($move);
+				push @uci_moves, $uci_move;
+			}
+			$tb_cache{$key} = {
+				result => $pgn->result,
+				pv => \@uci_moves,
+				score => $response->{'Response'}{'Score'},
+				used => time,
+			};
+			delete $tb_lookups{$key};
+			save_tb_cache();
+
+			# Show it right away in every game that is at this position.
+			my $old_game = $current_game;
+			for my $game (@games) {
+				switch_to_game($game);
+				output() if (defined($pos_calculating) && tb_cache_key($pos_calculating) eq $key);
+			}
+			switch_to_game($old_game);
 		} elsif ($state =~ /QUEUED/ || $state =~ /PROCESSING/) {
-			# Try again in a second. Note that if we have changed
-			# position in the meantime, we might query a completely
-			# different position! But that's fine.
+			# Ask again later (if we still care), waiting a bit longer each time.
+			if (!tb_lookup_wanted($lookup)) {
+				delete $tb_lookups{$key};
+			} else {
+				$lookup->{'delay'} = ($lookup->{'delay'} == 0) ? 1.0 : $lookup->{'delay'} * 2;
+				$lookup->{'delay'} = 16.0 if ($lookup->{'delay'} > 16.0);
+				$lookup->{'not_before'} = Time::HiRes::time() + $lookup->{'delay'};
+			}
 		} else {
 			die "Unknown response state " . $state;
 		}
-
-		# Wait a second before we schedule another one.
-		$tb_retry_timer = AnyEvent->timer(after => 1.0, cb => sub {
-			$tb_lookup_running = 0;
-			schedule_tb_lookup();
-		});
 	};
 	if ($@) {
 		warn "Error in tablebase lookup: $@";
 
-		# Don't try this one again, but don't block new lookups either.
-		$tb_lookup_running = 0;
+		# Don't try this one again (as long as we want it), but don't
+		# block new lookups either.
+		$lookup->{'failed'} = 1;
 	}
+
+	start_tb_lookups();
+}
+
+sub load_tb_cache {
+	return if (!defined($remoteglotconf::tb_cache_file) || ! -e $remoteglotconf::tb_cache_file);
+	eval {
+		my $cache = JSON::XS::decode_json(File::Slurp::read_file($remoteglotconf::tb_cache_file));
+		%tb_cache = %$cache;
+	};
+	if ($@) {
+		warn "Could not read tablebase cache from $remoteglotconf::tb_cache_file: $@";
+	}
+}
+
+# Several lookups tend to finish close together, so we write the cache
+# a little while after the first of them. That is also when we throw out
+# the entries that haven't been used for the longest, if there are too many.
+sub save_tb_cache {
+	return if (defined($tb_save_timer));
+	$tb_save_timer = AnyEvent->timer(after => 10, cb => sub {
+		$tb_save_timer = undef;
+		my $excess = scalar(keys %tb_cache) - $remoteglotconf::tb_cache_size;
+		if ($excess > 0) {
+			my @oldest = sort { ($tb_cache{$a}{'used'} // 0) <=> ($tb_cache{$b}{'used'} // 0) } keys %tb_cache;
+			delete @tb_cache{@oldest[0..$excess-1]};
+		}
+		atomic_set_contents($remoteglotconf::tb_cache_file, JSON::XS->new->canonical(1)->encode(\%tb_cache))
+			if (defined($remoteglotconf::tb_cache_file));
+	});
+}
+
+# With several games (@remoteglotconf::games), everything that has to do
+# with one game (the position, the engine(s) analyzing it, the timers and
+# so on) is kept in the same globals as with just one, and swapped in and
+# out of them as we go from game to game. Thus, everything that can be
+# called for a given game, ie. engine output, PGN fetches and timers,
+# needs to call switch_to_game() first; in_this_game() wraps a callback
+# so that it does that.
+sub in_this_game {
+	my $cb = shift;
+	my $game = $current_game;
+	return sub {
+		switch_to_game($game);
+		$cb->(@_);
+	};
+}
+
+sub switch_to_game {
+	my $game = shift;
+	return if (!defined($game) || (defined($current_game) && $game == $current_game));
+
+	if (defined($current_game)) {
+		$current_game->{'state'} = {
+			latest_update => $latest_update,
+			output_timer => $output_timer,
+			http_timer => $http_timer,
+			stop_pgn_fetch => $stop_pgn_fetch,
+			last_written_json => $last_written_json,
+			last_move => $last_move,
+			last_text => $last_text,
+			pos_waiting => $pos_waiting,
+			pos_calculating => $pos_calculating,
+			pos_calculating_second_engine => $pos_calculating_second_engine,
+			pos_speculating => $pos_speculating,
+			speculation_started => $speculation_started,
+			last_pgn_white => $last_pgn_white,
+			last_pgn_black => $last_pgn_black,
+			last_pgn_uci_moves => [ @last_pgn_uci_moves ],
+			pgn_hysteresis_counter => $pgn_hysteresis_counter,
+			pgn_replay => { %pgn_replay },
+			score_history => { %score_history },
+		};
+	}
+
+	my $state = $game->{'state'} // {};
+	$latest_update = $state->{'latest_update'};
+	$output_timer = $state->{'output_timer'};
+	$http_timer = $state->{'http_timer'};
+	$stop_pgn_fetch = $state->{'stop_pgn_fetch'} // 0;
+	$last_written_json = $state->{'last_written_json'};
+	$last_move = $state->{'last_move'};
+	$last_text = $state->{'last_text'} // '';
+	$pos_waiting = $state->{'pos_waiting'};
+	$pos_calculating = $state->{'pos_calculating'};
+	$pos_calculating_second_engine = $state->{'pos_calculating_second_engine'};
+	$pos_speculating = $state->{'pos_speculating'};
+	$speculation_started = $state->{'speculation_started'};
+	$last_pgn_white = $state->{'last_pgn_white'};
+	$last_pgn_black = $state->{'last_pgn_black'};
+	@last_pgn_uci_moves = @{$state->{'last_pgn_uci_moves'} // []};
+	$pgn_hysteresis_counter = $state->{'pgn_hysteresis_counter'} // 0;
+	%pgn_replay = %{$state->{'pgn_replay'} // {}};
+	%score_history = %{$state->{'score_history'} // {}};
+	delete $game->{'state'};
+
+	$engine = $game->{'engine'};
+	$engine2 = $game->{'engine2'};
+	$current_game = $game;
+}
+
+# How much a game needs analysis right now: 2 if a move has been played
+# recently, 1 if it's been quiet for a while, 0 if it's over.
+sub game_urgency {
+	my $game = shift;
+	return 0 if ($game->{'finished'});
+	return 1 if (!defined($game->{'last_move_time'}) ||
+	             time - $game->{'last_move_time'} > $remoteglotconf::game_active_time);
+	return 2;
+}
+
+# Gives out the engines in the pool to the games. A game that has a position
+# but no engine takes a free one if there is any, or else one from a game
+# that needs it less; a game with a new move thus gets analysis right away,
+# and if there are more quiet games than engines, they take turns, one
+# $remoteglotconf::engine_pool_slice at a time. Finally, the threads are
+# shared out between the engines by priority and urgency.
+sub schedule_games {
+	return if (scalar @engine_pool == 0);
+	my $old_game = $current_game;
+	my $now = time;
+
+	my @waiting = sort {
+		game_urgency($b) <=> game_urgency($a) ||
+		$b->{'priority'} <=> $a->{'priority'} ||
+		($a->{'idle_since'} // 0) <=> ($b->{'idle_since'} // 0)
+	} grep { !defined($_->{'engine'}) && game_has_position($_) } @games;
+
+	for my $game (@waiting) {
+		my ($free) = grep { !defined($_->{'game'}) } @engine_pool;
+		my $taken = 0;
+		if (!defined($free)) {
+			# Take the engine from the game that needs it the least,
+			# unless that game needs it as much as we do and hasn't
+			# had it for a full slice yet.
+			my $urgency = game_urgency($game);
+			my @victims = sort {
+				game_urgency($a->{'game'}) <=> game_urgency($b->{'game'}) ||
+				$a->{'game'}{'priority'} <=> $b->{'game'}{'priority'} ||
+				$a->{'assigned_at'} <=> $b->{'assigned_at'}
+			} grep {
+				my $u = game_urgency($_->{'game'});
+				$u < $urgency ||
+					($u == $urgency && $now - $_->{'assigned_at'} >= $remoteglotconf::engine_pool_slice)
+			} @engine_pool;
+			last if (scalar @victims == 0);
+			$free = $victims[0];
+
+			my $victim = $free->{'game'};
+			switch_to_game($victim);
+			$victim->{'engine'} = undef;
+			$victim->{'idle_since'} = $now;
+			$engine = undef;
+			$taken = 1;
+		}
+
+		switch_to_game($game);
+		$free->{'game'} = $game;
+		$free->{'assigned_at'} = $now;
+		$game->{'engine'} = $engine = $free;
+		clear_infos($engine);
+
+		$pos_calculating = $pos_waiting // $pos_calculating;
+		$pos_waiting = undef;
+		if ($taken) {
+			# Stop the other game's search, and wait for it to end before
+			# starting on ours (see handle_uci()), so that none of its
+			# output is taken to be about this game. If the engine was
+			# already on its way from another game, that stop is enough.
+			uciprint($engine, "stop") if (!$engine->{'discard_until_bestmove'});
+			$engine->{'discard_until_bestmove'} = 1;
+		} else {
+			set_engine_resources($engine, $game, 1);
+			uciprint($engine, "position fen " . $pos_calculating->fen());
+			uciprint($engine, "go infinite");
+		}
+	}
+
+	for my $e (@engine_pool) {
+		next if (!defined($e->{'game'}));
+		switch_to_game($e->{'game'});
+		set_engine_resources($e, $e->{'game'});
+	}
+
+	switch_to_game($old_game);
+}
+
+sub game_has_position {
+	my $game = shift;
+	return defined($pos_waiting // $pos_calculating) if ($game == $current_game);
+	my $state = $game->{'state'} // {};
+	return defined($state->{'pos_waiting'} // $state->{'pos_calculating'});
+}
+
+# Splits $remoteglotconf::engine_pool_threads between the engines in
+# proportion to how much their games matter. Changing the number of threads
+# means restarting the search, so unless the engine is about to start on
+# a new game anyway (<force>), we leave it alone until its share has grown
+# or shrunk by half; thus, we may use a few threads too many for a while.
+sub set_engine_resources {
+	my ($e, $game, $force) = @_;
+
+	# Waiting for the engine to stop; this is done when it starts again.
+	return if ($e->{'discard_until_bestmove'});
+
+	my $total_weight = 0;
+	for my $other (@engine_pool) {
+		$total_weight += game_weight($other->{'game'}) if (defined($other->{'game'}));
+	}
+	$total_weight = game_weight($game) if ($total_weight == 0);
+	my $weight = game_weight($game);
+
+	my $threads = int($remoteglotconf::engine_pool_threads * $weight / $total_weight);
+	$threads = 1 if ($threads < 1);
+
+	if (defined($e->{'threads'})) {
+		return if ($threads == $e->{'threads'});
+		return if (!$force && $threads < $e->{'threads'} * 1.5 && $threads * 1.5 > $e->{'threads'});
+	}
+	my $searching = (!$force && $e == ($engine // 0) && defined($pos_calculating));
+	uciprint($e, "stop") if ($searching);
+	uciprint($e, "setoption name Threads value $threads");
+	$e->{'threads'} = $threads;
+	if ($searching) {
+		uciprint($e, "position fen " . $pos_calculating->fen());
+		uciprint($e, "go infinite");
+	}
+}
+
+sub game_weight {
+	my $game = shift;
+	return (1 + $game->{'priority'}) * (1 + game_urgency($game));
+}
+
+# Picks up changes to the games' priorities from the database
+# (the same ones that decide the order in the game list).
+sub update_game_priorities {
+	my $q = $dbh->prepare('SELECT id, priority FROM current_games');
+	$q->execute;
+	while (my $ref = $q->fetchrow_hashref) {
+		for my $game (@games) {
+			$game->{'priority'} = $ref->{'priority'} if ($game->{'id'} eq $ref->{'id'});
+		}
+	}
+}
+
+sub engine_pool_status {
+	return '' if (scalar @engine_pool == 0);
+	my $text = '';
+	for my $e (@engine_pool) {
+		if (defined($e->{'game'})) {
+			$text .= sprintf "%s: %s (%u threads, %u MB hash)\n",
+				$e->{'tag'}, $e->{'game'}{'id'}, $e->{'threads'} // 0, $e->{'hash'} // 0;
+		} else {
+			$text .= sprintf "%s: idle\n", $e->{'tag'};
+		}
+	}
+	my $waiting = scalar grep { !defined($_->{'engine'}) } @games;
+	$text .= "$waiting game(s) waiting for an engine\n" if ($waiting > 0);
+	return $text;
 }
 
 sub open_engine {
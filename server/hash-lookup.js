@@ -8,47 +8,264 @@ var board = new Chess();
 
 var clients = [];
 
+// Answers we've given lately, keyed by normalized FEN (see cache_key()).
+// They are good until the analysis moves on to a new position or gets
+// deeper (the backends have probably learned something new by then),
+// and never for more than MAX_CACHE_AGE_MS. Map keeps insertion order,
+// so the first entry is always the oldest.
+var CACHE_SIZE = 10000;
+var MAX_CACHE_AGE_MS = 30000;
+var cache = new Map();
+var cache_generation = 0;
+var analysis_fen = null;
+var analysis_depth = null;
+
+// Probes in flight, keyed the same way, with the responses waiting for them.
+var in_flight = {};
+
+// How far along the line the user is looking at to prefetch.
+var MAX_PREFETCH_PLIES = 40;
+
+var stats = {
+	requests: 0,
+	hits: 0,
+	coalesced: 0,
+	prefetched: 0,
+	probes: 0,
+	positions: 0,
+	rpcs: 0,
+	failures: 0,
+};
+var STATS_INTERVAL_MS = 60000;
+
 var init = function(servers) {
 	for (var i = 0; i < servers.length; ++i) {
 		clients.push(new hashprobe_proto.HashProbe(servers[i], grpc.credentials.createInsecure()));
 	}
+	setInterval(log_stats, STATS_INTERVAL_MS);
 }
 exports.init = init;
 
-var handle_request = function(fen, response) {
+// Called by serve-analysis.js whenever there's a new version of the analysis.
+var set_analysis = function(fen, depth) {
+	if (fen !== analysis_fen || (depth !== null && depth > analysis_depth)) {
+		++cache_generation;
+	}
+	analysis_fen = fen;
+	analysis_depth = depth;
+}
+exports.set_analysis = set_analysis;
+
+// The move counters don't matter to the hash, so leave them out.
+var cache_key = function(fen) {
+	return fen.split(' ').slice(0, 4).join(' ');
+}
+
+// If <line_pv> is given (the line the user is looking at, as a
+// comma-separated list of moves from <line_start>), all the positions
+// along it are probed too, in a separate batch, so that they're already
+// cached by the time the user steps through the line. <fen> is probed
+// on its own, so that the answer doesn't have to wait for the batch.
+var handle_request = function(fen, response, line_start, line_pv) {
 	if (fen === undefined || fen === null || fen === '' || !board.validate_fen(fen).valid) {
 		response.writeHead(400, {});
 		response.end();
 		return;
 	}
+	++stats.requests;
 
+	var key = cache_key(fen);
+	var text = get_cached(key);
+	if (text !== null) {
+		++stats.hits;
+		send_response(response, text);
+	} else if (in_flight[key] !== undefined) {
+		// Somebody else is already asking for this position; wait for theirs.
+		++stats.coalesced;
+		in_flight[key].push(response);
+	} else {
+		in_flight[key] = [ response ];
+		probe([ fen ]);
+	}
+
+	// Backends without ProbeBatch would need one call per position, and
+	// asking only the others would give worse answers than the user
+	// gets by asking directly, so don't prefetch while there are any.
+	if (clients.some(function(client) { return client.no_batch; })) {
+		return;
+	}
+	var to_prefetch = [];
+	var line_fens = fens_along_line(line_start, line_pv);
+	for (var i = 0; i < line_fens.length; ++i) {
+		var line_key = cache_key(line_fens[i]);
+		if (in_flight[line_key] === undefined && get_cached(line_key) === null) {
+			in_flight[line_key] = [];
+			to_prefetch.push(line_fens[i]);
+			++stats.prefetched;
+		}
+	}
+	if (to_prefetch.length > 0) {
+		probe(to_prefetch);
+	}
+}
+exports.handle_request = handle_request;
+
+var get_cached = function(key) {
+	var entry = cache.get(key);
+	if (entry === undefined) {
+		return null;
+	}
+	if (entry.generation !== cache_generation ||
+	    Date.now() - entry.time >= MAX_CACHE_AGE_MS) {
+		cache.delete(key);
+		return null;
+	}
+	return entry.text;
+}
+
+// No <line_start> means the start position.
+var fens_along_line = function(line_start, line_pv) {
+	if (!line_pv || (line_start && !board.validate_fen(line_start).valid)) {
+		return [];
+	}
+	var fens = [];
+	var moves = line_pv.split(',').slice(0, MAX_PREFETCH_PLIES);
+	if (line_start) {
+		board.load(line_start);
+	} else {
+		board.reset();
+	}
+	for (var i = 0; i < moves.length; ++i) {
+		var move = moves[i].replace(/^0-0-0$/, 'O-O-O').replace(/^0-0$/, 'O-O');
+		if (board.move(move) === null) {
+			break;
+		}
+		fens.push(board.fen());
+	}
+	return fens;
+}
+
+// Asks all the backends about the given positions (which must be in
+// in_flight already), and answers everybody waiting for them.
+var probe = function(fens) {
+	++stats.probes;
+	stats.positions += fens.length;
+
+	var generation = cache_generation;
 	var rpc_status = {
 		failed: false,
 		left: clients.length,
-		responses: [],
+		responses: fens.map(function() { return []; }),
 	}
 	for (var i = 0; i < clients.length; ++i) {
-		clients[i].probe({fen: fen}, function(err, probe_response) {
+		probe_backend(clients[i], fens, function(err, probe_responses) {
 			if (err) {
 				rpc_status.failed = true;
 			} else {
-				rpc_status.responses.push(probe_response);
+				for (var j = 0; j < fens.length; ++j) {
+					rpc_status.responses[j].push(probe_responses[j]);
+				}
+			}
+			if (--rpc_status.left > 0) {
+				return;
+			}
+
+			// All probes have come back.
+			if (rpc_status.failed) {
+				++stats.failures;
 			}
-			if (--rpc_status.left == 0) {
-				// All probes have come back.
+			for (var j = 0; j < fens.length; ++j) {
+				var key = cache_key(fens[j]);
+				var waiting = in_flight[key];
+				delete in_flight[key];
 				if (rpc_status.failed) {
-					response.writeHead(500, {});
-					response.end();
-				} else {
-					handle_response(fen, response, rpc_status.responses);
+					for (var k = 0; k < waiting.length; ++k) {
+						waiting[k].writeHead(500, {});
+						waiting[k].end();
+					}
+					continue;
+				}
+
+				var text = format_response(fens[j], rpc_status.responses[j]);
+				for (var k = 0; k < waiting.length; ++k) {
+					send_response(waiting[k], text);
+				}
+
+				// Don't keep it if the analysis moved on while we were asking.
+				if (generation === cache_generation) {
+					cache.set(key, { text: text, generation: generation, time: Date.now() });
+					if (cache.size > CACHE_SIZE) {
+						cache.delete(cache.keys().next().value);
+					}
 				}
 			}
 		});
 	}
 }
-exports.handle_request = handle_request;
 
-var handle_response = function(fen, response, probe_responses) {
+// Probes the positions on one backend, in a single ProbeBatch call
+// if there's more than one and it supports that, or else one by one.
+var probe_backend = function(client, fens, cb) {
+	if (fens.length > 1 && !client.no_batch) {
+		++stats.rpcs;
+		var requests = fens.map(function(fen) { return { fen: fen }; });
+		client.probeBatch({ request: requests }, function(err, batch_response) {
+			if (err && err.code === grpc.status.UNIMPLEMENTED) {
+				console.log("Hash probe backend doesn't support ProbeBatch; probing one by one");
+				client.no_batch = true;
+				probe_backend(client, fens, cb);
+			} else if (err) {
+				cb(err);
+			} else {
+				cb(null, batch_response['response']);
+			}
+		});
+		return;
+	}
+
+	var probe_responses = [];
+	var left = fens.length;
+	var failed = null;
+	fens.forEach(function(fen, j) {
+		++stats.rpcs;
+		client.probe({ fen: fen }, function(err, probe_response) {
+			if (err) {
+				failed = err;
+			} else {
+				probe_responses[j] = probe_response;
+			}
+			if (--left == 0) {
+				cb(failed, probe_responses);
+			}
+		});
+	});
+}
+
+var send_response = function(response, text) {
+	var headers = {
+		'Content-Type': 'text/json; charset=utf-8',
+		'Content-Length': Buffer.byteLength(text)
+	};
+	response.writeHead(200, headers);
+	response.write(text);
+	response.end();
+}
+
+var log_stats = function() {
+	if (stats.requests == 0) {
+		return;
+	}
+	console.log("Hash probes: " + stats.requests + " requests, " +
+		(100.0 * stats.hits / stats.requests).toFixed(1) + "% cache hits, " +
+		stats.coalesced + " coalesced, " + stats.prefetched + " prefetched, " +
+		stats.probes + " probes of " + stats.positions + " positions (" + stats.rpcs + " RPCs, " +
+		stats.failures + " failed), " + cache.size + " cached");
+	for (var key in stats) {
+		stats[key] = 0;
+	}
+}
+
+var format_response = function(fen, probe_responses) {
 	var probe_response = reconcile_responses(probe_responses);
 	var lines = {};
 
@@ -59,17 +276,10 @@ var handle_response = function(fen, response, probe_responses) {
 		lines[uci_move] = translate_line(board, fen, line);
 	}
 
-	var text = JSON.stringify({
+	return JSON.stringify({
 		root: root,
 		lines: lines
 	});
-	var headers = {
-		'Content-Type': 'text/json; charset=utf-8'
-		//'Content-Length': text.length
-	};
-	response.writeHead(200, headers);
-	response.write(text);
-	response.end();
 }
 
 var reconcile_responses = function(probe_responses) {
@@ -0,0 +1,67 @@
+// Worker thread for serve-analysis.js: parses new versions of the JSON,
+// diffs them against the old ones and compresses the results, so that
+// the main thread can go on serving clients in the meantime.
+
+var worker_threads = require('worker_threads');
+var zlib = require('zlib');
+var delta = require('../www/js/json_delta.js');
+
+// Compression levels. The full JSON is sent rarely (to new clients),
+// but prepared on every update, so it gets a moderate level; the diffs
+// are small, so we can afford to squeeze them as hard as we can.
+var FULL_GZIP_LEVEL = 6;
+var FULL_BROTLI_QUALITY = 6;
+var DIFF_GZIP_LEVEL = 9;
+var DIFF_BROTLI_QUALITY = 11;
+
+// Parsed versions we've seen lately, by last_modified, so that we don't
+// need to parse the same base over again for every update.
+var PARSED_TO_KEEP = 16;
+var parsed_cache = new Map();
+
+var get_parsed = function(version, plain) {
+	if (parsed_cache.has(version)) {
+		return parsed_cache.get(version);
+	}
+	var parsed = JSON.parse(plain);
+	parsed_cache.set(version, parsed);
+	if (parsed_cache.size > PARSED_TO_KEEP) {
+		parsed_cache.delete(parsed_cache.keys().next().value);
+	}
+	return parsed;
+}
+
+var compress = function(plain, gzip_level, brotli_quality) {
+	var params = {};
+	params[zlib.constants.BROTLI_PARAM_QUALITY] = brotli_quality;
+	params[zlib.constants.BROTLI_PARAM_SIZE_HINT] = Buffer.byteLength(plain);
+	return {
+		plain: plain,
+		gzip: zlib.gzipSync(plain, { level: gzip_level }),
+		brotli: zlib.brotliCompressSync(plain, { params: params }),
+	};
+}
+
+// Tasks are either { type: 'full', version, plain }, or
+// { type: 'diff', base_version, base_plain, version, plain }.
+worker_threads.parentPort.on('message', function(task) {
+	try {
+		var result;
+		if (task.type === 'full') {
+			var parsed = get_parsed(task.version, task.plain);
+			result = compress(task.plain, FULL_GZIP_LEVEL, FULL_BROTLI_QUALITY);
+
+			// For the hash probe cache (see hash-lookup.js).
+			result.fen = (parsed['position'] && parsed['position']['fen']) || null;
+			result.depth = parsed['depth'] || null;
+		} else {
+			var base = get_parsed(task.base_version, task.base_plain);
+			var parsed = get_parsed(task.version, task.plain);
+			var diff_text = JSON.stringify(delta.JSON_delta.diff(base, parsed));
+			result = compress(diff_text, DIFF_GZIP_LEVEL, DIFF_BROTLI_QUALITY);
+		}
+		worker_threads.parentPort.postMessage({ id: task.id, result: result });
+	} catch (err) {
+		worker_threads.parentPort.postMessage({ id: task.id, error: err.toString() });
+	}
+});
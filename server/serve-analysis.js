@@ -4,19 +4,21 @@
 // Modules.
 var http = require('http');
 var fs = require('fs');
+var net = require('net');
+var os = require('os');
 var url = require('url');
 var querystring = require('querystring');
 var path = require('path');
-var zlib = require('zlib');
 var readline = require('readline');
 var child_process = require('child_process');
-var delta = require('../www/js/json_delta.js');
+var worker_threads = require('worker_threads');
 var hash_lookup = require('./hash-lookup.js');
 
 // Constants.
 var HISTORY_TO_KEEP = 5;
 var MINIMUM_VERSION = null;
 var COUNT_FROM_VARNISH_LOG = true;
+var NUM_JSON_WORKERS = Math.max(1, Math.min(4, os.cpus().length - 1));
 
 // Filename to serve.
 var json_filename = '/srv/analysis.sesse.net/www/analysis.json';
@@ -47,9 +49,19 @@ if (process.argv.length >= 7) {
 }
 hash_lookup.init(grpc_backends);
 
-// If set to 1, we are already processing a JSON update and should not
-// start a new one. If set to 2, we are _also_ having one in the queue.
-var json_lock = 0;
+// Unix socket remoteglot.pl can push new versions over, instead of going
+// through the file. Once it has, we stop looking at the file.
+var push_socket = undefined;
+if (process.argv.length >= 8) {
+	push_socket = process.argv[7];
+}
+var have_pushed_json = false;
+
+// Whether we are already processing a JSON update; if so, the newest
+// update that came in meanwhile (any older ones are simply skipped).
+var json_updating = false;
+var json_pending = undefined;
+var latest_mtime = undefined;
 
 // The current contents of the file to hand out, and its last modified time.
 var json = undefined;
@@ -64,12 +76,17 @@ var diff_json = {};
 var sleeping_clients = {};
 var request_id = 0;
 
+// The list of clients that have a stream open (?stream=1), keyed by
+// request_id. Every new version is pushed to them as a server-sent event,
+// instead of them having to come back for it.
+var streaming_clients = {};
+
 // List of when clients were last seen, keyed by their unique ID.
 // Used to show a viewer count to the user.
 var last_seen_clients = {};
 
-// The timer used to touch the file every 30 seconds if nobody
-// else does it for us. This makes sure we don't have clients
+// The timer used to republish the JSON every 30 seconds if nobody
+// else gives us a new one. This makes sure we don't have clients
 // hanging indefinitely (which might have them return errors).
 var touch_timer = undefined;
 
@@ -77,8 +94,56 @@ var touch_timer = undefined;
 // ourselves, so we need to get it from parsing varnishncsa.
 var viewer_count_override = undefined;
 
+// The parsing, diffing and compression is done by a pool of worker threads
+// (see json-worker.js), so that clients don't have to wait for it.
+var json_workers_idle = [];
+var json_task_queue = [];
+var json_task_id = 0;
+
+// How long it took to prepare the updates, from we got them until they
+// were ready to send out, in milliseconds.
+var prepare_stats = { count: 0, total: 0, max: 0 };
+
+var start_json_workers = function() {
+	for (var i = 0; i < NUM_JSON_WORKERS; ++i) {
+		var worker = new worker_threads.Worker(__dirname + '/json-worker.js');
+		worker.on('message', function(msg) {
+			var job = this.job;
+			this.job = undefined;
+			json_workers_idle.push(this);
+			run_json_tasks();
+			job.cb(msg.error, msg.result);
+		});
+		worker.on('error', function(err) { throw err; });
+		json_workers_idle.push(worker);
+	}
+}
+
+var run_json_task = function(task, cb) {
+	task.id = json_task_id++;
+	json_task_queue.push({ task: task, cb: cb });
+	run_json_tasks();
+}
+
+var run_json_tasks = function() {
+	while (json_workers_idle.length > 0 && json_task_queue.length > 0) {
+		var worker = json_workers_idle.pop();
+		worker.job = json_task_queue.shift();
+		worker.postMessage(worker.job.task);
+	}
+}
+
+// The compressed bodies come back as plain Uint8Arrays.
+var to_buffer = function(arr) {
+	return Buffer.from(arr.buffer, arr.byteOffset, arr.length);
+}
+
 var replace_json = function(new_json_contents, mtime) {
-	// Generate the list of diffs from the last five versions.
+	var start = Date.now();
+
+	// The versions we'll have diffs from once this one is in place,
+	// ie., the last five.
+	var new_historic_json = historic_json.slice(0);
 	if (json !== undefined) {
 		// If two versions have the same mtime, clients could have either.
 		// Note the fact, so that we never insert it.
@@ -86,94 +151,164 @@ var replace_json = function(new_json_contents, mtime) {
 			json.invalid_base = true;
 		}
 		if (!json.invalid_base) {
-			historic_json.push(json);
-			if (historic_json.length > HISTORY_TO_KEEP) {
-				historic_json.shift();
+			new_historic_json.push(json);
+			if (new_historic_json.length > HISTORY_TO_KEEP) {
+				new_historic_json.shift();
 			}
 		}
 	}
 
 	var new_json = {
-		parsed: JSON.parse(new_json_contents),
 		plain: new_json_contents,
 		last_modified: mtime
 	};
-	create_json_historic_diff(new_json, historic_json.slice(0), {}, function(new_diff_json) {
-		// gzip the new version (non-delta), and put it into place.
-		zlib.gzip(new_json_contents, function(err, buffer) {
-			if (err) throw err;
+	var new_diff_json = {};
+	var tasks_left = new_historic_json.length + 1;
+	var failed = false;
+	var task_done = function() {
+		if (--tasks_left > 0) {
+			return;
+		}
+		if (failed) {
+			finish_json_update();
+			return;
+		}
 
-			new_json.gzip = buffer;
-			json = new_json;
-			diff_json = new_diff_json;
-			json_lock = 0;
+		// Everything is ready, so put it into place all at once.
+		historic_json = new_historic_json;
+		json = new_json;
+		diff_json = new_diff_json;
+		hash_lookup.set_analysis(new_json.fen, new_json.depth);
+
+		var elapsed = Date.now() - start;
+		++prepare_stats.count;
+		prepare_stats.total += elapsed;
+		prepare_stats.max = Math.max(prepare_stats.max, elapsed);
+		log("Prepared version " + mtime + " with " + new_historic_json.length + " diffs in " + elapsed +
+		    " ms (average " + (prepare_stats.total / prepare_stats.count).toFixed(1) +
+		    " ms, max " + prepare_stats.max + " ms)");
+
+		// Finally, wake up any sleeping clients.
+		possibly_wakeup_clients();
+		finish_json_update();
+	};
 
-			// Finally, wake up any sleeping clients.
-			possibly_wakeup_clients();
+	run_json_task({ type: 'full', version: mtime, plain: new_json_contents }, function(err, result) {
+		if (err) {
+			console.log("Ignoring unparseable JSON: " + err);
+			failed = true;
+		} else {
+			new_json.gzip = to_buffer(result.gzip);
+			new_json.brotli = to_buffer(result.brotli);
+			new_json.fen = result.fen;
+			new_json.depth = result.depth;
+		}
+		task_done();
+	});
+	new_historic_json.forEach(function(histobj) {
+		run_json_task({
+			type: 'diff',
+			base_version: histobj.last_modified,
+			base_plain: histobj.plain,
+			version: mtime,
+			plain: new_json_contents
+		}, function(err, result) {
+			if (err) {
+				failed = true;
+			} else {
+				new_diff_json[histobj.last_modified] = {
+					plain: result.plain,
+					gzip: to_buffer(result.gzip),
+					brotli: to_buffer(result.brotli),
+					last_modified: mtime,
+				};
+			}
+			task_done();
 		});
 	});
 }
 
-var create_json_historic_diff = function(new_json, history_left, new_diff_json, cb) {
-	if (history_left.length == 0) {
-		cb(new_diff_json);
+var publish_json = function(new_json_contents, mtime) {
+	if (latest_mtime !== undefined && mtime < latest_mtime) {
 		return;
 	}
+	latest_mtime = mtime;
+	if (json_updating) {
+		json_pending = { contents: new_json_contents, mtime: mtime };
+		return;
+	}
+	json_updating = true;
+	replace_json(new_json_contents, mtime);
 
-	var histobj = history_left.shift();
-	var diff = delta.JSON_delta.diff(histobj.parsed, new_json.parsed);
-	var diff_text = JSON.stringify(diff);
-	zlib.gzip(diff_text, function(err, buffer) {
-		if (err) throw err;
-		new_diff_json[histobj.last_modified] = {
-			parsed: diff,
-			plain: diff_text,
-			gzip: buffer,
-			last_modified: new_json.last_modified,
-		};
-		create_json_historic_diff(new_json, history_left, new_diff_json, cb);
-	});
+	if (touch_timer !== undefined) {
+		clearTimeout(touch_timer);
+	}
+	touch_timer = setTimeout(function() {
+		// (the first version may still be with the workers)
+		if (json !== undefined) {
+			console.log("Republishing " + json_filename + " due to no other activity");
+			publish_json(json.plain, Date.now());
+		}
+	}, 30000);
+}
+
+var finish_json_update = function() {
+	json_updating = false;
+	if (json_pending !== undefined) {
+		var pending = json_pending;
+		json_pending = undefined;
+		publish_json(pending.contents, pending.mtime);
+	}
 }
 
 var reread_file = function(event, filename) {
 	if (filename != path.basename(json_filename)) {
 		return;
 	}
-	if (json_lock >= 2) {
-		return;
-	}
-	if (json_lock == 1) {
-		// Already processing; wait a bit.
-		json_lock = 2;
-		setTimeout(function() { if (json_lock == 2) json_lock = 1; reread_file(event, filename); }, 100);
+	if (have_pushed_json) {
+		// It's only a snapshot of what we already have.
 		return;
 	}
-	json_lock = 1;
 
 	console.log("Rereading " + json_filename);
 	fs.open(json_filename, 'r', function(err, fd) {
+		if (err && err.code === 'ENOENT' && push_socket !== undefined) {
+			// We'll get it over the socket instead.
+			return;
+		}
 		if (err) throw err;
 		fs.fstat(fd, function(err, st) {
 			if (err) throw err;
-			var buffer = new Buffer(1048576);
-			fs.read(fd, buffer, 0, 1048576, 0, function(err, bytesRead, buffer) {
+			fs.readFile(fd, 'utf8', function(err, new_json_contents) {
 				if (err) throw err;
 				fs.close(fd, function() {
-					var new_json_contents = buffer.toString('utf8', 0, bytesRead);
-					replace_json(new_json_contents, st.mtime.getTime());
+					publish_json(new_json_contents, st.mtime.getTime());
 				});
 			});
 		});
 	});
+}
 
-	if (touch_timer !== undefined) {
-		clearTimeout(touch_timer);
-	}
-	touch_timer = setTimeout(function() {
-		console.log("Touching analysis.json due to no other activity");
-		var now = Date.now() / 1000;
-		fs.utimes(json_filename, now, now);
-	}, 30000);
+// Each line is "<version> <json>"; the version takes the place of the mtime.
+var handle_push_connection = function(conn) {
+	console.log("remoteglot connected on " + push_socket);
+	var rl = readline.createInterface({
+		input: conn,
+		terminal: false
+	});
+	rl.on('line', function(line) {
+		var space = line.indexOf(' ');
+		var version = parseInt(line.substr(0, space));
+		if (space == -1 || isNaN(version)) {
+			console.log("Ignoring malformed line from " + push_socket);
+			return;
+		}
+		have_pushed_json = true;
+		publish_json(line.substr(space + 1), version);
+	});
+	conn.on('error', function(err) {
+		console.log("Error on " + push_socket + ": " + err);
+	});
 }
 var possibly_wakeup_clients = function() {
 	var num_viewers = count_viewers();
@@ -181,10 +316,17 @@ var possibly_wakeup_clients = function() {
 		mark_recently_seen(sleeping_clients[i].unique);
 		send_json(sleeping_clients[i].response,
 		          sleeping_clients[i].ims,
-		          sleeping_clients[i].accept_gzip,
+		          sleeping_clients[i].encoding,
 			  num_viewers);
 	}
 	sleeping_clients = {};
+
+	// Nearly all the streaming clients had the previous version,
+	// so they all get the very same frame.
+	var frames = {};
+	for (var i in streaming_clients) {
+		send_stream_update(streaming_clients[i], frames, num_viewers);
+	}
 }
 var send_404 = function(response) {
 	response.writeHead(404, {
@@ -193,7 +335,7 @@ var send_404 = function(response) {
 	response.write('Something went wrong. Sorry.');
 	response.end();
 }
-var send_json = function(response, ims, accept_gzip, num_viewers) {
+var send_json = function(response, ims, encoding, num_viewers) {
 	var this_json = diff_json[ims] || json;
 
 	var headers = {
@@ -208,18 +350,88 @@ var send_json = function(response, ims, accept_gzip, num_viewers) {
 		headers['X-RGMV'] = MINIMUM_VERSION;
 	}
 
-	if (accept_gzip) {
+	if (encoding === 'br') {
+		headers['Content-Length'] = this_json.brotli.length;
+		headers['Content-Encoding'] = 'br';
+		response.writeHead(200, headers);
+		response.write(this_json.brotli);
+	} else if (encoding === 'gzip') {
 		headers['Content-Length'] = this_json.gzip.length;
 		headers['Content-Encoding'] = 'gzip';
 		response.writeHead(200, headers);
 		response.write(this_json.gzip);
 	} else {
-		headers['Content-Length'] = this_json.plain.length;
+		headers['Content-Length'] = Buffer.byteLength(this_json.plain);
 		response.writeHead(200, headers);
 		response.write(this_json.plain);
 	}
 	response.end();
 }
+// Sends the client what it needs to get to the latest version, unless it
+// has that already, or hasn't yet taken what we sent last time (in which
+// case it gets to catch up once it has). Frames are shared between
+// clients through <frames>, keyed by the version they start from.
+var send_stream_update = function(client, frames, num_viewers) {
+	if (client.congested || client.ims == json.last_modified) {
+		return;
+	}
+	var base = (client.ims in diff_json) ? client.ims : 'full';
+	if (!(base in frames)) {
+		frames[base] = make_stream_frame(diff_json[client.ims] || json, num_viewers);
+	}
+	client.ims = json.last_modified;
+	if (!client.response.write(frames[base])) {
+		client.congested = true;
+	}
+}
+
+var make_stream_frame = function(this_json, num_viewers) {
+	var header = {
+		date: new Date().toUTCString(),
+		last_modified: this_json.last_modified,
+		num_viewers: num_viewers,
+		minimum_version: MINIMUM_VERSION,
+	};
+
+	// Splice in the JSON as it is, instead of parsing it again. Line breaks
+	// can only be whitespace in JSON, and would end the event early.
+	var header_text = JSON.stringify(header);
+	var data = header_text.substr(0, header_text.length - 1) + ',"data":' +
+		this_json.plain.replace(/[\r\n]/g, ' ') + '}';
+	return Buffer.from('event: update\nid: ' + this_json.last_modified + '\ndata: ' + data + '\n\n');
+}
+
+var start_stream = function(request, response, ims, unique) {
+	response.writeHead(200, {
+		'Content-Type': 'text/event-stream',
+		'Cache-Control': 'no-cache',
+		'X-Accel-Buffering': 'no',
+	});
+
+	var client = {};
+	client.response = response;
+	client.request_id = request_id;
+	client.unique = unique;
+	client.ims = ims;
+	client.congested = false;
+	streaming_clients[request_id++] = client;
+
+	response.on('drain', function() {
+		client.congested = false;
+		if (json !== undefined) {
+			send_stream_update(client, {}, count_viewers());
+		}
+	});
+	response.on('close', function() {
+		mark_recently_seen(client.unique);
+		delete streaming_clients[client.request_id];
+	});
+
+	if (json !== undefined) {
+		send_stream_update(client, {}, count_viewers());
+	}
+}
+
 var mark_recently_seen = function(unique) {
 	if (unique) {
 		last_seen_clients[unique] = (new Date).getTime();
@@ -227,7 +439,8 @@ var mark_recently_seen = function(unique) {
 }
 var count_viewers = function() {
 	if (viewer_count_override !== undefined) {
-		return viewer_count_override;
+		// Streams only show up in the Varnish log once, when they start.
+		return viewer_count_override + Object.keys(streaming_clients).length;
 	}
 
 	var now = (new Date).getTime();
@@ -242,10 +455,20 @@ var count_viewers = function() {
 		}
 	}
 
-	// Also add sleeping clients that we would otherwise assume timed out.
+	// Also add sleeping and streaming clients that we would otherwise
+	// assume timed out.
+	var counted = {};
 	for (var request_id in sleeping_clients) {
 		var unique = sleeping_clients[request_id].unique;
-		if (unique && !(unique in new_last_seen_clients)) {
+		if (unique && !(unique in new_last_seen_clients) && !(unique in counted)) {
+			counted[unique] = true;
+			++num_viewers;
+		}
+	}
+	for (var request_id in streaming_clients) {
+		var unique = streaming_clients[request_id].unique;
+		if (unique && !(unique in new_last_seen_clients) && !(unique in counted)) {
+			counted[unique] = true;
 			++num_viewers;
 		}
 	}
@@ -257,11 +480,22 @@ var log = function(str) {
 	console.log("[" + ((new Date).getTime()*1e-3).toFixed(3) + "] " + str);
 }
 
+start_json_workers();
+
 // Set up a watcher to catch changes to the file, then do an initial read
 // to make sure we have a copy.
 fs.watch(path.dirname(json_filename), reread_file);
 reread_file(null, path.basename(json_filename));
 
+if (push_socket !== undefined) {
+	try {
+		fs.unlinkSync(push_socket);
+	} catch (err) {
+		// Didn't exist.
+	}
+	net.createServer(handle_push_connection).listen(push_socket);
+}
+
 if (COUNT_FROM_VARNISH_LOG) {
 	// Note: We abuse serve_url as a regex.
 	var varnishncsa = child_process.spawn(
@@ -334,7 +568,7 @@ server.on('request', function(request, response) {
 	log(request.url);
 	if (u.pathname === hash_serve_url) {
 		var fen = (u.query)['fen'];
-		hash_lookup.handle_request(fen, response);
+		hash_lookup.handle_request(fen, response, (u.query)['start'], (u.query)['pv']);
 		return;
 	}
 	if (u.pathname !== serve_url) {
@@ -345,18 +579,25 @@ server.on('request', function(request, response) {
 
 	mark_recently_seen(unique);
 
+	if ((u.query)['stream']) {
+		start_stream(request, response, ims, unique);
+		return;
+	}
+
 	var accept_encoding = request.headers['accept-encoding'];
-	var accept_gzip;
-	if (accept_encoding !== undefined && accept_encoding.match(/\bgzip\b/)) {
-		accept_gzip = true;
+	var encoding;
+	if (accept_encoding !== undefined && accept_encoding.match(/\bbr\b/)) {
+		encoding = 'br';
+	} else if (accept_encoding !== undefined && accept_encoding.match(/\bgzip\b/)) {
+		encoding = 'gzip';
 	} else {
-		accept_gzip = false;
+		encoding = undefined;
 	}
 
 	// If we already have something newer than what the user has,
 	// just send it out and be done with it.
 	if (json !== undefined && (!ims || json.last_modified > ims)) {
-		send_json(response, ims, accept_gzip, count_viewers());
+		send_json(response, ims, encoding, count_viewers());
 		return;
 	}
 
@@ -365,7 +606,7 @@ server.on('request', function(request, response) {
 	var client = {};
 	client.response = response;
 	client.request_id = request_id;
-	client.accept_gzip = accept_gzip;
+	client.encoding = encoding;
 	client.unique = unique;
 	client.ims = ims;
 	sleeping_clients[request_id++] = client;
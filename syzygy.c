@@ -0,0 +1,436 @@
+// Probes Syzygy tablebases for the DTZ-optimal line from a position, like
+// the fathom command-line tool does, but as a long-lived process: the
+// tables are opened (and memory-mapped by Fathom) only once, and answers
+// are cached. Build with
+//
+//   gcc -O2 -I$FATHOM/src -o syzygy syzygy.c $FATHOM/src/tbprobe.c
+//
+// where $FATHOM is a checkout of https://github.com/jdart1/Fathom.
+// To test, point --path to a directory with just a few of the 3-4 man
+// tables (e.g. KQvK.rtbw and KQvK.rtbz); anything else is "unknown".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tbprobe.h"
+
+#define BIT(sq) (1ULL << (sq))
+
+// Lines longer than this are given up on; no DTZ-optimal line in the
+// 7-man tables is anywhere near it.
+#define MAX_PLIES 1024
+
+// Squares are numbered as in Fathom, rank * 8 + file, with a1 = 0.
+struct tb_position {
+	uint64_t white, black;
+	uint64_t kings, queens, rooks, bishops, knights, pawns;
+	unsigned rule50;
+	unsigned ep;   // the en passant square, or 0 if an en passant capture isn't possible
+	bool white_to_move;
+};
+
+enum result { RESULT_UNKNOWN, RESULT_DRAW, RESULT_WHITE_WINS, RESULT_BLACK_WINS };
+static const char *result_names[] = { "unknown", "1/2-1/2", "1-0", "0-1" };
+
+// Whether the side to move has a pawn that could capture on <ep>.
+static bool can_capture_en_passant(const struct tb_position *pos, unsigned ep)
+{
+	uint64_t pawns = pos->pawns & (pos->white_to_move ? pos->white : pos->black);
+	unsigned file = ep % 8;
+	unsigned from_rank = pos->white_to_move ? 4 : 3;
+
+	if (ep / 8 != (pos->white_to_move ? 5u : 2u))
+		return false;
+	if (file > 0 && (pawns & BIT(from_rank * 8 + file - 1)))
+		return true;
+	if (file < 7 && (pawns & BIT(from_rank * 8 + file + 1)))
+		return true;
+	return false;
+}
+
+// Parses a FEN; the clocks are optional. Returns -1 if it is malformed.
+static int parse_fen(const char *fen, struct tb_position *pos, bool *can_castle)
+{
+	char board[128], toplay[8], castling[8], ep[8];
+	unsigned rule50 = 0;
+	int rank = 7, file = 0;
+	const char *ptr;
+
+	if (sscanf(fen, "%127s %7s %7s %7s %u", board, toplay, castling, ep, &rule50) < 4)
+		return -1;
+
+	memset(pos, 0, sizeof(*pos));
+	for (ptr = board; *ptr != '\0'; ++ptr) {
+		uint64_t bit;
+
+		if (*ptr == '/') {
+			if (file != 8 || rank == 0)
+				return -1;
+			--rank;
+			file = 0;
+			continue;
+		}
+		if (*ptr >= '1' && *ptr <= '8') {
+			file += *ptr - '0';
+			if (file > 8)
+				return -1;
+			continue;
+		}
+		if (file >= 8)
+			return -1;
+
+		bit = BIT(rank * 8 + file++);
+		switch (*ptr | 0x20) {
+		case 'k': pos->kings |= bit; break;
+		case 'q': pos->queens |= bit; break;
+		case 'r': pos->rooks |= bit; break;
+		case 'b': pos->bishops |= bit; break;
+		case 'n': pos->knights |= bit; break;
+		case 'p': pos->pawns |= bit; break;
+		default: return -1;
+		}
+		if (*ptr >= 'a')
+			pos->black |= bit;
+		else
+			pos->white |= bit;
+	}
+	if (rank != 0 || file != 8)
+		return -1;
+
+	if (strcmp(toplay, "w") == 0)
+		pos->white_to_move = true;
+	else if (strcmp(toplay, "b") == 0)
+		pos->white_to_move = false;
+	else
+		return -1;
+
+	*can_castle = (strcmp(castling, "-") != 0);
+
+	if (strcmp(ep, "-") != 0) {
+		unsigned sq;
+		if (ep[0] < 'a' || ep[0] > 'h' || ep[1] < '1' || ep[1] > '8' || ep[2] != '\0')
+			return -1;
+		sq = (ep[1] - '1') * 8 + (ep[0] - 'a');
+		if (can_capture_en_passant(pos, sq))
+			pos->ep = sq;
+	}
+
+	pos->rule50 = rule50;
+	return 0;
+}
+
+// Plays a move as given by tb_probe_root(). Castling doesn't happen
+// in tablebase positions.
+static void make_move(struct tb_position *pos, unsigned from, unsigned to, unsigned promotes)
+{
+	uint64_t from_bit = BIT(from), to_bit = BIT(to);
+	uint64_t *us = pos->white_to_move ? &pos->white : &pos->black;
+	uint64_t *them = pos->white_to_move ? &pos->black : &pos->white;
+	uint64_t *sets[] = { &pos->kings, &pos->queens, &pos->rooks, &pos->bishops, &pos->knights, &pos->pawns };
+	uint64_t *moving = NULL;
+	bool is_pawn = (pos->pawns & from_bit) != 0;
+	bool capture = (*them & to_bit) != 0;
+	unsigned i;
+
+	if (is_pawn && pos->ep != 0 && to == pos->ep) {
+		uint64_t victim = pos->white_to_move ? (to_bit >> 8) : (to_bit << 8);
+		*them &= ~victim;
+		pos->pawns &= ~victim;
+		capture = true;
+	}
+
+	for (i = 0; i < sizeof(sets) / sizeof(sets[0]); ++i) {
+		if (*sets[i] & from_bit)
+			moving = sets[i];
+		*sets[i] &= ~(from_bit | to_bit);
+	}
+	*them &= ~to_bit;
+	*us = (*us & ~from_bit) | to_bit;
+
+	switch (promotes) {
+	case TB_PROMOTES_QUEEN: moving = &pos->queens; break;
+	case TB_PROMOTES_ROOK: moving = &pos->rooks; break;
+	case TB_PROMOTES_BISHOP: moving = &pos->bishops; break;
+	case TB_PROMOTES_KNIGHT: moving = &pos->knights; break;
+	}
+	if (moving != NULL)
+		*moving |= to_bit;
+
+	pos->rule50 = (is_pawn || capture) ? 0 : pos->rule50 + 1;
+	pos->white_to_move = !pos->white_to_move;
+	pos->ep = 0;
+	if (is_pawn && (from ^ to) == 16 && can_capture_en_passant(pos, (from + to) / 2))
+		pos->ep = (from + to) / 2;
+}
+
+static unsigned probe_root(const struct tb_position *pos)
+{
+	return tb_probe_root(pos->white, pos->black, pos->kings, pos->queens, pos->rooks,
+		pos->bishops, pos->knights, pos->pawns, pos->rule50, 0, pos->ep,
+		pos->white_to_move, NULL);
+}
+
+// Cache of earlier answers, keyed on the position probed. Direct-mapped;
+// a new entry simply replaces whatever was in its slot.
+struct cache_entry {
+	bool used;
+	struct tb_position pos;
+	enum result result;
+	char *moves;
+};
+
+static struct cache_entry *cache;
+static size_t cache_size, cache_entries;
+static uint64_t cache_hits, cache_misses;
+
+static bool same_position(const struct tb_position *a, const struct tb_position *b)
+{
+	return a->white == b->white && a->black == b->black &&
+		a->kings == b->kings && a->queens == b->queens && a->rooks == b->rooks &&
+		a->bishops == b->bishops && a->knights == b->knights && a->pawns == b->pawns &&
+		a->rule50 == b->rule50 && a->ep == b->ep && a->white_to_move == b->white_to_move;
+}
+
+static struct cache_entry *cache_slot(const struct tb_position *pos)
+{
+	uint64_t h = pos->white * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ pos->black) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ pos->kings ^ (pos->queens << 1) ^ (pos->rooks << 2)) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ pos->bishops ^ (pos->knights << 1) ^ (pos->pawns << 2)) * 0x9e3779b97f4a7c15ULL;
+	h ^= pos->rule50 | (pos->ep << 8) | ((uint64_t)pos->white_to_move << 16);
+	h *= 0x9e3779b97f4a7c15ULL;
+	return &cache[(h >> 32) % cache_size];
+}
+
+static void cache_put(const struct tb_position *pos, enum result result, const char *moves)
+{
+	struct cache_entry *entry;
+
+	if (cache_size == 0)
+		return;
+	entry = cache_slot(pos);
+	if (entry->used)
+		free(entry->moves);
+	else
+		++cache_entries;
+	entry->used = true;
+	entry->pos = *pos;
+	entry->result = result;
+	entry->moves = strdup(moves);
+	if (entry->moves == NULL) {
+		entry->used = false;
+		--cache_entries;
+	}
+}
+
+// Finds the DTZ-optimal line from the given position, and stores the moves
+// (in UCI notation, space-separated) in <moves>, which must have room for
+// MAX_PLIES * 6 bytes. Returns the result; the line is only filled in for
+// wins. (A win that the 50-move rule turns into a draw counts as a draw.)
+static enum result probe_line(const struct tb_position *start, char *moves)
+{
+	// every position along the line, and where its moves start in <moves>,
+	// so that we can cache all of them
+	static struct tb_position positions[MAX_PLIES + 1];
+	static size_t offsets[MAX_PLIES + 1];
+	struct tb_position pos = *start;
+	enum result result = RESULT_UNKNOWN;
+	char *out = moves;
+	int ply;
+
+	*out = '\0';
+	if (cache_size != 0) {
+		struct cache_entry *entry = cache_slot(start);
+		if (entry->used && same_position(&entry->pos, start)) {
+			++cache_hits;
+			strcpy(moves, entry->moves);
+			return entry->result;
+		}
+		++cache_misses;
+	}
+
+	if ((unsigned)__builtin_popcountll(pos.white | pos.black) > TB_LARGEST)
+		return RESULT_UNKNOWN;
+
+	for (ply = 0; ; ++ply) {
+		unsigned res = probe_root(&pos), from, to;
+
+		positions[ply] = pos;
+		offsets[ply] = out - moves;
+		if (res == TB_RESULT_FAILED)
+			return RESULT_UNKNOWN;
+		if (res == TB_RESULT_CHECKMATE) {
+			if (ply == 0)
+				result = pos.white_to_move ? RESULT_BLACK_WINS : RESULT_WHITE_WINS;
+			break;
+		}
+		if (ply == 0) {
+			if (res == TB_RESULT_STALEMATE || (TB_GET_WDL(res) != TB_WIN && TB_GET_WDL(res) != TB_LOSS)) {
+				result = RESULT_DRAW;
+				break;
+			}
+			if ((TB_GET_WDL(res) == TB_WIN) == pos.white_to_move)
+				result = RESULT_WHITE_WINS;
+			else
+				result = RESULT_BLACK_WINS;
+		} else if (res == TB_RESULT_STALEMATE) {
+			// shouldn't happen on a DTZ-optimal line
+			return RESULT_UNKNOWN;
+		}
+		if (ply == MAX_PLIES)
+			return RESULT_UNKNOWN;
+
+		from = TB_GET_FROM(res);
+		to = TB_GET_TO(res);
+		if (out != moves) {
+			*out++ = ' ';
+			++offsets[ply];
+		}
+		out += sprintf(out, "%c%c%c%c", 'a' + from % 8, '1' + from / 8, 'a' + to % 8, '1' + to / 8);
+		if (TB_GET_PROMOTES(res) != TB_PROMOTES_NONE)
+			*out++ = " qrbn"[TB_GET_PROMOTES(res)];
+		*out = '\0';
+		make_move(&pos, from, to, TB_GET_PROMOTES(res));
+	}
+
+	// Every position along the line has the rest of it as its own
+	// DTZ-optimal line, so cache those, too. (Backwards, so that the
+	// position we were asked about wins any collisions.)
+	if (result == RESULT_DRAW) {
+		cache_put(start, result, "");
+	} else {
+		int i;
+		for (i = ply; i >= 0; --i)
+			cache_put(&positions[i], result, moves + offsets[i]);
+	}
+	return result;
+}
+
+// Probes one FEN and prints the line (if any). Returns the result,
+// or -1 if the FEN was malformed.
+static int probe_and_output(const char *fen)
+{
+	static char moves[MAX_PLIES * 6 + 1];
+	struct tb_position pos;
+	bool can_castle;
+	enum result result;
+
+	if (parse_fen(fen, &pos, &can_castle) == -1) {
+		fprintf(stderr, "Malformed FEN '%s'\n", fen);
+		return -1;
+	}
+	if (can_castle)
+		return RESULT_UNKNOWN;
+
+	result = probe_line(&pos, moves);
+	if (result == RESULT_WHITE_WINS || result == RESULT_BLACK_WINS)
+		printf("%s\n", moves);
+	return result;
+}
+
+// Server mode, so that the caller doesn't have to start a new process (and
+// open all the tables) for every probe. Reads one request per line, of
+// the form
+//
+//   <id> <fen>
+//
+// where <id> is an arbitrary token chosen by the client; the clocks in
+// the FEN are optional (the halfmove clock is taken to be zero if it is
+// missing). Requests can be sent without waiting for the answers to
+// earlier ones; they are answered in order. For a win, the response is
+// one line with the DTZ-optimal line in UCI notation (empty if the side
+// to move is already mated); in any case, it ends with
+//
+//   end <id> <result>
+//
+// where <result> is "1-0", "0-1", "1/2-1/2", "unknown" (the position
+// isn't in the tables we have, or castling is still possible) or "error".
+//
+// The request "<id> stats" instead gives a line
+//
+//   cache <hits> <misses> <entries> <capacity>
+//
+// followed by "end <id> ok".
+static void serve(FILE *in)
+{
+	char line[1024];
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char id[64];
+		const char *status;
+		int consumed = 0;
+
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%63s %n", id, &consumed) != 1)
+			continue;
+
+		if (strncmp(line + consumed, "stats", 5) == 0) {
+			printf("cache %llu %llu %zu %zu\n",
+				(unsigned long long)cache_hits, (unsigned long long)cache_misses,
+				cache_entries, cache_size);
+			status = "ok";
+		} else {
+			int ret = probe_and_output(line + consumed);
+			status = (ret == -1) ? "error" : result_names[ret];
+		}
+
+		printf("end %s %s\n", id, status);
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char *progname = argv[0];
+	char *path = NULL;
+	size_t size = 65536;
+
+	for ( ;; ) {
+		if (argc >= 3 && strcmp(argv[1], "--path") == 0) {
+			path = argv[2];
+		} else if (argc >= 3 && strcmp(argv[1], "--cache") == 0) {
+			size = strtoul(argv[2], NULL, 10);
+		} else {
+			break;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (path == NULL || argc != 2) {
+		fprintf(stderr, "Usage: %s --path DIR [--cache ENTRIES] FEN\n", progname);
+		fprintf(stderr, "       %s --path DIR [--cache ENTRIES] --server\n", progname);
+		fprintf(stderr, "\nDIR can have several directories, separated by colons.\n");
+		exit(1);
+	}
+
+	if (!tb_init(path)) {
+		fprintf(stderr, "%s: Could not initialize tablebases\n", path);
+		exit(1);
+	}
+	if (TB_LARGEST == 0)
+		fprintf(stderr, "%s: No tablebases found\n", path);
+
+	if (size != 0) {
+		cache = calloc(size, sizeof(*cache));
+		if (cache == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		cache_size = size;
+	}
+
+	if (strcmp(argv[1], "--server") == 0) {
+		serve(stdin);
+	} else {
+		int ret = probe_and_output(argv[1]);
+		if (ret == -1)
+			exit(1);
+		printf("%s\n", result_names[ret]);
+	}
+	tb_free();
+	exit(0);
+}
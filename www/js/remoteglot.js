@@ -198,6 +198,25 @@ var current_display_move = null;
  */
 var current_analysis_xhr = null;
 
+/**
+ * The current stream of main analysis updates from the backend, if any,
+ * so that we can close it. Used instead of current_analysis_xhr where
+ * the browser supports it.
+ *
+ * @type {?EventSource}
+ * @private
+ */
+var current_analysis_stream = null;
+
+/**
+ * Whether streaming has failed before we got anything through it
+ * (e.g. because of a proxy), so that we should stick to long-polling.
+ *
+ * @type {boolean}
+ * @private
+ */
+var streaming_failed = false;
+
 /**
  * The current timer to fire off a request to get main analysis (not history),
  * if any, so that we can abort it.
@@ -232,6 +251,15 @@ var current_hash_xhr = null;
  */
 var current_hash_display_timer = null;
 
+/**
+ * The line we last asked the backend to prefetch hash probes along,
+ * so that we only need to ask once per line.
+ *
+ * @type {?Object}
+ * @private
+ */
+var hash_prefetched_line = null;
+
 var supports_html5_storage = function() {
 	try {
 		return 'localStorage' in window && window['localStorage'] !== null;
@@ -257,30 +285,19 @@ var get_unique = function() {
 var request_update = function() {
 	current_analysis_request_timer = null;
 
+	if (window['EventSource'] && !streaming_failed) {
+		request_update_stream();
+		return;
+	}
+
 	current_analysis_xhr = $.ajax({
 		url: backend_url + "?ims=" + ims + "&unique=" + unique
 	}).done(function(data, textstatus, xhr) {
-		sync_server_clock(xhr.getResponseHeader('Date'));
-		ims = xhr.getResponseHeader('X-RGLM');
-		var num_viewers = xhr.getResponseHeader('X-RGNV');
-		var new_data;
-		if (Array.isArray(data)) {
-			new_data = JSON.parse(JSON.stringify(current_analysis_data));
-			JSON_delta.patch(new_data, data);
-		} else {
-			new_data = data;
-		}
-
-		var minimum_version = xhr.getResponseHeader('X-RGMV');
-		if (minimum_version && minimum_version > SCRIPT_VERSION) {
-			// Upgrade to latest version with a force-reload.
-			location.reload(true);
-		}
-
-		possibly_play_sound(current_analysis_data, new_data);
-		current_analysis_data = new_data;
-		update_board();
-		update_num_viewers(num_viewers);
+		process_update(data,
+		               xhr.getResponseHeader('Date'),
+		               xhr.getResponseHeader('X-RGLM'),
+		               xhr.getResponseHeader('X-RGNV'),
+		               xhr.getResponseHeader('X-RGMV'));
 
 		// Next update.
 		current_analysis_request_timer = setTimeout(function() { request_update(); }, 100);
@@ -295,6 +312,59 @@ var request_update = function() {
 	});
 }
 
+/**
+ * Like request_update(), but keeps the connection open and gets every
+ * new update (usually a delta) pushed as a server-sent event.
+ */
+var request_update_stream = function() {
+	var got_update = false;
+	var stream = new EventSource(backend_url + "?stream=1&ims=" + ims + "&unique=" + unique);
+	stream.addEventListener('update', function(event) {
+		got_update = true;
+		var msg = JSON.parse(event.data);
+		process_update(msg['data'], msg['date'], msg['last_modified'], msg['num_viewers'], msg['minimum_version']);
+	});
+	stream.onerror = function() {
+		// Don't let the browser reconnect on its own; it would ask for
+		// the version we had when we started.
+		stream.close();
+		current_analysis_stream = null;
+		if (!got_update) {
+			streaming_failed = true;
+			request_update();
+		} else {
+			current_analysis_request_timer = setTimeout(function() { request_update(); }, 1000);
+		}
+	};
+	current_analysis_stream = stream;
+}
+
+/**
+ * Handles a new version of the analysis from the backend (either the full
+ * JSON, or a delta from the one we have), however we got it.
+ */
+var process_update = function(data, date, last_modified, num_viewers, minimum_version) {
+	sync_server_clock(date);
+	ims = last_modified;
+	var new_data;
+	if (Array.isArray(data)) {
+		new_data = JSON.parse(JSON.stringify(current_analysis_data));
+		JSON_delta.patch(new_data, data);
+	} else {
+		new_data = data;
+	}
+
+	if (minimum_version && minimum_version > SCRIPT_VERSION) {
+		// Upgrade to latest version with a force-reload.
+		location.reload(true);
+	}
+
+	possibly_play_sound(current_analysis_data, new_data);
+	current_analysis_data = new_data;
+	update_board();
+	update_num_viewers(num_viewers);
+}
+
 var possibly_play_sound = function(old_data, new_data) {
 	if (!enable_sound) {
 		return;
@@ -1732,7 +1802,7 @@ var update_displayed_line = function() {
 	if (display_fen !== hiddenboard.fen() && !current_display_line_is_history) {
 		// Fire off a hash request, since we're now off the main position
 		// and it just changed.
-		explore_hash(hiddenboard.fen());
+		explore_hash(hiddenboard.fen(), current_display_line);
 	}
 	display_fen = hiddenboard.fen();
 	update_imbalance(hiddenboard.fen());
@@ -1773,10 +1843,13 @@ var set_sound = function(param_enable_sound) {
 }
 window['set_sound'] = set_sound;
 
-/** Send off a hash probe request to the backend.
+/** Send off a hash probe request to the backend. The first time we look
+ * at a given line, also have the backend probe all the positions along it
+ * at once, so that stepping through it is quick.
  * @param {string} fen
+ * @param {?Object} line
  */
-var explore_hash = function(fen) {
+var explore_hash = function(fen, line) {
 	// If we already have a backend response going, abort it.
 	if (current_hash_xhr) {
 		current_hash_xhr.abort();
@@ -1786,8 +1859,16 @@ var explore_hash = function(fen) {
 		current_hash_display_timer = null;
 	}
 	$("#refutationlines").empty();
+	var url = backend_hash_url + "?fen=" + fen;
+	if (line && line !== hash_prefetched_line) {
+		if (line.start_fen !== null) {
+			url += "&start=" + encodeURIComponent(line.start_fen);
+		}
+		url += "&pv=" + encodeURIComponent(line.pv.join(','));
+		hash_prefetched_line = line;
+	}
 	current_hash_xhr = $.ajax({
-		url: backend_hash_url + "?fen=" + fen
+		url: url
 	}).done(function(data, textstatus, xhr) {
 		show_explore_hash_results(data, fen);
 	});
@@ -2115,6 +2196,10 @@ var switch_backend = function(game) {
 	if (current_analysis_xhr) {
 		current_analysis_xhr.abort();
 	}
+	if (current_analysis_stream) {
+		current_analysis_stream.close();
+		current_analysis_stream = null;
+	}
 	if (current_hash_xhr) {
 		current_hash_xhr.abort();
 	}